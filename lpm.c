@@ -4,7 +4,7 @@
  * Longest prefix matching implementation file.
  *
  * ATTENTION:
- *      1. b-trie equals to 1-trie.
+ *      1. b-trie equals to 1-trie, it is path-compressed (Patricia), node keeps its own prefix.
  *      2. m-trie block has 256 m-trie entry (aka. node) while stride is 8.
  *      3. While compare two valid prefix, the "more specific" prefix refers to the one who 
  *         has longer mask length, and the "less specific" prefix has shorter mask length.
@@ -17,984 +17,896 @@
 #include <string.h>
 #include <assert.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "lpm.h"
 #include "lpm_internal.h"
 
+#if LPM_PERF_EVENT
+#include <linux/perf_event.h>
+#endif
+
 /*******************************
- * B-trie rel. codes
+ * Slab rel. codes
  */
-static btrie_node_t *btrie_mem_alloc(struct lpm_lkup_table_stat *stat)
+static void lpm_slab_init(lpm_slab_t *slab, u32 obj_size, u32 obj_per_slab, u32 flags)
 {
-    btrie_node_t *ret;
+    size_t size;
 
-    assert(stat != NULL);
-    
-    ret = malloc(sizeof(btrie_node_t));
-    
-#if LPM_DEBUG_ALLOC_FAIL
-    if (!lpm_mem_success(64)) {
-        free(ret);
-        ret = NULL;
+    assert(slab != NULL);
+    assert(obj_size >= sizeof(void *));
+    assert(obj_per_slab > 0);
+
+    memset(slab, 0, sizeof(lpm_slab_t));
+    /* keep every object pointer aligned, no per object overhead like malloc */
+    slab->obj_size = (obj_size + sizeof(void *) - 1) & (~(sizeof(void *) - 1));
+    if (flags & LPM_SLAB_COLOR) {
+        /*
+         * Object is cache line aligned and one more cache line is padded, so every object
+         * starts one cache line further than the former one modulo page size. Objects of page
+         * size multiple do not map to the same cache sets any more.
+         */
+        slab->obj_size = (obj_size + LPM_CACHE_LINE - 1) & (~(LPM_CACHE_LINE - 1));
+        slab->obj_size += LPM_CACHE_LINE;
     }
-#endif
+    slab->flags = flags;
+    slab->numa_node = -1;
 
-    if (ret != NULL) {
-        /* zero out needed */
-        memset(ret, 0, sizeof(btrie_node_t));
-        stat->btrie_node_alloc_stat++;
+    if (flags & LPM_SLAB_HUGEPAGE_1G) {
+        slab->slab_size = LPM_HUGEPAGE_1G_SIZE;
+    } else if (flags & LPM_SLAB_HUGEPAGE) {
+        slab->slab_size = LPM_HUGEPAGE_SIZE;
     } else {
-        stat->btrie_node_alloc_fail_stat++;
+        /* Round down to power of 2, but hold one object at least */
+        size = sizeof(lpm_slab_hdr_t) + ((size_t)slab->obj_size) * obj_per_slab;
+        for (slab->slab_size = LPM_CACHE_LINE; slab->slab_size * 2 <= size; slab->slab_size *= 2) {
+            ;
+        }
+        if (slab->slab_size < sizeof(lpm_slab_hdr_t) + slab->obj_size) {
+            slab->slab_size *= 2;
+        }
     }
-    
-    return ret;
+    /* Slab holds as many objects as it can */
+    slab->obj_per_slab = (slab->slab_size - sizeof(lpm_slab_hdr_t)) / slab->obj_size;
 }
 
-static void btrie_mem_free(struct lpm_lkup_table_stat *stat, btrie_node_t *p)
+/* Map size bytes aligned to align, by mapping more and unmapping the unaligned head and tail */
+static void *lpm_slab_mmap_aligned(size_t size, size_t align)
 {
-    assert(stat != NULL);
+    u8 *raw, *aligned;
 
-    if (p != NULL) {
-        assert(stat->btrie_node_alloc_stat > 0);
-        free(p);
-        stat->btrie_node_alloc_stat--;
+    raw = mmap(NULL, size + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
     }
-}
-
-static btrie_node_t *btrie_alloc_node(lpm_lkup_table_t *table)
-{
-    btrie_node_t *ret = NULL;
-
-    assert(table != NULL);
-
-    ret = btrie_mem_alloc(&table->stat);
-
-    return ret;
-}
-
-static void btrie_free_node(lpm_lkup_table_t *table, btrie_node_t *p)
-{
-    assert(table != NULL);
+    aligned = (u8 *)((((unsigned long)raw) + align - 1) & (~(align - 1)));
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + size, (raw + align) - aligned);
 
-    btrie_mem_free(&table->stat, p);
+    return aligned;
 }
 
-/* find addr/masklen corresponding 1-trie node, will not add new node when don't find */
-static btrie_node_t *btrie_find_node(btrie_node_t *root, u8 *addr, u32 masklen)
+/*
+ * Map one huge page slab, try hugetlbfs pages first, then fall back to transparent huge pages
+ * on a normal mapping which is aligned to huge page boundary.
+ */
+static void *lpm_slab_mmap_huge(lpm_slab_t *slab)
 {
-    int pos;
-    u8 bit;
-    btrie_node_t *node;
+    void *p;
+    size_t align = LPM_HUGEPAGE_SIZE;
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    if (slab->flags & LPM_SLAB_HUGEPAGE_1G) {
+        p = mmap(NULL, slab->slab_size, prot, flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if (p != MAP_FAILED) {
+            slab->huge_cnt++;
+            return p;
+        }
+        align = LPM_HUGEPAGE_1G_SIZE;
+    }
 
-    if (masklen > 0) {
-        assert(addr != NULL);
+    if (slab->slab_size % LPM_HUGEPAGE_SIZE == 0) {
+        p = mmap(NULL, slab->slab_size, prot, flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+        if (p != MAP_FAILED) {
+            slab->huge_cnt++;
+            return p;
+        }
     }
 
-    for (node = root, pos = 0; pos < masklen && node != NULL; pos++) {
-        bit = bit_at_position(addr, pos);
-        node = node->child[bit];
+    p = lpm_slab_mmap_aligned(slab->slab_size, align);
+    if (p == NULL) {
+        return NULL;
     }
+#ifdef MADV_HUGEPAGE
+    (void)madvise(p, slab->slab_size, MADV_HUGEPAGE);
+#endif
 
-    return node;
+    return p;
 }
 
-/* accurately find */
-static void *btrie_find_data(btrie_node_t *root, u8 *addr, u32 masklen)
+/* Bind slab's pages to slab's NUMA node, before any page is touched */
+static void lpm_slab_bind_node(lpm_slab_t *slab, void *p)
 {
-    btrie_node_t *node;
+    unsigned long nodemask;
 
-    node = btrie_find_node(root, addr, masklen);
-    
-    if (node != NULL) {
-        return node->data;
+    nodemask = 0x1UL << slab->numa_node;
+    if (syscall(SYS_mbind, p, slab->slab_size, LPM_MPOL_BIND, &nodemask,
+                sizeof(nodemask) * 8, 0) != 0) {
+        /* Not fatal, memory is still usable although it is not local */
+        lpm_con_print("%s bind slab to NUMA node %d failed\n", __func__, slab->numa_node);
     }
-
-    return NULL;
 }
 
 /*
- * Return LPM_ERR_EXISTS while find corresponding node success, ATTENTION it's not an failure.
- * Add new node while not find corresponding node, and return LPM_SUCCESS.
- * Any failure will lead to return LPM_ERR_XXX.
- * It will not operate data.
+ * Slab bound to NUMA node is mapped and bound before any page is touched, so all its pages
+ * come from that node.
  */
-static lpm_result_t btrie_add_node(lpm_lkup_table_t *table,
-                                   u8 *addr,
-                                   u32 masklen,
-                                   btrie_node_t **newnode,
-                                   btrie_node_t **append_point,
-                                   u8 *append_bit)
+static void *lpm_slab_mmap_node(lpm_slab_t *slab)
 {
-    lpm_result_t ret = LPM_ERR_EXISTS;              /* node is existing by default */
-    int pos;
-    u8 bit;
-    btrie_node_t *place;
+    void *p;
 
-    assert(newnode != NULL);
-    assert(append_point != NULL);
-    assert(table != NULL);
-    assert(table->hi256_table_base != NULL);
-    
-    if (masklen > 0) {
-        assert(addr != NULL);
-        *append_point = table->btrie_root;
-        *append_bit = bit_at_position(addr, 0);
+    if (slab->flags & (LPM_SLAB_HUGEPAGE | LPM_SLAB_HUGEPAGE_1G)) {
+        p = lpm_slab_mmap_huge(slab);
+    } else {
+        p = lpm_slab_mmap_aligned(slab->slab_size, slab->slab_size);
     }
-
-    place = table->btrie_root;                      /* from the root of 1-trie */
-    pos = 0;
-
-    while (pos < masklen) {
-        bit = bit_at_position(addr, pos);
-        if (place->child[bit] == NULL) {
-            place->child[bit] = btrie_alloc_node(table);
-            if (place->child[bit] == NULL) {        /* Resources failed */
-                lpm_debug_mem(table, "btrie node [%d Bytes] alloc failed\n", sizeof(btrie_node_t));
-                return LPM_ERR_RESOURCES;
-            }
-            ret = LPM_SUCCESS;                      /* node new allocated */
-        } else {
-            *append_point = place->child[bit];
-            *append_bit = bit_at_position(addr, (pos + 1));
-        }
-        place = place->child[bit];
-        pos++;
+    if (p == NULL) {
+        return NULL;
     }
+    lpm_slab_bind_node(slab, p);
 
-    *newnode = place;
-
-    return ret;
+    return p;
 }
 
 /*
- * Releasing the allocated 1-trie nodes when failure takes place 
- * within add entry in 1-trie or M-trie.
+ * Reserve region of size bytes aligned to align, pages are not populated until written.
+ * Region is private memory for fd -1, or shared memory object fd mapped with prot.
  */
-static void btrie_del_appended(lpm_lkup_table_t *table, btrie_node_t *node)
+static lpm_result_t lpm_region_init(lpm_region_t *region, size_t size, size_t align, int fd, int prot)
 {
-    btrie_node_t *curr, *next;
-
-    for (curr = node, next = NULL; curr != NULL; curr = next) {
-        if (curr->child[0] != NULL && curr->child[1] != NULL) {
-            /* XXX BUG */
-            lpm_debug_alg(table, "*BUG* Appended btrie nodes can not have two children\n");
-            lpm_con_print("*BUG* Appended btrie nodes can not have two children\n");
-            assert(0);  /* XXX suicide */
-        } else if (curr->child[0] != NULL) {
-            next = curr->child[0];
-        } else {
-            next = curr->child[1];
-        }
+    u8 *raw, *aligned;
 
-        lpm_debug_norm(table, "\t\tfree one temporary btrie node...\n");
-        btrie_free_node(table, curr);
+    raw = mmap(NULL, size + align, (fd < 0) ? (PROT_READ | PROT_WRITE) : PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        return LPM_ERR_RESOURCES;
+    }
+    aligned = (u8 *)((((unsigned long)raw) + align - 1) & (~(align - 1)));
+    if (fd >= 0 && mmap(aligned, size, prot, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(raw, size + align);
+        return LPM_ERR_RESOURCES;
     }
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    munmap(aligned + size, (raw + align) - aligned);
+
+    region->base = aligned;
+    region->size = size;
+    region->shared = (fd >= 0);
+    /* Offset 0 is never a block, so block index 0 stands for no block */
+    region->used = LPM_CACHE_LINE;
+
+    return LPM_SUCCESS;
 }
 
-static void __btrie_destroy_subtree(lpm_lkup_table_t *table, btrie_node_t *node, u32 *recur_times)
+static void lpm_region_destroy(lpm_region_t *region)
 {
-#if LPM_DEBUG_RECURSION
-    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
-        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
+    if (region->base != NULL) {
+        munmap(region->base, region->size);
     }
-    *recur_times = *recur_times + 1;
-#endif
+    memset(region, 0, sizeof(lpm_region_t));
+}
 
-    if (node == NULL) {
-        return;
+/*
+ * Give pages of region back. Pages of shared memory object are punched out of it, as
+ * MADV_DONTNEED drops them from this mapping only and the object keeps them.
+ */
+static void lpm_region_release(lpm_region_t *region, void *p, size_t len)
+{
+    if (region->shared) {
+#ifdef MADV_REMOVE
+        (void)madvise(p, len, MADV_REMOVE);
+#endif
+    } else {
+        (void)madvise(p, len, MADV_DONTNEED);
     }
+}
 
-    __btrie_destroy_subtree(table, node->child[0], recur_times);
-    
-#if LPM_DEBUG_RECURSION
-    *recur_times = *recur_times - 1;
-#endif
+/* Carve slab from region, slab is aligned to its size as region is aligned to the largest slab */
+static void *lpm_slab_region_get(lpm_slab_t *slab)
+{
+    lpm_region_t *region = slab->region;
+    size_t off;
+    u8 *p;
 
-    __btrie_destroy_subtree(table, node->child[1], recur_times);
+    off = (region->used + slab->slab_size - 1) & (~(slab->slab_size - 1));
+    if (off + slab->slab_size > region->size) {
+        return NULL;
+    }
+    region->used = off + slab->slab_size;
+    p = region->base + off;
 
-#if LPM_DEBUG_RECURSION
-    *recur_times = *recur_times - 1;
+#ifdef MADV_HUGEPAGE
+    if (slab->flags & (LPM_SLAB_HUGEPAGE | LPM_SLAB_HUGEPAGE_1G)) {
+        (void)madvise(p, slab->slab_size, MADV_HUGEPAGE);
+    }
 #endif
+    if (slab->numa_node >= 0) {
+        lpm_slab_bind_node(slab, p);
+    }
 
-    btrie_free_node(table, node);
+    return p;
 }
 
-static void btrie_destroy_subtree(lpm_lkup_table_t *table, btrie_node_t *node)
+/* User allocator, NULL for built-in one */
+static inline lpm_allocator_t *lpm_slab_allocator(lpm_slab_t *slab)
 {
-    u32 recur_times = 0;
-    
-    __btrie_destroy_subtree(table, node, &recur_times);
+    if (slab->allocator != NULL && slab->allocator->alloc != NULL) {
+        return slab->allocator;
+    }
+
+    return NULL;
 }
 
-static lpm_result_t __btrie_dfs_walk(btrie_node_t *node,
-                                     u8 *addr,
-                                     u32 bitpos,
-                                     lpm_data_walker_func_t walker,
-                                     u32 *recur_times)
+static lpm_slab_hdr_t *lpm_slab_mem_get(lpm_slab_t *slab)
 {
-    lpm_result_t ret;
+    lpm_allocator_t *allocator = lpm_slab_allocator(slab);
+    void *p;
 
-#if LPM_DEBUG_RECURSION
-    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
-        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
+    /* Slab is aligned to its size, see lpm_slab_hdr() */
+    if (slab->region != NULL) {
+        return lpm_slab_region_get(slab);
     }
-    *recur_times = *recur_times + 1;
-#endif
-    
-    if (node->data != NULL) {
-        if ((*walker)(addr, bitpos, node->data) != 0) {
-            /* Error is from walker, not from LPM */
-            return LPM_ERR_EXOTIC;
-        }
+    if (allocator != NULL) {
+        /* NUMA option is hint for user allocator */
+        return allocator->alloc(allocator->ctx, slab->slab_size, slab->slab_size, slab->numa_node);
     }
 
-    /* Traverse left sub-tree */
-    if (node->child[0] != NULL) {
-        CLEAR_BIT_AT_POSITION(addr, bitpos);
-
-        ret = __btrie_dfs_walk(node->child[0], addr, bitpos + 1, walker, recur_times);
-
-#if LPM_DEBUG_RECURSION
-        *recur_times = *recur_times - 1;
-#endif
+    if (slab->numa_node >= 0) {
+        return lpm_slab_mmap_node(slab);
+    }
+    if (slab->flags & (LPM_SLAB_HUGEPAGE | LPM_SLAB_HUGEPAGE_1G)) {
+        return lpm_slab_mmap_huge(slab);
+    }
 
-        if (ret != LPM_SUCCESS) {
-            return ret;
-        }
+    if (posix_memalign(&p, slab->slab_size, slab->slab_size) != 0) {
+        return NULL;
     }
 
-    /* Traverse right sub-tree */
-    if (node->child[1] != NULL) {
-        SET_BIT_AT_POSITION(addr, bitpos);
+    return p;
+}
 
-        ret = __btrie_dfs_walk(node->child[1], addr, bitpos + 1, walker, recur_times);
+static void lpm_slab_mem_put(lpm_slab_t *slab, lpm_slab_hdr_t *hdr)
+{
+    lpm_allocator_t *allocator = lpm_slab_allocator(slab);
 
+    if (slab->region != NULL) {
         /*
-         * XXX: addr is changed due to SET_BIT_AT_POSITION, recover its value and prepare for
-         *      next recursion. eg. 128.0.0.0/2 and 80.0.0.0/4
+         * Region is released as a whole, give pages back only. Shared region is kept for
+         * reader processes still attached, it is gone when they are all detached.
          */
-        CLEAR_BIT_AT_POSITION(addr, bitpos);
+        if (!slab->region->shared) {
+            lpm_region_release(slab->region, hdr, slab->slab_size);
+        }
+    } else if (allocator != NULL) {
+        allocator->free(allocator->ctx, hdr, slab->slab_size);
+    } else if ((slab->numa_node >= 0) || (slab->flags & (LPM_SLAB_HUGEPAGE | LPM_SLAB_HUGEPAGE_1G))) {
+        munmap(hdr, slab->slab_size);
+    } else {
+        free(hdr);
+    }
+}
 
-#if LPM_DEBUG_RECURSION
-        *recur_times = *recur_times - 1;
+/*
+ * Get one more slab and append it to slab list, it is carved after all former slabs.
+ * It is the only place where slab allocator gets memory, and the only place which fails.
+ */
+static lpm_slab_hdr_t *lpm_slab_grow(lpm_slab_t *slab)
+{
+    lpm_slab_hdr_t *hdr;
+
+    if (slab->flags & LPM_SLAB_FIXED) {
+        return NULL;
+    }
+    if (slab->budget != NULL && slab->budget->limit != 0 &&
+        slab->budget->used + slab->slab_size > slab->budget->limit) {
+        return NULL;
+    }
+
+#if LPM_DEBUG_ALLOC_FAIL
+    if (!lpm_mem_success(4)) {
+        return NULL;
+    }
 #endif
 
-        if (ret != LPM_SUCCESS) {
-            return ret;
-        }
+    hdr = lpm_slab_mem_get(slab);
+    if (hdr == NULL) {
+        return NULL;
+    }
+    if (slab->budget != NULL) {
+        slab->budget->used += slab->slab_size;
     }
 
-    return LPM_SUCCESS;
+    hdr->next = NULL;
+    if (slab->slab_tail != NULL) {
+        slab->slab_tail->next = hdr;
+    } else {
+        slab->slab_list = hdr;
+    }
+    slab->slab_tail = hdr;
+    slab->slab_cnt++;
+
+    return hdr;
 }
 
-static lpm_result_t btrie_dfs_walk(btrie_node_t *root, lpm_data_walker_func_t walker)
+/* Header of slab which object is carved from */
+static inline lpm_slab_hdr_t *lpm_slab_hdr(lpm_slab_t *slab, void *obj)
 {
-    int ret = LPM_SUCCESS;
-    u8 addr[LPM_LEVEL_MAX];
-    u32 prefix_len;
-    u32 recur_times = 0;    /* Recursion depth check */
-
-    memset(&addr, 0, sizeof(addr));
-    prefix_len = 0;
-    
-    ret = __btrie_dfs_walk(root, addr, prefix_len, walker, &recur_times);
+    return (lpm_slab_hdr_t *)(((unsigned long)obj) & (~(slab->slab_size - 1)));
+}
 
-    return ret;
+/* Objects quantity which can be allocated without getting more memory */
+static size_t lpm_slab_avail(lpm_slab_t *slab)
+{
+    return slab->free_cnt + ((size_t)(slab->slab_end - slab->next_obj)) / slab->obj_size +
+           ((size_t)(slab->slab_cnt - slab->slab_used)) * slab->obj_per_slab;
 }
 
-static lpm_result_t btrie_init(lpm_lkup_table_t *table)
+/* Make sure the coming cnt allocations never fail */
+static lpm_result_t lpm_slab_reserve(lpm_slab_t *slab, size_t cnt)
 {
-    if (table == NULL) {
-        return LPM_ERR_INVALID;
-    }
-    
-    if (table->btrie_root != NULL) {
-        lpm_debug_norm(table, "B-trie already exists\n");
-        return LPM_ERR_EXISTS;
-    }
+    assert(slab != NULL);
 
-    table->btrie_root = btrie_alloc_node(table);
-    if (table->btrie_root == NULL) {
-        lpm_debug_mem(table, "B-trie root node [%d Bytes] alloc failed\n", sizeof(btrie_node_t));
-        return LPM_ERR_RESOURCES;
+    while (lpm_slab_avail(slab) < cnt) {
+        if (lpm_slab_grow(slab) == NULL) {
+            return LPM_ERR_RESOURCES;
+        }
     }
-    
-    lpm_debug_norm(table, "B-trie initialized\n");
 
     return LPM_SUCCESS;
 }
 
-static void btrie_destroy(lpm_lkup_table_t *table)
+/* Carve one never used object, objects carved one by one are contiguous in slab */
+static void *lpm_slab_carve(lpm_slab_t *slab)
 {
-    if (table == NULL) {
-        return;
+    lpm_slab_hdr_t *hdr;
+    void *ret;
+
+    assert(slab != NULL);
+
+    /* Current slab is used up, move to next slab kept by reset or reserve, or get a new one */
+    if (slab->next_obj == slab->slab_end) {
+        hdr = (slab->slab_cur != NULL) ? slab->slab_cur->next : slab->slab_list;
+        if (hdr == NULL) {
+            hdr = lpm_slab_grow(slab);
+            if (hdr == NULL) {
+                return NULL;
+            }
+        }
+        slab->slab_cur = hdr;
+        slab->slab_used++;
+        hdr->live = 0;
+        slab->next_obj = (u8 *)(hdr + 1);
+        slab->slab_end = slab->next_obj + ((size_t)slab->obj_size) * slab->obj_per_slab;
     }
 
-    btrie_destroy_subtree(table, table->btrie_root);
-    
-    table->btrie_root = NULL;
+    ret = slab->next_obj;
+    slab->next_obj += slab->obj_size;
+    slab->slab_cur->live++;
 
-    lpm_debug_norm(table, "B-trie is destroyed\n");
+    return ret;
 }
 
-/*******************************
- * M-trie rel. codes
- */
-#define MTRIE_BLOCK_ENTRY   (0x1 << LPM_STRIDE)         /* for 8-stride */
-#define MTRIE_BLOCK_ALLOC_SIZE ((sizeof(mtrie_node_t)) * MTRIE_BLOCK_ENTRY)
-
-static mtrie_node_t *mtrie_mem_alloc(struct lpm_lkup_table_stat *stat)
+static void *lpm_slab_alloc(lpm_slab_t *slab)
 {
-    mtrie_node_t *ret;
+    void *ret;
 
-    assert(stat != NULL);
+    assert(slab != NULL);
 
-    ret = malloc(MTRIE_BLOCK_ALLOC_SIZE);
-    
-#if LPM_DEBUG_ALLOC_FAIL
-    if (!lpm_mem_success(8)) {
-        free(ret);
-        ret = NULL;
+    /* Fast path, pop one released object */
+    if (slab->free_list != NULL) {
+        ret = slab->free_list;
+        slab->free_list = *((void **)ret);
+        slab->free_cnt--;
+        lpm_slab_hdr(slab, ret)->live++;
+        return ret;
     }
-#endif
 
-    if (ret != NULL) {
-        memset(ret, 0, MTRIE_BLOCK_ALLOC_SIZE);
-        stat->mtrie_block_alloc_stat++;
-    } else {
-        stat->mtrie_block_alloc_fail_stat++;
-    }
-    
-    return ret;
+    return lpm_slab_carve(slab);
 }
 
-static void mtrie_mem_free(struct lpm_lkup_table_stat *stat, mtrie_node_t *p)
+static void lpm_slab_free(lpm_slab_t *slab, void *obj)
 {
-    assert(stat != NULL);
-
-    if (p != NULL) {
-        assert(stat->mtrie_block_alloc_stat > 0);
-        free(p);
-        stat->mtrie_block_alloc_stat--;
-    }
+    assert(slab != NULL);
+    assert(obj != NULL);
+    assert(lpm_slab_hdr(slab, obj)->live > 0);
+
+    *((void **)obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->free_cnt++;
+    lpm_slab_hdr(slab, obj)->live--;
 }
 
-static mtrie_node_t *mtrie_alloc_block(lpm_lkup_table_t *table)
+/*
+ * Recycle carved slabs without live object as never used slabs, their objects are dropped
+ * from free list and they are moved to the tail of slab list, so they are carved again after
+ * all slabs in use. Pages of region slab are given back but the one of its header, lookups
+ * in progress read zeroed entries from a freed block then, which is no block and no data.
+ * Return slabs quantity recycled.
+ */
+static u32 lpm_slab_recycle(lpm_slab_t *slab)
 {
-    mtrie_node_t *base = NULL;
+    lpm_slab_hdr_t *hdr, **link, *empty = NULL, *empty_tail = NULL;
+    void *obj, *next, *free_list = NULL;
+    u32 cnt = 0;
 
-    assert(table != NULL);
+    assert(slab != NULL);
 
-    base = mtrie_mem_alloc(&table->stat);
-    if (base == NULL) {
-        lpm_debug_mem(table, "Mtrie block [%d Bytes] allocate failed\n", MTRIE_BLOCK_ALLOC_SIZE);
+    if (slab->slab_cur == NULL) {
+        return 0;
     }
-    
-    return base;
-}
-
-static void __mtrie_free_block(lpm_lkup_table_t *table, mtrie_node_t *base, u32 *recur_times)
-{
-    int i;
-    mtrie_node_t *entry;
-
-    assert(table != NULL);
-    
-#if LPM_DEBUG_RECURSION
-    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
-        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
-    }
-    *recur_times = *recur_times + 1;
-#endif
 
-    if (base == NULL) {
-        return;
+    /* Current slab is never recycled, it is carving */
+    slab->free_cnt = 0;
+    for (obj = slab->free_list; obj != NULL; obj = next) {
+        next = *((void **)obj);
+        hdr = lpm_slab_hdr(slab, obj);
+        if (hdr->live == 0 && hdr != slab->slab_cur) {
+            continue;
+        }
+        *((void **)obj) = free_list;
+        free_list = obj;
+        slab->free_cnt++;
     }
+    slab->free_list = free_list;
+
+    /* Slabs before current slab are carved up */
+    for (link = &slab->slab_list; *link != slab->slab_cur; ) {
+        hdr = *link;
+        if (hdr->live != 0) {
+            link = &hdr->next;
+            continue;
+        }
+        *link = hdr->next;
+        hdr->next = NULL;
+        if (empty_tail != NULL) {
+            empty_tail->next = hdr;
+        } else {
+            empty = hdr;
+        }
+        empty_tail = hdr;
+        slab->slab_used--;
+        cnt++;
 
-    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
-        entry = (mtrie_node_t *)(base + i);
-        if (entry->base != NULL) {
-            __mtrie_free_block(table, entry->base, recur_times);
-
-#if LPM_DEBUG_RECURSION
-            *recur_times = *recur_times - 1;
-#endif 
+        if (slab->region != NULL && slab->slab_size > LPM_PAGE_SIZE) {
+            lpm_region_release(slab->region, ((u8 *)hdr) + LPM_PAGE_SIZE,
+                               slab->slab_size - LPM_PAGE_SIZE);
         }
     }
+    if (empty != NULL) {
+        slab->slab_tail->next = empty;
+        slab->slab_tail = empty_tail;
+    }
 
-    mtrie_mem_free(&table->stat, base);
+    return cnt;
 }
 
-static void mtrie_free_block(lpm_lkup_table_t *table, mtrie_node_t *base)
+/* Forget all objects but keep slabs for reuse, O(1) */
+static void lpm_slab_reset(lpm_slab_t *slab)
 {
-    u32 recur_times = 0;
-
-    __mtrie_free_block(table, base, &recur_times);
+    assert(slab != NULL);
+
+    slab->free_list = NULL;
+    slab->free_cnt = 0;
+    slab->slab_cur = NULL;
+    slab->slab_used = 0;
+    slab->next_obj = NULL;
+    slab->slab_end = NULL;
 }
 
-static lpm_result_t mtrie_init(lpm_lkup_table_t *table)
+/* Release all slabs, objects allocated from slab are invalid after that */
+static void lpm_slab_destroy(lpm_slab_t *slab)
 {
-    if (table == NULL) {
-        return LPM_ERR_INVALID;
-    }
+    lpm_slab_hdr_t *hdr, *next;
 
-    if (table->hi256_table_base != NULL) {
-        lpm_debug_norm(table, "M-trie table already exists\n");
-        return LPM_ERR_EXISTS;
-    }
+    assert(slab != NULL);
 
-    table->hi256_table_base = mtrie_alloc_block(table);
-    if (table->hi256_table_base == NULL) {
-        lpm_debug_mem(table, "M-trie base table [%d Bytes] of LPM alloc failed\n",
-                                    MTRIE_BLOCK_ALLOC_SIZE);
-        return LPM_ERR_RESOURCES;
+    for (hdr = slab->slab_list; hdr != NULL; hdr = next) {
+        next = hdr->next;
+        lpm_slab_mem_put(slab, hdr);
+        if (slab->budget != NULL) {
+            assert(slab->budget->used >= slab->slab_size);
+            slab->budget->used -= slab->slab_size;
+        }
     }
-    
-    lpm_debug_norm(table, "M-trie is initialized\n");
 
-    return LPM_SUCCESS;
+    slab->free_list = NULL;
+    slab->free_cnt = 0;
+    slab->slab_list = NULL;
+    slab->slab_tail = NULL;
+    slab->slab_cur = NULL;
+    slab->next_obj = NULL;
+    slab->slab_end = NULL;
+    slab->slab_cnt = 0;
+    slab->slab_used = 0;
+    slab->huge_cnt = 0;
 }
 
-static void mtrie_destroy(lpm_lkup_table_t *table)
+static size_t lpm_slab_mem_size(lpm_slab_t *slab)
 {
-    if (table == NULL) {
-        return;
-    }
-
-    mtrie_free_block(table, table->hi256_table_base);
-
-    table->hi256_table_base = NULL;
-    
-    lpm_debug_norm(table, "M-trie is destroyed\n");
+    return slab->slab_size * slab->slab_cnt;
 }
 
 /*******************************
- * LPM rel. codes
+ * B-trie rel. codes
  */
-static lpm_lkup_table_t *lpm_mem_alloc()
+static btrie_node_t *btrie_mem_alloc(lpm_slab_t *slab, struct lpm_lkup_table_stat *stat)
 {
-    lpm_lkup_table_t *ret;
-    
-    ret = malloc(sizeof(lpm_lkup_table_t));
+    btrie_node_t *ret;
+
+    assert(slab != NULL);
+    assert(stat != NULL);
     
-#if LPM_DEBUG_ALLOC_FAIL
-    if (!lpm_mem_success(101)) {
-        free(ret);
-        ret = NULL;
-    }
-#endif
+    ret = lpm_slab_alloc(slab);
 
     if (ret != NULL) {
-        memset(ret, 0, sizeof(lpm_lkup_table_t));
+        /* zero out needed */
+        memset(ret, 0, sizeof(btrie_node_t));
+        stat->btrie_node_alloc_stat++;
+    } else {
+        stat->btrie_node_alloc_fail_stat++;
     }
     
     return ret;
 }
 
-static void lpm_mem_free(lpm_lkup_table_t *p)
+static void btrie_mem_free(lpm_slab_t *slab, struct lpm_lkup_table_stat *stat, btrie_node_t *p)
 {
+    assert(slab != NULL);
+    assert(stat != NULL);
+
     if (p != NULL) {
-        free(p);
+        assert(stat->btrie_node_alloc_stat > 0);
+        lpm_slab_free(slab, p);
+        stat->btrie_node_alloc_stat--;
     }
 }
 
-lpm_result_t lpm_debug_support(lpm_lkup_table_t *table, lpm_debug_t debug, int on)
+static btrie_node_t *btrie_alloc_node(lpm_lkup_table_t *table)
 {
-    if (table == NULL) {
-        lpm_con_print("%s table not found..\n", __func__);
-        return LPM_ERR_INVALID;
-    }
+    btrie_node_t *ret = NULL;
 
-    if (on == 1) {          /* open */
-        switch (debug) {
-        case DEBUG_NORMAL:
-            table->debug_flag |= LPM_DEBUG_NORM;
-            break;
-        case DEBUG_MEMORY:
-            table->debug_flag |= LPM_DEBUG_MEM;
-            break;
-        case DEBUG_ALGORITHM:
-            table->debug_flag |= LPM_DEBUG_ALG;
-            break;
-        case DEBUG_ALL:
-            table->debug_flag |= LPM_DEBUG_MASK;
-            break;
-        case LOGGING:
-            table->debug_flag |= LPM_LOGGING;
-            break;
-        default:
-            lpm_debug_norm(table, "Unknown debug <%d>\n", debug);
-            return LPM_ERR_INVALID;
-        }
-    } else if (on == 0){    /* close */
-        switch (debug) {
-        case DEBUG_NORMAL:
-            table->debug_flag &= (~LPM_DEBUG_NORM);
-            break;
-        case DEBUG_MEMORY:
-            table->debug_flag &= (~LPM_DEBUG_MEM);
-            break;
-        case DEBUG_ALGORITHM:
-            table->debug_flag &= (~LPM_DEBUG_ALG);
-            break;
-        case DEBUG_ALL:
-            table->debug_flag &= (~LPM_DEBUG_MASK);
-            break;
-        case LOGGING:
-            table->debug_flag &= (~LPM_LOGGING);
-            break;
-        default:
-            lpm_debug_norm(table, "Unknown debug <%d>\n", debug);
-            return LPM_ERR_INVALID;
-        }
-    } else {
-        lpm_debug_norm(table, "Unknown on <%d>\n", on);
-        return LPM_ERR_INVALID;
-    }
+    assert(table != NULL);
 
-    lpm_log_print(table, "debug<%d>, on<%d>\n", debug, on);
+    ret = btrie_mem_alloc(&table->btrie_slab, &table->stat);
 
-    return LPM_SUCCESS;
+    return ret;
 }
 
-void lpm_table_statistic(lpm_lkup_table_t *table)
+static void btrie_free_node(lpm_lkup_table_t *table, btrie_node_t *p)
 {
-    struct lpm_lkup_table_stat *stat;
-    float btrie_mem, mtrie_mem;
-    float cnt;
-    u32 i, j;
-    char buf[128], *p;
+    assert(table != NULL);
 
-    if (table == NULL) {
-        lpm_con_print("%s table not found...\n", __func__);
+    btrie_mem_free(&table->btrie_slab, &table->stat, p);
+}
+
+/*
+ * Prefix key of 1-trie node, bits after masklen are cleared.
+ * ATTENTION addr should be network byte order (big endianness)
+ */
+static void btrie_set_key(btrie_node_t *node, u8 *addr, u32 masklen)
+{
+    u32 cnt;
+
+    memset(node->key, 0, sizeof(node->key));
+    node->masklen = masklen;
+    if (masklen == 0) {
         return;
     }
-    
-    lpm_log_print(table, "print LPM statistic\n");
 
-    stat = &table->stat;
-    btrie_mem = ((float)((stat->btrie_node_alloc_stat) * sizeof(btrie_node_t))) / 1000000.0;
-    mtrie_mem = ((float)((stat->mtrie_block_alloc_stat) * MTRIE_BLOCK_ALLOC_SIZE)) / 1000000.0;
+    cnt = ((masklen - 1) >> 0x3) + 1;
+    memcpy(node->key, addr, cnt);
+    node->key[cnt - 1] &= (u8)(0xFF << (7 - ((masklen - 1) & 0x7)));
+}
 
-    lpm_con_print("LPM Table [%s] statistic:\n", table->name);
-    lpm_con_print("\tB-trie allocated nodes: %d nodes, [%.3f MB]\n",
-                        stat->btrie_node_alloc_stat, btrie_mem);
-    lpm_con_print("\tB-trie allocated failure: %u times\n", stat->btrie_node_alloc_fail_stat);
-    lpm_con_print("\tM-trie allocated blocks: %d blocks, [%.3f MB]\n",
-                        stat->mtrie_block_alloc_stat, mtrie_mem);
-    lpm_con_print("\tM-trie allocated failure: %u times\n", stat->mtrie_block_alloc_fail_stat);
-    lpm_con_print("\tLPM Table valid data total count: [%d]\n", stat->data_total);
+/* Length of common prefix of key and addr, no longer than masklen */
+static u32 btrie_common_len(u8 *key, u8 *addr, u32 masklen)
+{
+    u32 pos = 0;
+    u8 diff;
 
-    if (LPM_DEBUGGING_NORM(table)) {
-        for (i = 0; i <= LPM_MASKLEN_MAX; i++) {
-            if (stat->data_per_masklen[i] == 0) {
-                continue;
-            }
-#define TOTAL_ASTERISK_PRINT 100
-            assert(stat->data_total > 0);
-            cnt = ((float)(stat->data_per_masklen[i] * TOTAL_ASTERISK_PRINT)) / ((float)(stat->data_total));
-            j = (u32)cnt;
-            if (j == 0) {
-                j = 1;
-            }
-            if (j > TOTAL_ASTERISK_PRINT) {
-                lpm_debug_alg(table, "data of masklen /%u is larger than total count\n", i);
-                j = TOTAL_ASTERISK_PRINT;
-            }
-            for (p = buf; j > 0; j--, p++) {
-                *p = '*';
-            }
-            *p = '\0';
-            lpm_debug_norm(table, "\t  /%-3u [%4u]: %s\n", i, stat->data_per_masklen[i], buf);
+    while (pos < masklen) {
+        diff = key[pos >> 3] ^ addr[pos >> 3];
+        if (diff == 0) {
+            pos = (pos & (~0x7U)) + 8;
+            continue;
         }
+        /* first different bit in this byte */
+        pos = pos & (~0x7U);
+        while ((diff & 0x80) == 0) {
+            diff <<= 1;
+            pos++;
+        }
+        break;
     }
 
-    lpm_con_print("\tTotal memory size: %.3f MB\n", (btrie_mem + mtrie_mem));
+    return (pos < masklen) ? pos : masklen;
+}
+
+static inline u8 btrie_key_match(btrie_node_t *node, u8 *addr, u32 masklen)
+{
+    return (btrie_common_len(node->key, addr, masklen) == masklen);
 }
 
 /*
- * lpm_create_table never fail to allocate 1-trie root node and m-trie root trie block.
- * After LPM table is created, 1-trie root node and m-trie root trie block will never be NULL,
- * otherwise it is LPM algorithm internal error.
+ * find addr/masklen corresponding 1-trie node, will not add new node when don't find.
+ * Skipped bits of compressed path are not compared while going down, so check the key at last.
  */
-lpm_lkup_table_t *lpm_create_table(char *name)
+static btrie_node_t *btrie_find_node(btrie_node_t *root, u8 *addr, u32 masklen)
 {
-    lpm_lkup_table_t *table;
-
-    lpm_con_print("%s with name <%s>\n", __func__, name);
+    btrie_node_t *node;
 
-    table = lpm_mem_alloc();
-    if (table == NULL) {
-        lpm_con_print("%s allocate LPM table failed\n", __func__);
-        return NULL;
-    }
-    if (name == NULL) {
-        sprintf(table->name, LPM_TABLE_DEFAULT_NAME);
-    } else {
-        strncpy(table->name, name, (LPM_TABLE_NAME_LEN - 1));
-    }
-    
-    if (btrie_init(table) != LPM_SUCCESS) {
-        lpm_debug_norm(table, "B-trie initial failed\n");
-        goto error_btrie;
+    if (masklen > 0) {
+        assert(addr != NULL);
     }
 
-    if (mtrie_init(table) != LPM_SUCCESS) {
-        lpm_debug_norm(table, "M-trie initial failed\n");
-        goto error_mtrie;
+    node = root;
+    while (node != NULL && node->masklen < masklen) {
+        node = node->child[bit_at_position(addr, node->masklen)];
     }
 
-    lpm_log_print(table, "name <%s>, success\n", table->name);
+    if (node == NULL || node->masklen != masklen || !btrie_key_match(node, addr, masklen)) {
+        return NULL;
+    }
 
-    return table;
+    return node;
+}
 
-error_mtrie:
-    btrie_destroy(table);
+/* accurately find */
+static void *btrie_find_data(btrie_node_t *root, u8 *addr, u32 masklen)
+{
+    btrie_node_t *node;
 
-error_btrie:
-    lpm_mem_free(table);
+    node = btrie_find_node(root, addr, masklen);
+    
+    if (node != NULL) {
+        return node->data;
+    }
 
     return NULL;
 }
 
-lpm_result_t lpm_destroy_table(lpm_lkup_table_t *table)
+/*
+ * Whether data more specific than addr/masklen exists.
+ * Every non-root 1-trie node has data or has two children, so any node below addr/masklen
+ * means more specific data.
+ */
+static u8 btrie_has_more_specific(btrie_node_t *root, u8 *addr, u32 masklen)
 {
-    if (table == NULL) {
-        lpm_con_print("%s table not found...\n", __func__);
-        return LPM_ERR_INVALID;
-    }
-
-    lpm_log_print(table, "I am done...\n");
+    btrie_node_t *node;
 
-    mtrie_destroy(table);
-    btrie_destroy(table);
-    lpm_mem_free(table);
-    
-    return LPM_SUCCESS;
-}
+    node = root;
+    while (node != NULL && node->masklen < masklen) {
+        node = node->child[bit_at_position(addr, node->masklen)];
+    }
 
-static lpm_result_t lpm_check_arg(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
-{
-    if (table == NULL) {                /* table should be valid */
-        lpm_con_print("%s table not found...\n", __func__);
-        return LPM_ERR_INVALID;
+    if (node == NULL || !btrie_key_match(node, addr, masklen)) {
+        return 0;
     }
 
-    if (masklen > LPM_MASKLEN_MAX) {
-        lpm_con_print("%s masklen [%u] is too large\n", __func__, masklen);
-        return LPM_ERR_INVALID;
+    if (node->masklen == masklen) {
+        return ((node->child[0] != NULL) || (node->child[1] != NULL));
     }
 
-    if (masklen > 0 && addr == NULL) {  /* addr should be valid while masklen is not 0 */
-        lpm_con_print("%s address CAN NOT be NULL while masklen > 0\n", __func__);
-        return LPM_ERR_INVALID;
-    }
-
-    return LPM_SUCCESS;
+    return 1;
 }
 
-void *lpm_find_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+/*
+ * Data which m-trie entry addr[0..level] holds at its own level, that is data of the longest
+ * prefix covering the entry with masklen in (level * 8, level * 8 + 8].
+ */
+static void *btrie_level_data(btrie_node_t *root, u8 *addr, u32 level)
 {
+    btrie_node_t *node;
     void *data = NULL;
+    u32 low = level << 0x3, high = low + LPM_STRIDE;
 
-    if (lpm_check_arg(table, addr, masklen) != LPM_SUCCESS) {
-        lpm_con_print("%s invalid argument\n", __func__);
-        return NULL;
-    }
-
-    if (table->btrie_root == NULL) {
-        lpm_debug_alg(table, "B-trie of LPM not exists\n");
-        return NULL;
+    node = root;
+    while (node != NULL && node->masklen <= high) {
+        if (!btrie_key_match(node, addr, node->masklen)) {
+            break;
+        }
+        if (node->data != NULL && node->masklen > low) {
+            data = node->data;
+        }
+        if (node->masklen == high) {
+            break;
+        }
+        node = node->child[bit_at_position(addr, node->masklen)];
     }
 
-    data = btrie_find_data(table->btrie_root, addr, masklen);
-
-    lpm_log_print(table, "accurately find result %p\n", data);
-
     return data;
 }
 
 /*
- * Longest prefix matching search, performance is the KEY.
- * Return default data when do not find valid data in m-trie, and set the value to 1 pointed by
- * using_default.
+ * Return LPM_ERR_EXISTS while find corresponding node success, ATTENTION it's not an failure.
+ * Add new node while not find corresponding node, and return LPM_SUCCESS.
+ * At most two nodes are added, the new node and a branch node where compressed path forks.
+ * Any failure will lead to return LPM_ERR_XXX, and 1-trie is not touched.
+ * It will not operate data.
  */
-void *lpm_search_table(lpm_lkup_table_t *table, u8 *addr, u8 *using_default)
+static lpm_result_t btrie_add_node(lpm_lkup_table_t *table,
+                                   u8 *addr,
+                                   u32 masklen,
+                                   btrie_node_t **newnode)
 {
-    u8 *idx;
-    mtrie_node_t *entry, *base;
-    void *data = NULL;
+    btrie_node_t *place, *next, *node, *branch;
+    u32 common;
+    u8 bit;
 
-    if (table == NULL || addr == NULL || using_default == NULL) {
-        lpm_con_print("%s invalid argument\n", __func__);
-        return NULL;
+    assert(newnode != NULL);
+    assert(table != NULL);
+    assert(table->mtrie_cnt != 0);
+    
+    if (masklen > 0) {
+        assert(addr != NULL);
     }
 
-    base = table->hi256_table_base;
-    idx = addr;
-    *using_default = 0;
-    while (base != NULL) {
-        entry = (mtrie_node_t *)(base + (*idx));
-        if (entry->data != NULL) {
-            data = entry->data;
+    place = table->btrie_root;                      /* from the root of 1-trie */
+
+    while (place->masklen < masklen) {
+        bit = bit_at_position(addr, place->masklen);
+        next = place->child[bit];
+        if (next == NULL) {
+            /* New leaf node */
+            node = btrie_alloc_node(table);
+            if (node == NULL) {
+                lpm_debug_mem(table, "btrie node [%d Bytes] alloc failed\n", (int)sizeof(btrie_node_t));
+                return LPM_ERR_RESOURCES;
+            }
+            btrie_set_key(node, addr, masklen);
+            place->child[bit] = node;
+            *newnode = node;
+            return LPM_SUCCESS;
         }
-        idx++;
-        base = entry->base;
-    }
 
-    if (data == NULL) {
-        data = table->default_data;
-        *using_default = 1;
-    }
-    
-    return data;
-}
+        common = btrie_common_len(next->key, addr,
+                                  (next->masklen < masklen) ? next->masklen : masklen);
+        if (common == next->masklen) {
+            /* next is on the path of addr/masklen */
+            place = next;
+            continue;
+        }
 
-/* Write data in m-trie block */
-static void lpm_pattern_generate(mtrie_node_t *base, u8 idx, u32 bitpos, void *data)
-{
-    u8 mask;
-    u32 tmp_idx, end_idx;
-    u32 masklen = (bitpos + 1) % 8;
-    mtrie_node_t *tmp_trie;
+        node = btrie_alloc_node(table);
+        if (node == NULL) {
+            lpm_debug_mem(table, "btrie node [%d Bytes] alloc failed\n", (int)sizeof(btrie_node_t));
+            return LPM_ERR_RESOURCES;
+        }
+        btrie_set_key(node, addr, masklen);
 
-    if (BOUNDARY_BIT_POSITION(bitpos)) {
-        mask = 0xFF;
-    } else {
-        mask = ~((0x1 << (8 - masklen)) - 1);
+        if (common == masklen) {
+            /* New node is inserted into compressed path, above next */
+            node->child[bit_at_position(next->key, masklen)] = next;
+            place->child[bit] = node;
+        } else {
+            /* Compressed path forks at common, new branch node needed */
+            branch = btrie_alloc_node(table);
+            if (branch == NULL) {
+                lpm_debug_mem(table, "btrie node [%d Bytes] alloc failed\n", (int)sizeof(btrie_node_t));
+                btrie_free_node(table, node);
+                return LPM_ERR_RESOURCES;
+            }
+            btrie_set_key(branch, addr, common);
+            branch->child[bit_at_position(addr, common)] = node;
+            branch->child[bit_at_position(next->key, common)] = next;
+            place->child[bit] = branch;
+        }
+        *newnode = node;
+        return LPM_SUCCESS;
     }
 
-    tmp_idx = idx & mask;
-    idx |= (~mask);
-    end_idx = idx;
+    *newnode = place;
 
-    for ( ; tmp_idx <= end_idx; tmp_idx++) {
-        tmp_trie = (mtrie_node_t *)(base + tmp_idx);
-        tmp_trie->data = data;
-    }
+    return LPM_ERR_EXISTS;
 }
 
-/* Operation is only confined to a certain m-trie block */
-static lpm_result_t lpm_gen_combinations(lpm_lkup_table_t *table,
-                                         u8 *addr,
-                                         u32 temp_bitpos,
-                                         void *data,
-                                         char nextbit)
+/*
+ * Release 1-trie node of addr/masklen if it has no data and is not needed as a branch node,
+ * the parent branch node which has no data is merged into compressed path too.
+ * Used when data is deleted, or when failure takes place within add entry in m-trie.
+ */
+static void btrie_release_node(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
 {
-    lpm_result_t ret = LPM_SUCCESS;
-    mtrie_node_t *mtrie_table_base;
-    mtrie_node_t *frontier_trie, *pre_entry;
-    mtrie_node_t *trie_chain[LPM_LEVEL_MAX] = {NULL}; /* trie base */
-    u8 trie_idx[LPM_LEVEL_MAX] = {0};
-    
-#define TRIE_CHAIN_ALLOC 0x10
-    u8 trie_chain_alloc[LPM_LEVEL_MAX] = {0};   /* 0x10 stands for newly allocating */
-
-    int trie_count;                             /* the count of tries which will be operated */
-    int level, i;
-    u8 idx = 0;
-
-    assert(temp_bitpos < LPM_MASKLEN_MAX);
-    assert(addr != NULL);
-    assert(table != NULL);
-    mtrie_table_base = table->hi256_table_base;
-    assert(mtrie_table_base != NULL);
-    assert((nextbit == -1) || (nextbit == 0) || (nextbit == 1));
-
-    if (temp_bitpos < 8) {
-        idx = addr[0];
-        switch (nextbit) {
-        case 0: /* next bit should set to 0 */
-            assert(temp_bitpos != 7);
-            idx &= (0xFF ^ (0x1 << (7 - (temp_bitpos + 1))));
-            lpm_pattern_generate(mtrie_table_base, idx, (temp_bitpos + 1), data);
-            break;
-        case 1: /* next bit should set to 1 */
-            assert(temp_bitpos != 7);
-            idx |= (0x1 << (7 - (temp_bitpos + 1)));
-            lpm_pattern_generate(mtrie_table_base, idx, (temp_bitpos + 1), data);
-            break;
-        case -1:/* next bit need no touch */
-            lpm_pattern_generate(mtrie_table_base, idx, temp_bitpos, data);
-            break;
-        }
+    btrie_node_t *grand = NULL, *parent = NULL, *node;
+    u8 bit = 0, parent_bit = 0;
 
-        return ret;
+    node = table->btrie_root;
+    while (node != NULL && node->masklen < masklen) {
+        grand = parent;
+        parent_bit = bit;
+        parent = node;
+        bit = bit_at_position(addr, node->masklen);
+        node = node->child[bit];
     }
 
-    /* temp_bitpos >= 8 */
-    trie_count = (temp_bitpos >> 3) + 1;
-
-    /* Build trie chain, allocate new trie block when necessary */
-    for (level = 0, frontier_trie = mtrie_table_base; level < trie_count; level++) {
-        if (frontier_trie == NULL) {
-            frontier_trie = mtrie_alloc_block(table);
-            if (frontier_trie == NULL) {
-                lpm_debug_mem(table, "mtrie block [%d Btyes] allocate failed, releasing allocated memory\n",
-                                            MTRIE_BLOCK_ALLOC_SIZE);
-                for (i = 0; i < level; i++) {
-                    if (trie_chain_alloc[i] == TRIE_CHAIN_ALLOC) {
-                        /* release mtrie blocks which were former allocated */
-                        mtrie_free_block(table, trie_chain[i]);
-                        lpm_debug_mem(table, "\t\tfree one mtrie block...\n");
-                    }
-                }
-                return LPM_ERR_RESOURCES;
-            }
-            trie_chain_alloc[level] = TRIE_CHAIN_ALLOC;
-        }
-        trie_chain[level] = frontier_trie;
-        trie_idx[level] = addr[level];
+    if (node == NULL || node == table->btrie_root || node->masklen != masklen ||
+        node->data != NULL) {
+        return;
+    }
 
-        frontier_trie = ((mtrie_node_t *)(trie_chain[level] + trie_idx[level]))->base;
+    if (node->child[0] != NULL && node->child[1] != NULL) {
+        /* Still a branch node */
+        return;
     }
 
-    frontier_trie = trie_chain[trie_count - 1]; /* lowest level trie block */
-    idx = trie_idx[trie_count - 1]; /* index in lowest level trie block */
+    if (node->child[0] != NULL || node->child[1] != NULL) {
+        /* Merge node into compressed path */
+        parent->child[bit] = (node->child[0] != NULL) ? node->child[0] : node->child[1];
+        btrie_free_node(table, node);
+        return;
+    }
 
-    /*
-     * XXX: backward hook from low to high level trie block, for the sake of data plane reading.
-     *      Since control plane bind to core 0, we only need disable preemption when multiple
-     *      control threads are co-exist.
-     */
-    for (level = trie_count - 1; level > 0; level--) {
-        pre_entry = (mtrie_node_t *)(trie_chain[level - 1] + trie_idx[level - 1]);
+    parent->child[bit] = NULL;
+    btrie_free_node(table, node);
 
-        if (trie_chain_alloc[level] == TRIE_CHAIN_ALLOC) {
-            /* Hook newly allocating trie block to upper level trie block entry's base */
-            pre_entry->base = trie_chain[level];
-        } else {
-            /* Inconsistence check */
-            if (pre_entry->base != trie_chain[level]) {
-                /* XXX BUG */
-                lpm_debug_alg(table, "*BUG* *FATAL ERROR* trie_chain[%d]=%p, pre_node->base=%p, *INCONSISTENT*\n",
-                                      level, trie_chain[level], pre_entry->base);
-                lpm_log_print(table, "*FATAL ERROR* : *inconsistent*\n");
-                lpm_con_print("*FATAL ERROR* : *inconsistent*\n");
-                assert(0);  /* XXX suicide */
-                return LPM_ERR_INTERNAL;
-            }
-        }
-    }
-    
-    /* trie_chain: mtrie_table_base -> ... -> frontier_trie */
-    switch (nextbit) {
-    case 0: /* next bit should set to 0 */
-        assert(!BOUNDARY_BIT_POSITION(temp_bitpos));
-        idx &= (0xFF ^ (0x1 << (7 - ((temp_bitpos + 1) & 7))));
-        lpm_pattern_generate(frontier_trie, idx, (temp_bitpos + 1), data);
-        break;
-    case 1: /* next bit should set to 1 */
-        assert(!BOUNDARY_BIT_POSITION(temp_bitpos));
-        idx |= (0x1 << (7 - ((temp_bitpos + 1) & 7)));
-        lpm_pattern_generate(frontier_trie, idx, (temp_bitpos + 1), data);
-        break;
-    case -1:/* next bit need no touch */
-        lpm_pattern_generate(frontier_trie, idx, temp_bitpos, data);
-        break;
+    /* Parent without data has only one child now, merge it into compressed path */
+    if (parent != table->btrie_root && parent->data == NULL) {
+        assert(grand != NULL);
+        grand->child[parent_bit] = (parent->child[0] != NULL) ? parent->child[0] : parent->child[1];
+        btrie_free_node(table, parent);
     }
-
-    return ret;
 }
 
-static lpm_result_t __lpm_prefix_expansion(lpm_lkup_table_t *table,
-                                         u8 *addr,
-                                         u32 masklen,
-                                         u32 temp_bitpos,
-                                         btrie_node_t *temp_root,
-                                         void *data,
-                                         u32 *recur_times)
+static lpm_result_t __btrie_dfs_walk(btrie_node_t *node,
+                                     lpm_data_walker_func_t walker,
+                                     u32 *recur_times)
 {
     lpm_result_t ret;
-    
+    u8 addr[LPM_LEVEL_MAX];
+    int i;
+
 #if LPM_DEBUG_RECURSION
     if (*recur_times > LPM_RECUR_DEPTH_WARN) {
         lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
     }
     *recur_times = *recur_times + 1;
 #endif
-
-    /* Boundary bit specify only one entry in m-trie block. Combinations directly. */
-    if (BOUNDARY_BIT_POSITION(temp_bitpos)) {
-        return lpm_gen_combinations(table, addr, temp_bitpos, data, -1);
-    }
-
-    if ((temp_root->child[0] == NULL) && (temp_root->child[1] == NULL)) {
-        /* No children in 1-trie, which means I AM the most specific data. Combinations directly. */
-        return lpm_gen_combinations(table, addr, temp_bitpos, data, -1);
+    
+    if (node->data != NULL) {
+        /* walker gets a copy, node's key can not be changed */
+        memcpy(&addr, node->key, sizeof(addr));
+        if ((*walker)(addr, node->masklen, node->data) != 0) {
+            /* Error is from walker, not from LPM */
+            return LPM_ERR_EXOTIC;
+        }
     }
 
-    /* Take care left sub-tree. */
-    if (temp_root->child[0] != NULL) {  /* More specific data maybe exist in left sub-tree */
-        
-        if (temp_root->child[0]->data == NULL) {
-            /* Take care left sub-tree recursively */
-            CLEAR_BIT_AT_POSITION(addr, (temp_bitpos + 1));
-
-            ret = __lpm_prefix_expansion(table,
-                                         addr,
-                                         masklen,
-                                         (temp_bitpos + 1),
-                                         temp_root->child[0],
-                                         data,
-                                         recur_times);
-            
-#if LPM_DEBUG_RECURSION
-            *recur_times = *recur_times - 1;
-#endif
-
-            if (ret != LPM_SUCCESS) {
-                return ret;
-            }
-        } else {
-            /*
-             * The temp_root->child[0]->data is not NULL, which means it is the more specific data,
-             * and it will take over all below nodes. We have done our job now.
-             */
-            (void)0; 
-        }
-        
-    } else {
-        /* Left sub-tree not exist, combination directly in left sub-tree. */
-        ret = lpm_gen_combinations(table, addr, temp_bitpos, data, 0);
-        if (ret != LPM_SUCCESS) {
-            return ret;
+    /* Traverse left sub-tree, then right sub-tree */
+    for (i = 0; i < 2; i++) {
+        if (node->child[i] == NULL) {
+            continue;
         }
-    }
 
-    /* Take care right sub-tree. */
-    if (temp_root->child[1] != NULL) {  /* More specific data maybe exist in right sub-tree */
-        
-        if (temp_root->child[1]->data == NULL) {
-            /* Take care right sub-tree recursively */
-            SET_BIT_AT_POSITION(addr, (temp_bitpos + 1));
-
-            ret = __lpm_prefix_expansion(table,
-                                         addr,
-                                         masklen,
-                                         (temp_bitpos + 1),
-                                         temp_root->child[1],
-                                         data,
-                                         recur_times);
+        ret = __btrie_dfs_walk(node->child[i], walker, recur_times);
 
 #if LPM_DEBUG_RECURSION
-            *recur_times = *recur_times - 1;
+        *recur_times = *recur_times - 1;
 #endif
 
-            if (ret != LPM_SUCCESS) {
-                return ret;
-            }
-        } else {
-            /*
-             * The temp_root->child[1]->data is not NULL, which means it is the more specific data,
-             * and it will take over all below nodes. We have done our job now.
-             */
-            (void)0; 
-        }
-        
-    } else {
-        /* Right sub-tree not exist, combination directly in right sub-tree. */
-        ret = lpm_gen_combinations(table, addr, temp_bitpos, data, 1);
         if (ret != LPM_SUCCESS) {
             return ret;
         }
@@ -1003,592 +915,5119 @@ static lpm_result_t __lpm_prefix_expansion(lpm_lkup_table_t *table,
     return LPM_SUCCESS;
 }
 
-static lpm_result_t lpm_prefix_expansion(lpm_lkup_table_t *table,
-                                         u8 *addr,
-                                         u32 masklen,
-                                         u32 temp_bitpos,
-                                         btrie_node_t *temp_root,
-                                         void *data)
+static lpm_result_t btrie_dfs_walk(btrie_node_t *root, lpm_data_walker_func_t walker)
 {
-    u32 recur_times = 0;
+    u32 recur_times = 0;    /* Recursion depth check */
 
-    return __lpm_prefix_expansion(table, addr, masklen, temp_bitpos, temp_root, data, &recur_times);
+    return __btrie_dfs_walk(root, walker, &recur_times);
 }
 
-/* Update LPM default data, accroding to addr/masklen prefix. */
-lpm_result_t lpm_update_default_data(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+static lpm_result_t btrie_init(lpm_lkup_table_t *table)
 {
-    void *data = NULL;
-    int cnt;
-    u8 mask;
-
-    if (lpm_check_arg(table, addr, masklen) != LPM_SUCCESS) {
-        lpm_con_print("%s invalid argument\n", __func__);
+    if (table == NULL) {
         return LPM_ERR_INVALID;
     }
-
-    if (table->btrie_root == NULL) {
-        lpm_debug_alg(table, "B-trie of LPM not exists\n");
+    
+    if (table->btrie_root != NULL) {
+        lpm_debug_norm(table, "B-trie already exists\n");
+        return LPM_ERR_EXISTS;
+    }
+
+    lpm_slab_init(&table->btrie_slab, sizeof(btrie_node_t), LPM_BTRIE_SLAB_NODES, 0);
+    table->btrie_slab.budget = &table->budget;
+    table->btrie_slab.allocator = &table->allocator;
+    table->btrie_root = btrie_alloc_node(table);
+    if (table->btrie_root == NULL) {
+        lpm_debug_mem(table, "B-trie root node [%d Bytes] alloc failed\n", sizeof(btrie_node_t));
+        lpm_slab_destroy(&table->btrie_slab);
+        return LPM_ERR_RESOURCES;
+    }
+    
+    lpm_debug_norm(table, "B-trie initialized\n");
+
+    return LPM_SUCCESS;
+}
+
+static void btrie_destroy(lpm_lkup_table_t *table)
+{
+    if (table == NULL) {
+        return;
+    }
+
+    /* All 1-trie nodes come from slab, release whole slabs instead of walking 1-trie */
+    lpm_slab_destroy(&table->btrie_slab);
+    table->stat.btrie_node_alloc_stat = 0;
+    
+    table->btrie_root = NULL;
+
+    lpm_debug_norm(table, "B-trie is destroyed\n");
+}
+
+/*******************************
+ * Trace rel. codes
+ */
+#if LPM_TRACE
+static lpm_trace_func_t lpm_trace_hook[LPM_TRACE_POINT_MAX];
+
+static void lpm_trace_call(lpm_trace_func_t func,
+                           lpm_trace_point_t point,
+                           lpm_lkup_table_t *table,
+                           u8 *addr,
+                           u32 masklen,
+                           unsigned long entries,
+                           lpm_result_t result)
+{
+    lpm_trace_t trace;
+
+    memset(&trace, 0, sizeof(trace));
+    trace.point = point;
+    trace.table = table->name;
+    if (masklen <= LPM_MASKLEN_MAX) {
+        memcpy(trace.addr, addr, (masklen + 7) >> 3);
+        trace.masklen = masklen;
+    }
+    trace.entries = entries;
+    trace.result = result;
+
+    func(&trace);
+}
+
+/* Arguments but point and table are not evaluated when the point is not hooked */
+#define LPM_TRACE_POINT(point, table, addr, masklen, entries, result) do { \
+    lpm_trace_func_t __trace_func = __atomic_load_n(&lpm_trace_hook[(point)], __ATOMIC_ACQUIRE); \
+    if (unlikely(__trace_func != NULL)) { \
+        lpm_trace_call(__trace_func, (point), (table), (addr), (masklen), (entries), (result)); \
+    } \
+} while (0)
+
+/* Prefix of update in progress, for trace points knowing no prefix */
+static inline void lpm_trace_begin(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    memcpy(table->trace.addr, addr, (masklen + 7) >> 3);
+    table->trace.masklen = masklen;
+}
+
+static inline void lpm_trace_end(lpm_lkup_table_t *table)
+{
+    memset(&table->trace, 0, sizeof(table->trace));
+}
+#else
+/* Arguments are never evaluated, but they are still used */
+#define LPM_TRACE_POINT(point, table, addr, masklen, entries, result) do { \
+    if (0) { \
+        (void)(table); (void)(addr); (void)(masklen); (void)(entries); (void)(result); \
+    } \
+} while (0)
+
+static inline void lpm_trace_begin(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+}
+
+static inline void lpm_trace_end(lpm_lkup_table_t *table)
+{
+}
+#endif
+
+/* Block of entries allocated or freed for the update in progress */
+#define LPM_TRACE_BLOCK(point, table, entries) \
+    LPM_TRACE_POINT((point), (table), (table)->trace.addr, (table)->trace.masklen, (entries), LPM_SUCCESS)
+
+lpm_result_t lpm_trace_set(lpm_trace_point_t point, lpm_trace_func_t func)
+{
+    if (point >= LPM_TRACE_POINT_MAX) {
+        lpm_con_print("%s invalid trace point %d\n", __func__, point);
+        return LPM_ERR_INVALID;
+    }
+#if LPM_TRACE
+    __atomic_store_n(&lpm_trace_hook[point], func, __ATOMIC_RELEASE);
+
+    return LPM_SUCCESS;
+#else
+    lpm_con_print("%s LPM is built without LPM_TRACE\n", __func__);
+
+    return LPM_ERR_INVALID;
+#endif
+}
+
+/*******************************
+ * M-trie rel. codes
+ */
+#define MTRIE_BLOCK_ENTRY   (0x1 << LPM_STRIDE)         /* for 8-stride */
+#define MTRIE_BLOCK_ALLOC_SIZE ((sizeof(mtrie_node_t)) * MTRIE_BLOCK_ENTRY)
+
+/*
+ * Shared all-zero block standing for a folded uniform block, see mtrie_fold_block().
+ * Data plane reads it and stops with parent entry's data, it is never written or freed.
+ */
+static mtrie_node_t mtrie_uniform_block[MTRIE_BLOCK_ENTRY] __attribute__((aligned(LPM_CACHE_LINE)));
+#define MTRIE_UNIFORM_BLOCK (&mtrie_uniform_block[0])
+
+/*
+ * Entry fields are read and written through mtrie_base(), mtrie_base_of(), mtrie_data() and
+ * mtrie_data_of(), so the algorithm is the same for both entry layouts, see LPM_MTRIE_INDEX32.
+ */
+#if LPM_MTRIE_INDEX32
+#define MTRIE_INDEX_SHIFT   6                       /* block index unit is one cache line */
+#define MTRIE_UNIFORM_INDEX ((mtrie_base_t)MTRIE_SPARSE_TAG)  /* offset 0 is never a block */
+
+/* Block pointer of index, tagged for sparse block */
+static inline mtrie_node_t *mtrie_base(lpm_mtrie_t *mtrie, mtrie_base_t base)
+{
+    if (base == 0) {
+        return NULL;
+    }
+    if (base == MTRIE_UNIFORM_INDEX) {
+        return MTRIE_UNIFORM_BLOCK;
+    }
+
+    return (mtrie_node_t *)(((unsigned long)(mtrie->region.base +
+                            (((size_t)(base >> 1)) << MTRIE_INDEX_SHIFT))) | (base & MTRIE_SPARSE_TAG));
+}
+
+/* Block index of pointer, block is in replica's region */
+static inline mtrie_base_t mtrie_base_of(lpm_mtrie_t *mtrie, mtrie_node_t *block)
+{
+    size_t off;
+
+    if (block == NULL) {
+        return 0;
+    }
+    if (block == MTRIE_UNIFORM_BLOCK) {
+        return MTRIE_UNIFORM_INDEX;
+    }
+
+    off = ((u8 *)MTRIE_SPARSE(block)) - mtrie->region.base;
+    assert(off < mtrie->region.size && (off & (LPM_CACHE_LINE - 1)) == 0);
+
+    return (mtrie_base_t)(((off >> MTRIE_INDEX_SHIFT) << 1) | MTRIE_IS_SPARSE(block));
+}
+
+static inline void *mtrie_data(mtrie_node_t *entry)
+{
+    return (void *)(unsigned long)entry->data;
+}
+
+static inline mtrie_data_t mtrie_data_of(void *data)
+{
+    return (mtrie_data_t)(unsigned long)data;
+}
+
+/* Data must fit in 32-bit handle of entry */
+static inline int mtrie_data_valid(void *data)
+{
+    return ((unsigned long)data) <= 0xFFFFFFFFUL;
+}
+#else
+static inline mtrie_node_t *mtrie_base(lpm_mtrie_t *mtrie, mtrie_base_t base)
+{
+    return base;
+}
+
+static inline mtrie_base_t mtrie_base_of(lpm_mtrie_t *mtrie, mtrie_node_t *block)
+{
+    return block;
+}
+
+static inline void *mtrie_data(mtrie_node_t *entry)
+{
+    return entry->data;
+}
+
+static inline mtrie_data_t mtrie_data_of(void *data)
+{
+    return data;
+}
+
+static inline int mtrie_data_valid(void *data)
+{
+    return 1;
+}
+#endif
+
+static mtrie_node_t *mtrie_mem_alloc(lpm_slab_t *arena, struct lpm_lkup_table_stat *stat)
+{
+    mtrie_node_t *ret;
+
+    assert(arena != NULL);
+    assert(stat != NULL);
+
+    ret = lpm_slab_alloc(arena);
+
+    if (ret != NULL) {
+        memset(ret, 0, MTRIE_BLOCK_ALLOC_SIZE);
+        stat->mtrie_block_alloc_stat++;
+        stat->mtrie_block_alloc_total_stat++;
+    } else {
+        stat->mtrie_block_alloc_fail_stat++;
+    }
+    
+    return ret;
+}
+
+static void mtrie_mem_free(lpm_slab_t *arena, struct lpm_lkup_table_stat *stat, mtrie_node_t *p)
+{
+    assert(arena != NULL);
+    assert(stat != NULL);
+
+    if (p != NULL) {
+        assert(stat->mtrie_block_alloc_stat > 0);
+        lpm_slab_free(arena, p);
+        stat->mtrie_block_alloc_stat--;
+        stat->mtrie_block_free_total_stat++;
+    }
+}
+
+static mtrie_node_t *mtrie_alloc_block(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie)
+{
+    mtrie_node_t *base = NULL;
+
+    assert(table != NULL);
+    assert(mtrie != NULL);
+
+    base = mtrie_mem_alloc(&mtrie->arena, &table->stat);
+    if (base == NULL) {
+        lpm_debug_mem(table, "Mtrie block [%d Bytes] allocate failed\n", MTRIE_BLOCK_ALLOC_SIZE);
+    } else {
+        LPM_TRACE_BLOCK(LPM_TRACE_BLOCK_ALLOC, table, MTRIE_BLOCK_ENTRY);
+    }
+    
+    return base;
+}
+
+/* Return tagged pointer of empty sparse block */
+static mtrie_node_t *mtrie_alloc_sparse(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie)
+{
+    mtrie_sparse_t *sparse;
+
+    assert(table != NULL);
+    assert(mtrie != NULL);
+
+    sparse = lpm_slab_alloc(&mtrie->sparse_arena);
+
+    if (sparse == NULL) {
+        table->stat.mtrie_block_alloc_fail_stat++;
+        lpm_debug_mem(table, "Mtrie sparse block [%d Bytes] allocate failed\n", (int)sizeof(mtrie_sparse_t));
+        return NULL;
+    }
+
+    /* All entries share slot 0, which is empty */
+    memset(sparse, 0, sizeof(mtrie_sparse_t));
+    table->stat.mtrie_sparse_alloc_stat++;
+    table->stat.mtrie_block_alloc_total_stat++;
+    LPM_TRACE_BLOCK(LPM_TRACE_BLOCK_ALLOC, table, MTRIE_SPARSE_SLOTS);
+
+    return (mtrie_node_t *)(((unsigned long)sparse) | MTRIE_SPARSE_TAG);
+}
+
+/* Sub-level block newly added to m-trie, starts as sparse block when the table supports */
+static mtrie_node_t *mtrie_alloc_sub_block(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie)
+{
+    if (table->flags & LPM_TABLE_SPARSE) {
+        return mtrie_alloc_sparse(table, mtrie);
+    }
+
+    return mtrie_alloc_block(table, mtrie);
+}
+
+static void __mtrie_free_block(lpm_lkup_table_t *table,
+                               lpm_mtrie_t *mtrie,
+                               mtrie_node_t *base,
+                               u32 *recur_times)
+{
+    int i;
+    mtrie_node_t *entry;
+
+    assert(table != NULL);
+    
+#if LPM_DEBUG_RECURSION
+    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
+        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
+    }
+    *recur_times = *recur_times + 1;
+#endif
+
+    if (base == NULL || base == MTRIE_UNIFORM_BLOCK) {
+        return;
+    }
+
+    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+        entry = mtrie_entry(base, i);
+        if (mtrie_base(mtrie, entry->base) != NULL && mtrie_base(mtrie, entry->base) != MTRIE_UNIFORM_BLOCK) {
+            /* Entry with sub-block owns its slot in sparse block, sub-block is visited once */
+            __mtrie_free_block(table, mtrie, mtrie_base(mtrie, entry->base), recur_times);
+
+#if LPM_DEBUG_RECURSION
+            *recur_times = *recur_times - 1;
+#endif 
+        }
+    }
+
+    if (MTRIE_IS_SPARSE(base)) {
+        assert(table->stat.mtrie_sparse_alloc_stat > 0);
+        lpm_slab_free(&mtrie->sparse_arena, MTRIE_SPARSE(base));
+        table->stat.mtrie_sparse_alloc_stat--;
+        table->stat.mtrie_block_free_total_stat++;
+        LPM_TRACE_BLOCK(LPM_TRACE_BLOCK_FREE, table, MTRIE_SPARSE_SLOTS);
+        return;
+    }
+
+    mtrie_mem_free(&mtrie->arena, &table->stat, base);
+    LPM_TRACE_BLOCK(LPM_TRACE_BLOCK_FREE, table, MTRIE_BLOCK_ENTRY);
+}
+
+static void mtrie_free_block(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, mtrie_node_t *base)
+{
+    u32 recur_times = 0;
+
+    __mtrie_free_block(table, mtrie, base, &recur_times);
+}
+
+/*
+ * Count entries referring every slot of sparse block, entries in [skip_lo, skip_hi] which
+ * share slots are not counted, since they are going to be rewritten.
+ */
+static void mtrie_sparse_refcnt(mtrie_sparse_t *sparse, u32 *refcnt, u32 skip_lo, u32 skip_hi)
+{
+    u32 i;
+
+    memset(refcnt, 0, sizeof(u32) * MTRIE_SPARSE_SLOTS);
+    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+        if (i >= skip_lo && i <= skip_hi && !sparse->slot[sparse->map[i]].base) {
+            continue;
+        }
+        refcnt[sparse->map[i]]++;
+    }
+}
+
+/* Convert sparse block *ref into dense block when slots run out, *ref is updated */
+static mtrie_node_t *mtrie_sparse_upgrade(lpm_lkup_table_t *table,
+                                          lpm_mtrie_t *mtrie,
+                                          mtrie_base_t *ref)
+{
+    mtrie_sparse_t *sparse = MTRIE_SPARSE(mtrie_base(mtrie, *ref));
+    mtrie_node_t *dense;
+    int i;
+
+    dense = mtrie_alloc_block(table, mtrie);
+    if (dense == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+        *(dense + i) = sparse->slot[sparse->map[i]];
+    }
+
+    /* Data plane reads the same entries from sparse or dense block during converting */
+    *ref = mtrie_base_of(mtrie, dense);
+    lpm_slab_free(&mtrie->sparse_arena, sparse);
+    table->stat.mtrie_sparse_alloc_stat--;
+    table->stat.mtrie_block_free_total_stat++;
+    table->stat.mtrie_sparse_upgrade_stat++;
+    LPM_TRACE_BLOCK(LPM_TRACE_BLOCK_FREE, table, MTRIE_SPARSE_SLOTS);
+
+    return dense;
+}
+
+/*
+ * Return entry idx of block *ref which can be written alone. Entry of sparse block gets its own
+ * slot, and sparse block is upgraded to dense block when slots run out, *ref is updated then.
+ */
+static mtrie_node_t *mtrie_own_entry(lpm_lkup_table_t *table,
+                                     lpm_mtrie_t *mtrie,
+                                     mtrie_base_t *ref,
+                                     u8 idx)
+{
+    mtrie_sparse_t *sparse;
+    u32 refcnt[MTRIE_SPARSE_SLOTS];
+    u32 cur, s;
+
+    if (!MTRIE_IS_SPARSE(mtrie_base(mtrie, *ref))) {
+        return mtrie_base(mtrie, *ref) + idx;
+    }
+
+    sparse = MTRIE_SPARSE(mtrie_base(mtrie, *ref));
+    cur = sparse->map[idx];
+    if (sparse->slot[cur].base) {
+        return &(sparse->slot[cur]);
+    }
+
+    mtrie_sparse_refcnt(sparse, refcnt, 1, 0);
+    if (refcnt[cur] == 1) {
+        return &(sparse->slot[cur]);
+    }
+    for (s = 0; s < MTRIE_SPARSE_SLOTS; s++) {
+        if (refcnt[s] == 0) {
+            break;
+        }
+    }
+    if (s == MTRIE_SPARSE_SLOTS) {
+        if (mtrie_sparse_upgrade(table, mtrie, ref) == NULL) {
+            return NULL;
+        }
+        return mtrie_base(mtrie, *ref) + idx;
+    }
+
+    sparse->slot[s] = sparse->slot[cur];
+    sparse->map[idx] = s;
+
+    return &(sparse->slot[s]);
+}
+
+/*
+ * Write data in entries [lo, hi] of block *ref, entries holding folded data are kept.
+ * Sparse block is upgraded to dense block when slots run out, *ref is updated then.
+ */
+static lpm_result_t mtrie_set_data(lpm_lkup_table_t *table,
+                                   lpm_mtrie_t *mtrie,
+                                   mtrie_base_t *ref,
+                                   u32 lo,
+                                   u32 hi,
+                                   void *data)
+{
+    mtrie_sparse_t *sparse;
+    mtrie_node_t *entry;
+    u32 refcnt[MTRIE_SPARSE_SLOTS];
+    u32 i, s, free_slot = MTRIE_SPARSE_SLOTS, written = 0;
+
+    if (MTRIE_IS_SPARSE(mtrie_base(mtrie, *ref))) {
+        sparse = MTRIE_SPARSE(mtrie_base(mtrie, *ref));
+        mtrie_sparse_refcnt(sparse, refcnt, lo, hi);
+
+        /* Entries without sub-block share one slot holding data */
+        for (s = 0; s < MTRIE_SPARSE_SLOTS; s++) {
+            if (refcnt[s] == 0) {
+                if (free_slot == MTRIE_SPARSE_SLOTS) {
+                    free_slot = s;
+                }
+                continue;
+            }
+            if (!sparse->slot[s].base && mtrie_data(&sparse->slot[s]) == data) {
+                break;
+            }
+        }
+        if (s == MTRIE_SPARSE_SLOTS && free_slot != MTRIE_SPARSE_SLOTS) {
+            s = free_slot;
+            sparse->slot[s].base = mtrie_base_of(mtrie, NULL);
+            sparse->slot[s].data = mtrie_data_of(data);
+        }
+
+        if (s != MTRIE_SPARSE_SLOTS) {
+            for (i = lo; i <= hi; i++) {
+                entry = &(sparse->slot[sparse->map[i]]);
+                if (mtrie_base(mtrie, entry->base) == MTRIE_UNIFORM_BLOCK) {
+                    /* Folded data is more specific, keep it */
+                    continue;
+                }
+                if (entry->base) {
+                    entry->data = mtrie_data_of(data);
+                } else {
+                    sparse->map[i] = s;
+                }
+                written++;
+            }
+            table->stat.mtrie_entry_write_stat += written;
+            return LPM_SUCCESS;
+        }
+
+        if (mtrie_sparse_upgrade(table, mtrie, ref) == NULL) {
+            return LPM_ERR_RESOURCES;
+        }
+    }
+
+    for (i = lo; i <= hi; i++) {
+        entry = mtrie_base(mtrie, *ref) + i;
+        if (mtrie_base(mtrie, entry->base) == MTRIE_UNIFORM_BLOCK) {
+            /* Folded data is more specific, keep it */
+            continue;
+        }
+        entry->data = mtrie_data_of(data);
+        written++;
+    }
+    table->stat.mtrie_entry_write_stat += written;
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * Convert dense block under entry into sparse block, when its entries fit in half of the
+ * slots. Half is used so that a block around the limit is not converted back and forth.
+ */
+static void mtrie_sparse_downgrade(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, mtrie_node_t *entry)
+{
+    mtrie_node_t *dense = mtrie_base(mtrie, entry->base), *sparse_base;
+    mtrie_sparse_t temp;
+    u32 i, s, cnt = 0;
+
+    if (!(table->flags & LPM_TABLE_SPARSE) || dense == NULL || dense == MTRIE_UNIFORM_BLOCK ||
+        MTRIE_IS_SPARSE(dense)) {
+        return;
+    }
+
+    memset(&temp, 0, sizeof(mtrie_sparse_t));
+    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+        for (s = 0; !(dense + i)->base && s < cnt; s++) {
+            if (!temp.slot[s].base && temp.slot[s].data == (dense + i)->data) {
+                break;
+            }
+        }
+        if ((dense + i)->base || s == cnt) {
+            if (cnt == (MTRIE_SPARSE_SLOTS >> 1)) {
+                /* Still crowded, keep dense block */
+                return;
+            }
+            s = cnt++;
+            temp.slot[s] = *(dense + i);
+        }
+        temp.map[i] = s;
+    }
+
+    sparse_base = mtrie_alloc_sparse(table, mtrie);
+    if (sparse_base == NULL) {
+        return;
+    }
+    memcpy(MTRIE_SPARSE(sparse_base), &temp, sizeof(mtrie_sparse_t));
+
+    /* Data plane reads the same entries from sparse or dense block during converting */
+    entry->base = mtrie_base_of(mtrie, sparse_base);
+    mtrie_mem_free(&mtrie->arena, &table->stat, dense);
+    table->stat.mtrie_sparse_downgrade_stat++;
+    LPM_TRACE_BLOCK(LPM_TRACE_BLOCK_FREE, table, MTRIE_BLOCK_ENTRY);
+}
+
+/*
+ * Fold block under entry into entry, when all its 256 entries hold the same data and no sub-block.
+ * Such block costs one cache miss but tells nothing more than a single entry. Entry's data is then
+ * the folded data, which is more specific than any data at entry's own level.
+ * All NULL block is not folded here, deletion releases it.
+ */
+static void mtrie_fold_block(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, mtrie_node_t *entry)
+{
+    mtrie_node_t *block = mtrie_base(mtrie, entry->base);
+    void *data;
+    int i;
+
+    if (block == NULL || block == MTRIE_UNIFORM_BLOCK) {
+        return;
+    }
+
+    data = mtrie_data(mtrie_entry(block, 0));
+    if (data == NULL) {
+        return;
+    }
+    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+        if (mtrie_data(mtrie_entry(block, i)) != data || mtrie_entry(block, i)->base) {
+            return;
+        }
+    }
+
+    /* Data plane gets the same data from entry or from block during folding */
+    entry->data = mtrie_data_of(data);
+    entry->base = mtrie_base_of(mtrie, MTRIE_UNIFORM_BLOCK);
+    mtrie_free_block(table, mtrie, block);
+    table->stat.mtrie_block_fold_stat++;
+
+    lpm_debug_norm(table, "uniform block folded, data <%p>\n", data);
+}
+
+/*
+ * Fold block of level on addr's path into its parent entry if it is uniform, otherwise turn it
+ * into sparse block if it is nearly empty.
+ */
+static void mtrie_fold_path(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, u8 *addr, u32 level)
+{
+    mtrie_node_t *entry = NULL, *base;
+    u32 i;
+
+    base = mtrie_base(mtrie, mtrie->hi256_table_base);
+    for (i = 0; i < level; i++) {
+        if (base == NULL || base == MTRIE_UNIFORM_BLOCK) {
+            return;
+        }
+        entry = mtrie_entry(base, addr[i]);
+        base = mtrie_base(mtrie, entry->base);
+    }
+
+    if (entry != NULL) {
+        mtrie_fold_block(table, mtrie, entry);
+        mtrie_sparse_downgrade(table, mtrie, entry);
+    }
+}
+
+/*
+ * Expand folded block under entry addr[0..level] again, before writing below the entry.
+ * Entry's own level data is restored from 1-trie.
+ */
+static mtrie_node_t *mtrie_unfold_block(lpm_lkup_table_t *table,
+                                        lpm_mtrie_t *mtrie,
+                                        mtrie_node_t *entry,
+                                        u8 *addr,
+                                        u32 level)
+{
+    mtrie_base_t block;
+
+    assert(mtrie_base(mtrie, entry->base) == MTRIE_UNIFORM_BLOCK);
+
+    block = mtrie_base_of(mtrie, mtrie_alloc_sub_block(table, mtrie));
+    if (!block) {
+        return NULL;
+    }
+    /* Empty block has room for one data, never fails */
+    (void)mtrie_set_data(table, mtrie, &block, 0, MTRIE_BLOCK_ENTRY - 1, mtrie_data(entry));
+
+    /* Data plane gets the same data from entry or from block during unfolding */
+    entry->base = block;
+    entry->data = mtrie_data_of(btrie_level_data(table->btrie_root, addr, level));
+    table->stat.mtrie_block_unfold_stat++;
+
+    return mtrie_base(mtrie, block);
+}
+
+/*
+ * Reserve m-trie blocks in every replica before writing any replica, so that replicas never
+ * become different due to allocation failure in one of them, and nothing is touched when
+ * memory is not enough.
+ * Writing prefix's level block allocates missing or folded blocks on the path, and upgrades
+ * at most two sparse blocks, the one hooking new blocks and the level block itself.
+ */
+static lpm_result_t mtrie_reserve_path(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    lpm_mtrie_t *mtrie;
+    mtrie_node_t *base;
+    u32 level, cnt, blocks, sparse, upgrades;
+
+    if (masklen == 0) {
+        return LPM_SUCCESS;
+    }
+    cnt = (masklen - 1) >> 0x3;
+
+    for_each_mtrie(table, mtrie) {
+        blocks = 0;
+        upgrades = 0;
+        base = mtrie_base(mtrie, mtrie->hi256_table_base);
+        for (level = 1; level <= cnt; level++) {
+            if (base != NULL && base != MTRIE_UNIFORM_BLOCK) {
+                base = mtrie_base(mtrie, mtrie_entry(base, addr[level - 1])->base);
+            } else {
+                base = NULL;                /* blocks below missing or folded block are missing */
+            }
+            if (base == NULL || base == MTRIE_UNIFORM_BLOCK) {
+                blocks++;
+            } else if (MTRIE_IS_SPARSE(base) && upgrades < 2) {
+                upgrades++;
+            }
+        }
+
+        sparse = 0;
+        if (table->flags & LPM_TABLE_SPARSE) {
+            sparse = blocks;
+            blocks = upgrades;
+        }
+
+        if (lpm_slab_reserve(&mtrie->sparse_arena, sparse) != LPM_SUCCESS ||
+            lpm_slab_reserve(&mtrie->arena, blocks) != LPM_SUCCESS) {
+            lpm_debug_mem(table, "reserve %u mtrie blocks and %u sparse blocks on NUMA node %d failed\n",
+                                    blocks, sparse, mtrie->numa_node);
+            table->stat.mtrie_block_alloc_fail_stat++;
+            return LPM_ERR_RESOURCES;
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * Release blocks relocated by the last compacting, which lookups in progress then may still
+ * read. Slabs emptied by them are recycled when lpm_compact() asks, so memory does not grow
+ * round by round and not every call walks all slabs.
+ */
+static void mtrie_compact_release(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie)
+{
+    mtrie_node_t *base;
+    u32 i, recycled;
+
+    for (i = 0; i < mtrie->compact_retired_cnt; i++) {
+        base = mtrie->compact_retired[i];
+        if (MTRIE_IS_SPARSE(base)) {
+            lpm_slab_free(&mtrie->sparse_arena, MTRIE_SPARSE(base));
+        } else {
+            lpm_slab_free(&mtrie->arena, base);
+        }
+    }
+    mtrie->compact_retired_cnt = 0;
+
+    if (mtrie->compact_recycle) {
+        mtrie->compact_recycle = 0;
+        recycled = lpm_slab_recycle(&mtrie->arena) + lpm_slab_recycle(&mtrie->sparse_arena);
+        lpm_debug_norm(table, "%u mtrie blocks released and %u slabs recycled on NUMA node %d\n",
+                                i, recycled, mtrie->numa_node);
+    }
+}
+
+/* Forget compacting of replica, retired blocks are forgotten with their arena */
+static void mtrie_compact_forget(lpm_mtrie_t *mtrie)
+{
+    free(mtrie->compact_queue);
+    mtrie->compact_queue = NULL;
+    mtrie->compact_queue_max = 0;
+    mtrie->compact_head = 0;
+    mtrie->compact_tail = 0;
+    mtrie->compact_state = LPM_COMPACT_IDLE;
+    free(mtrie->compact_retired);
+    mtrie->compact_retired = NULL;
+    mtrie->compact_retired_max = 0;
+    mtrie->compact_retired_cnt = 0;
+    mtrie->compact_moved = 0;
+    mtrie->compact_recycle = 0;
+}
+
+/*
+ * Make room for cnt more references in compact queue. Relocated blocks are dropped from the
+ * head when they take half of the queue, queue is doubled otherwise.
+ */
+static lpm_result_t mtrie_compact_queue_reserve(lpm_mtrie_t *mtrie, u32 cnt)
+{
+    mtrie_base_t **queue;
+    u32 max;
+
+    if (mtrie->compact_tail + cnt <= mtrie->compact_queue_max) {
+        return LPM_SUCCESS;
+    }
+
+    if (mtrie->compact_head >= (mtrie->compact_queue_max >> 1) &&
+        mtrie->compact_tail - mtrie->compact_head + cnt <= mtrie->compact_queue_max) {
+        memmove(mtrie->compact_queue, mtrie->compact_queue + mtrie->compact_head,
+                (mtrie->compact_tail - mtrie->compact_head) * sizeof(mtrie_base_t *));
+        mtrie->compact_tail -= mtrie->compact_head;
+        mtrie->compact_head = 0;
+        return LPM_SUCCESS;
+    }
+
+    for (max = (mtrie->compact_queue_max != 0) ? mtrie->compact_queue_max : MTRIE_BLOCK_ENTRY;
+         max < mtrie->compact_tail + cnt; max <<= 1) {
+        ;
+    }
+    queue = realloc(mtrie->compact_queue, ((size_t)max) * sizeof(mtrie_base_t *));
+    if (queue == NULL) {
+        return LPM_ERR_RESOURCES;
+    }
+    mtrie->compact_queue = queue;
+    mtrie->compact_queue_max = max;
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * Relocate blocks of m-trie replica breadth-first into never used memory, at most budget
+ * blocks (0 for no limit). Queue of blocks to relocate is kept in replica, so every call goes
+ * on from where the former one stops and costs its budget only. Block is copied before its
+ * parent's base is switched to the copy, so lookups get the same data from the old block or
+ * from the copy. Children are queued by their entries in the copy. Old blocks are retired,
+ * and released by mtrie_compact_release() of the next compacting.
+ * Return LPM_ERR_AGAIN when budget is used up before all blocks are visited.
+ */
+static lpm_result_t mtrie_compact(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, u32 budget)
+{
+    lpm_result_t ret = LPM_SUCCESS;
+    mtrie_base_t *ref;
+    mtrie_node_t *base, *copy, *entry, **retired;
+    u32 moved = 0, max;
+    int i;
+
+    assert(mtrie->compact_retired_cnt == 0);
+
+    /* Every block of replica is retired once at most, hi256_table_base included */
+    max = budget;
+    if (max == 0) {
+        max = ((u32)(table->stat.mtrie_block_alloc_stat + table->stat.mtrie_sparse_alloc_stat)) + 1;
+    }
+    if (max > mtrie->compact_retired_max) {
+        retired = realloc(mtrie->compact_retired, ((size_t)max) * sizeof(mtrie_node_t *));
+        if (retired == NULL) {
+            lpm_debug_mem(table, "compact retired [%u entries] alloc failed\n", max);
+            return LPM_ERR_RESOURCES;
+        }
+        mtrie->compact_retired = retired;
+        mtrie->compact_retired_max = max;
+    }
+
+    if (mtrie->compact_state == LPM_COMPACT_IDLE) {
+        mtrie->compact_head = 0;
+        mtrie->compact_tail = 0;
+        if (mtrie_compact_queue_reserve(mtrie, 1) != LPM_SUCCESS) {
+            lpm_debug_mem(table, "compact queue alloc failed\n");
+            return LPM_ERR_RESOURCES;
+        }
+        mtrie->compact_queue[mtrie->compact_tail++] = &mtrie->hi256_table_base;
+        mtrie->compact_state = LPM_COMPACT_RUNNING;
+    }
+
+    while (mtrie->compact_head < mtrie->compact_tail) {
+        if (budget != 0 && moved == budget) {
+            ret = LPM_ERR_AGAIN;
+            break;
+        }
+        /* Children of block are all queued, or block is not relocated */
+        if (mtrie_compact_queue_reserve(mtrie, MTRIE_BLOCK_ENTRY) != LPM_SUCCESS) {
+            lpm_debug_mem(table, "compact queue [%u entries] grow failed\n", mtrie->compact_queue_max);
+            ret = LPM_ERR_RESOURCES;
+            break;
+        }
+        ref = mtrie->compact_queue[mtrie->compact_head];
+        base = mtrie_base(mtrie, *ref);
+
+        if (MTRIE_IS_SPARSE(base)) {
+            copy = lpm_slab_carve(&mtrie->sparse_arena);
+            if (copy != NULL) {
+                memcpy(copy, MTRIE_SPARSE(base), sizeof(mtrie_sparse_t));
+                copy = (mtrie_node_t *)(((unsigned long)copy) | MTRIE_SPARSE_TAG);
+            }
+        } else {
+            copy = lpm_slab_carve(&mtrie->arena);
+            if (copy != NULL) {
+                memcpy(copy, base, MTRIE_BLOCK_ALLOC_SIZE);
+            }
+        }
+        if (copy == NULL) {
+            lpm_debug_mem(table, "compact block alloc failed, %u blocks relocated\n", moved);
+            ret = LPM_ERR_RESOURCES;
+            break;
+        }
+
+        /* Copy is complete before it is reachable */
+        __atomic_store_n(ref, mtrie_base_of(mtrie, copy), __ATOMIC_RELEASE);
+        assert(mtrie->compact_retired_cnt < mtrie->compact_retired_max);
+        mtrie->compact_retired[mtrie->compact_retired_cnt++] = base;
+        mtrie->compact_head++;
+        moved++;
+
+        for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+            /* Entry with sub-block owns its slot in sparse block, sub-block is queued once */
+            entry = mtrie_entry(copy, i);
+            if (entry->base && mtrie_base(mtrie, entry->base) != MTRIE_UNIFORM_BLOCK) {
+                mtrie->compact_queue[mtrie->compact_tail++] = &entry->base;
+            }
+        }
+    }
+
+    if (ret == LPM_SUCCESS) {
+        mtrie->compact_state = LPM_COMPACT_DONE;
+    }
+    mtrie->compact_moved += moved;
+    table->stat.mtrie_block_compact_stat += moved;
+    lpm_debug_norm(table, "%u mtrie blocks relocated on NUMA node %d, %u queued, ret %d\n",
+                            moved, mtrie->numa_node, mtrie->compact_tail - mtrie->compact_head, ret);
+
+    return ret;
+}
+
+/* Online NUMA nodes, eg. "0-1,3", node ID larger than LPM_NUMA_NODE_MAX is ignored */
+static int lpm_numa_online_nodes(int *nodes, int max)
+{
+    FILE *fp;
+    char buf[128], *p, *end;
+    long lo, hi;
+    int cnt = 0;
+
+    fp = fopen("/sys/devices/system/node/online", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    p = fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    if (p == NULL) {
+        return 0;
+    }
+
+    while (cnt < max) {
+        lo = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for ( ; lo <= hi && cnt < max; lo++) {
+            if (lo < LPM_NUMA_NODE_MAX) {
+                nodes[cnt++] = (int)lo;
+            }
+        }
+        if (*end != ',') {
+            break;
+        }
+        p = end + 1;
+    }
+
+    return cnt;
+}
+
+/* NUMA node of calling thread, detected once and cached */
+static __thread int lpm_thread_numa_node = -1;
+
+static inline int lpm_numa_local_node(void)
+{
+    unsigned int cpu, node;
+
+    if (unlikely(lpm_thread_numa_node < 0)) {
+        if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+            node = 0;
+        }
+        lpm_thread_numa_node = node % LPM_NUMA_NODE_MAX;
+    }
+
+    return lpm_thread_numa_node;
+}
+
+void lpm_numa_refresh_thread(void)
+{
+    lpm_thread_numa_node = -1;
+}
+
+static void mtrie_destroy(lpm_lkup_table_t *table);
+
+/* Create shared memory object of table, and map it as m-trie region of the only replica */
+static lpm_result_t lpm_shm_region_init(lpm_lkup_table_t *table, lpm_region_t *region,
+                                        size_t size, size_t align)
+{
+    lpm_result_t ret = LPM_ERR_RESOURCES;
+    int fd;
+
+    fd = shm_open(table->shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        lpm_debug_mem(table, "create shared memory <%s> failed\n", table->shm_name);
+        return LPM_ERR_RESOURCES;
+    }
+    /* Pages of shared memory are allocated when blocks are written, like private region */
+    if (ftruncate(fd, (off_t)size) == 0) {
+        ret = lpm_region_init(region, size, align, fd, PROT_READ | PROT_WRITE);
+    }
+    close(fd);
+    if (ret != LPM_SUCCESS) {
+        shm_unlink(table->shm_name);
+        return ret;
+    }
+
+    assert(sizeof(lpm_shm_hdr_t) <= LPM_CACHE_LINE);
+    table->shm = (lpm_shm_hdr_t *)region->base;
+
+    return LPM_SUCCESS;
+}
+
+/* Publish root block and default data of shared table to reader processes */
+static void lpm_shm_publish(lpm_lkup_table_t *table)
+{
+    if (table->shm == NULL || (table->flags & LPM_TABLE_ATTACHED)) {
+        return;
+    }
+
+    __atomic_store_n(&table->shm->default_data, (u32)(unsigned long)table->default_data, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->shm->root, (u32)(unsigned long)table->mtrie[0].hi256_table_base,
+                     __ATOMIC_RELEASE);
+}
+
+/* Header is valid for reader processes once magic is written */
+static void lpm_shm_hdr_init(lpm_lkup_table_t *table)
+{
+    lpm_shm_hdr_t *shm = table->shm;
+
+    shm->version = LPM_SHM_VERSION;
+    shm->entry_size = sizeof(mtrie_node_t);
+    shm->sparse_size = sizeof(mtrie_sparse_t);
+    shm->size = table->mtrie[0].region.size;
+    snprintf(shm->name, sizeof(shm->name), "%s", table->name);
+    lpm_shm_publish(table);
+    __atomic_store_n(&shm->magic, LPM_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+static lpm_result_t mtrie_init(lpm_lkup_table_t *table)
+{
+    lpm_mtrie_t *mtrie;
+    int nodes[LPM_NUMA_NODE_MAX];
+    u32 arena_flags = 0;
+    size_t region_size, region_align = LPM_HUGEPAGE_SIZE;
+    lpm_result_t ret;
+    int i, cnt;
+
+    if (table == NULL) {
+        return LPM_ERR_INVALID;
+    }
+
+    if (table->mtrie_cnt != 0) {
+        lpm_debug_norm(table, "M-trie table already exists\n");
+        return LPM_ERR_EXISTS;
+    }
+
+    if (table->flags & LPM_TABLE_HUGEPAGE_1G) {
+        arena_flags = LPM_SLAB_HUGEPAGE_1G;
+        region_align = LPM_HUGEPAGE_1G_SIZE;
+    } else if (table->flags & LPM_TABLE_HUGEPAGE) {
+        arena_flags = LPM_SLAB_HUGEPAGE;
+    }
+
+    /* Region is address space only, it is as large as block index addresses unless limited */
+    region_size = LPM_REGION_SIZE_MAX;
+    if (table->budget.limit != 0 && table->budget.limit + region_align < region_size) {
+        region_size = (table->budget.limit + 2 * region_align - 1) & (~(region_align - 1));
+    }
+
+    cnt = 0;
+    /* Shared table has the only replica, which all reader processes walk through */
+    if ((table->flags & LPM_TABLE_NUMA_REPLICA) && table->shm_name[0] == '\0') {
+        cnt = lpm_numa_online_nodes(nodes, LPM_NUMA_NODE_MAX);
+        if (cnt <= 0) {
+            lpm_debug_norm(table, "NUMA nodes not found, M-trie is not replicated\n");
+        }
+    }
+    if (cnt <= 0) {
+        cnt = 1;
+        nodes[0] = -1;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        mtrie = &(table->mtrie[i]);
+        /* Blocks on a lookup path are colored, they do not evict each other from cache sets */
+        lpm_slab_init(&mtrie->arena, MTRIE_BLOCK_ALLOC_SIZE, LPM_MTRIE_ARENA_BLOCKS,
+                      arena_flags | LPM_SLAB_COLOR);
+        mtrie->arena.numa_node = nodes[i];
+        mtrie->arena.budget = &table->budget;
+        mtrie->arena.allocator = &table->allocator;
+        lpm_slab_init(&mtrie->sparse_arena, sizeof(mtrie_sparse_t), LPM_SPARSE_ARENA_BLOCKS, arena_flags);
+        mtrie->sparse_arena.numa_node = nodes[i];
+        mtrie->sparse_arena.budget = &table->budget;
+        mtrie->sparse_arena.allocator = &table->allocator;
+        mtrie->numa_node = nodes[i];
+        table->mtrie_cnt++;
+
+        /* Blocks are addressed by index in region, so they never come from user allocator */
+        if (LPM_MTRIE_INDEX32) {
+            if (table->shm_name[0] != '\0') {
+                ret = lpm_shm_region_init(table, &mtrie->region, region_size, region_align);
+            } else {
+                ret = lpm_region_init(&mtrie->region, region_size, region_align, -1, 0);
+            }
+            if (ret != LPM_SUCCESS) {
+                lpm_debug_mem(table, "M-trie region [%lu Bytes] reserve failed\n", (unsigned long)region_size);
+                mtrie_destroy(table);
+                return LPM_ERR_RESOURCES;
+            }
+            mtrie->arena.region = &mtrie->region;
+            mtrie->sparse_arena.region = &mtrie->region;
+        }
+
+        mtrie->hi256_table_base = mtrie_base_of(mtrie, mtrie_alloc_block(table, mtrie));
+        if (!mtrie->hi256_table_base) {
+            lpm_debug_mem(table, "M-trie base table [%d Bytes] of LPM alloc failed\n",
+                                        MTRIE_BLOCK_ALLOC_SIZE);
+            mtrie_destroy(table);
+            return LPM_ERR_RESOURCES;
+        }
+        if (nodes[i] >= 0) {
+            table->numa_mtrie[nodes[i]] = i;
+        }
+    }
+    if (table->shm != NULL) {
+        lpm_shm_hdr_init(table);
+    }
+    
+    lpm_debug_norm(table, "M-trie is initialized, %u replicas\n", table->mtrie_cnt);
+
+    return LPM_SUCCESS;
+}
+
+static void mtrie_destroy(lpm_lkup_table_t *table)
+{
+    lpm_mtrie_t *mtrie;
+
+    if (table == NULL) {
+        return;
+    }
+
+    /* All m-trie blocks come from arena, release whole arena instead of walking m-trie */
+    for_each_mtrie(table, mtrie) {
+        lpm_slab_destroy(&mtrie->arena);
+        lpm_slab_destroy(&mtrie->sparse_arena);
+        lpm_region_destroy(&mtrie->region);
+        mtrie->hi256_table_base = mtrie_base_of(mtrie, NULL);
+        mtrie_compact_forget(mtrie);
+    }
+    /* Reader processes keep their mapping, memory is released when they are all detached */
+    if (table->shm != NULL && !(table->flags & LPM_TABLE_ATTACHED)) {
+        shm_unlink(table->shm_name);
+    }
+    table->shm = NULL;
+    table->stat.mtrie_block_alloc_stat = 0;
+    table->stat.mtrie_sparse_alloc_stat = 0;
+    table->mtrie_cnt = 0;
+    
+    lpm_debug_norm(table, "M-trie is destroyed\n");
+}
+
+/*
+ * Reserve memory for expected prefixes, then seal all slab allocators so that the table never
+ * gets more memory later. At most two 1-trie nodes are added for one prefix.
+ */
+static lpm_result_t lpm_reserve_table(lpm_lkup_table_t *table)
+{
+    lpm_mtrie_t *mtrie;
+    size_t nodes, blocks, sparse = 0;
+
+    if (table->expected_prefixes == 0) {
+        return LPM_SUCCESS;
+    }
+
+    nodes = ((size_t)table->expected_prefixes) * 2;
+    blocks = table->expected_prefixes / LPM_RESERVE_PREFIXES_PER_BLOCK + LPM_LEVEL_MAX;
+    if (table->flags & LPM_TABLE_SPARSE) {
+        /* New blocks start as sparse blocks, only crowded ones are upgraded to dense */
+        sparse = blocks;
+        blocks = sparse / LPM_RESERVE_SPARSE_PER_DENSE + LPM_LEVEL_MAX;
+    }
+
+    if (lpm_slab_reserve(&table->btrie_slab, nodes) != LPM_SUCCESS) {
+        lpm_debug_mem(table, "reserve %lu btrie nodes failed\n", (unsigned long)nodes);
+        return LPM_ERR_RESOURCES;
+    }
+    table->btrie_slab.flags |= LPM_SLAB_FIXED;
+
+    for_each_mtrie(table, mtrie) {
+        if (lpm_slab_reserve(&mtrie->arena, blocks) != LPM_SUCCESS ||
+            lpm_slab_reserve(&mtrie->sparse_arena, sparse) != LPM_SUCCESS) {
+            lpm_debug_mem(table, "reserve %lu mtrie blocks and %lu sparse blocks on NUMA node %d failed\n",
+                                    (unsigned long)blocks, (unsigned long)sparse, mtrie->numa_node);
+            return LPM_ERR_RESOURCES;
+        }
+        mtrie->arena.flags |= LPM_SLAB_FIXED;
+        mtrie->sparse_arena.flags |= LPM_SLAB_FIXED;
+    }
+
+    lpm_debug_norm(table, "reserved for %u prefixes, %lu btrie nodes, %lu mtrie blocks, %lu sparse blocks\n",
+                            table->expected_prefixes, (unsigned long)nodes, (unsigned long)blocks,
+                            (unsigned long)sparse);
+
+    return LPM_SUCCESS;
+}
+
+/*******************************
+ * Write statistic rel. codes
+ */
+
+/* Cumulative m-trie writes, updates take the difference */
+static inline void lpm_write_sample(lpm_lkup_table_t *table, lpm_write_count_t *count)
+{
+    count->entries = table->stat.mtrie_entry_write_stat;
+    count->blocks_alloc = table->stat.mtrie_block_alloc_total_stat;
+    count->blocks_free = table->stat.mtrie_block_free_total_stat;
+}
+
+/* Start counting m-trie writes of update, return 0 when arguments are too bad to count */
+static inline int lpm_write_begin(lpm_lkup_table_t *table, u8 *addr, u32 masklen, lpm_write_count_t *begin)
+{
+    if (table == NULL || addr == NULL || masklen > LPM_MASKLEN_MAX) {
+        return 0;
+    }
+    lpm_write_sample(table, begin);
+    lpm_trace_begin(table, addr, masklen);
+
+    return 1;
+}
+
+/*
+ * M-trie writes of update of prefix addr/masklen since begin, return entries written. Failed
+ * update is counted only as failed, its writes stay in the cumulative counters.
+ */
+static unsigned long lpm_write_end(lpm_lkup_table_t *table, lpm_write_count_t *begin,
+                                   u8 *addr, u32 masklen, lpm_result_t ret)
+{
+    struct lpm_lkup_table_stat *stat = &table->stat;
+    lpm_write_count_t *last = &stat->write_last;
+
+    lpm_trace_end(table);
+    if (ret != LPM_SUCCESS) {
+        stat->write_failed++;
+        return table->stat.mtrie_entry_write_stat - begin->entries;
+    }
+    lpm_write_sample(table, last);
+    last->entries -= begin->entries;
+    last->blocks_alloc -= begin->blocks_alloc;
+    last->blocks_free -= begin->blocks_free;
+    stat->write_updates++;
+
+    if (last->entries > stat->write_max.entries) {
+        stat->write_max = *last;
+        memset(stat->write_max_addr, 0, sizeof(stat->write_max_addr));
+        memcpy(stat->write_max_addr, addr, (masklen + 7) >> 3);
+        stat->write_max_masklen = masklen;
+        lpm_debug_norm(table, "update of /%u writes %lu entries, %lu blocks allocated, %lu freed\n",
+                                masklen, last->entries, last->blocks_alloc, last->blocks_free);
+    }
+
+    return last->entries;
+}
+
+lpm_result_t lpm_write_stat(lpm_lkup_table_t *table, lpm_write_stat_t *stat)
+{
+    if (table == NULL || stat == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    stat->updates = table->stat.write_updates;
+    stat->failed = table->stat.write_failed;
+    lpm_write_sample(table, &stat->total);
+    stat->last = table->stat.write_last;
+    stat->max = table->stat.write_max;
+    memcpy(stat->max_addr, table->stat.write_max_addr, sizeof(stat->max_addr));
+    stat->max_masklen = table->stat.write_max_masklen;
+
+    return LPM_SUCCESS;
+}
+
+/*******************************
+ * Hit counter rel. codes
+ */
+
+/* Shards of calling thread, by table and generation */
+static __thread struct {
+    lpm_lkup_table_t *table;
+    unsigned long gen;
+    lpm_hit_shard_t *shard;                 /* NULL for failing to get one */
+} lpm_hit_cache[LPM_HIT_CACHE];
+static __thread u32 lpm_hit_cache_next;
+static unsigned long lpm_hit_gen;
+
+/* Shard of calling thread, found in table's shards or newly added to them */
+static lpm_hit_shard_t *lpm_hit_shard_get(lpm_lkup_table_t *table)
+{
+    void *owner = &lpm_hit_cache[0];        /* unique among live threads */
+    lpm_hit_shard_t *shard;
+    u32 i;
+
+    for (shard = __atomic_load_n(&table->hit.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        if (shard->owner == owner) {
+            break;
+        }
+    }
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(lpm_hit_shard_t) + sizeof(lpm_hit_slot_t) * table->hit.slots);
+        if (shard != NULL) {
+            shard->owner = owner;
+            shard->mask = table->hit.slots - 1;
+            shard->next = __atomic_load_n(&table->hit.shards, __ATOMIC_ACQUIRE);
+            while (!__atomic_compare_exchange_n(&table->hit.shards, &shard->next, shard, 0,
+                                                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                ;
+            }
+        } else {
+            lpm_debug_mem(table, "hit counters of %u slots allocate failed\n", table->hit.slots);
+        }
+    }
+
+    i = lpm_hit_cache_next++ % LPM_HIT_CACHE;
+    lpm_hit_cache[i].table = table;
+    lpm_hit_cache[i].gen = table->hit.gen;
+    lpm_hit_cache[i].shard = shard;
+
+    return shard;
+}
+
+/* Count lookup matching data in entry of depth-th m-trie block on addr's path, 0 for miss */
+static void lpm_hit_count(lpm_lkup_table_t *table, u8 *addr, u32 depth)
+{
+    lpm_hit_shard_t *shard = NULL;
+    lpm_hit_slot_t *slot;
+    u32 i, hash = 2166136261U;
+    int c;
+
+    for (c = 0; c < LPM_HIT_CACHE; c++) {
+        if (lpm_hit_cache[c].table == table && lpm_hit_cache[c].gen == table->hit.gen) {
+            shard = lpm_hit_cache[c].shard;
+            break;
+        }
+    }
+    if (c == LPM_HIT_CACHE) {
+        shard = lpm_hit_shard_get(table);
+    }
+    if (shard == NULL) {
+        return;
+    }
+    if (depth == 0) {
+        shard->misses++;
+        return;
+    }
+
+    for (i = 0; i < depth; i++) {
+        hash = (hash ^ addr[i]) * 16777619U;
+    }
+    for (i = hash & shard->mask; ; i = (i + 1) & shard->mask) {
+        slot = &shard->slot[i];
+        if (slot->depth == depth && memcmp(slot->key, addr, depth) == 0) {
+            slot->hits++;
+            return;
+        }
+        if (slot->depth == 0) {
+            break;
+        }
+    }
+    if (shard->used >= LPM_HIT_LOAD(shard->mask + 1)) {
+        shard->dropped++;
+        return;
+    }
+    memcpy(slot->key, addr, depth);
+    slot->hits = 1;
+    /* Slot is complete before reader sees it */
+    __atomic_store_n(&slot->depth, depth, __ATOMIC_RELEASE);
+    shard->used++;
+}
+
+static void lpm_hit_free(lpm_lkup_table_t *table)
+{
+    lpm_hit_shard_t *shard, *next;
+
+    for (shard = table->hit.shards; shard != NULL; shard = next) {
+        next = shard->next;
+        free(shard);
+    }
+    table->hit.shards = NULL;
+    table->hit.slots = 0;
+}
+
+lpm_result_t lpm_hit_enable(lpm_lkup_table_t *table, u32 slots)
+{
+    u32 size;
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (table->flags & LPM_TABLE_ATTACHED) {
+        lpm_con_print("%s prefixes of attached table are not known\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (slots > (0x1U << 30)) {
+        return LPM_ERR_INVALID;
+    }
+
+    lpm_hit_free(table);
+    if (slots != 0) {
+        for (size = 4; size < slots; size <<= 1) {
+            ;
+        }
+        table->hit.gen = __atomic_add_fetch(&lpm_hit_gen, 1, __ATOMIC_RELAXED);
+        table->hit.slots = size;
+    }
+
+    lpm_log_print(table, "hit counters of %u slots\n", table->hit.slots);
+
+    return LPM_SUCCESS;
+}
+
+/* Node of the longest prefix matching addr, with masklen in [1, maxlen], NULL for none */
+static btrie_node_t *btrie_match_node(btrie_node_t *root, u8 *addr, u32 maxlen)
+{
+    btrie_node_t *node = root, *match = NULL;
+
+    while (node != NULL && node->masklen <= maxlen) {
+        if (!btrie_key_match(node, addr, node->masklen)) {
+            break;
+        }
+        if (node->data != NULL && node->masklen > 0) {
+            match = node;
+        }
+        if (node->masklen == maxlen) {
+            break;
+        }
+        node = node->child[bit_at_position(addr, node->masklen)];
+    }
+
+    return match;
+}
+
+/* Hits merged by 1-trie node, open addressing */
+typedef struct lpm_hit_merge_s {
+    btrie_node_t *node;
+    unsigned long hits;
+} lpm_hit_merge_t;
+
+static inline lpm_hit_merge_t *lpm_hit_merge_find(lpm_hit_merge_t *merge, u32 mask, btrie_node_t *node)
+{
+    u32 i = (u32)(((unsigned long)node >> 4) * 2654435761U) & mask;
+
+    while (merge[i].node != NULL && merge[i].node != node) {
+        i = (i + 1) & mask;
+    }
+
+    return &merge[i];
+}
+
+static lpm_result_t __btrie_hit_walk(btrie_node_t *node, lpm_hit_merge_t *merge, u32 mask,
+                                     lpm_hit_walker_func_t walker, u32 *recur_times)
+{
+    lpm_hit_merge_t *m;
+    lpm_result_t ret;
+    u8 addr[LPM_LEVEL_MAX];
+    int i;
+
+#if LPM_DEBUG_RECURSION
+    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
+        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
+    }
+    *recur_times = *recur_times + 1;
+#endif
+
+    if (node->data != NULL) {
+        m = lpm_hit_merge_find(merge, mask, node);
+        /* walker gets a copy, node's key can not be changed */
+        memcpy(&addr, node->key, sizeof(addr));
+        if ((*walker)(addr, node->masklen, node->data, (m->node != NULL) ? m->hits : 0) != 0) {
+            return LPM_ERR_EXOTIC;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (node->child[i] == NULL) {
+            continue;
+        }
+
+        ret = __btrie_hit_walk(node->child[i], merge, mask, walker, recur_times);
+
+#if LPM_DEBUG_RECURSION
+        *recur_times = *recur_times - 1;
+#endif
+
+        if (ret != LPM_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+lpm_result_t lpm_walk_hits(lpm_lkup_table_t *table, lpm_hit_walker_func_t walker)
+{
+    lpm_hit_shard_t *shard;
+    lpm_hit_slot_t *slot;
+    lpm_hit_merge_t *merge, *m;
+    btrie_node_t *node;
+    unsigned long misses = 0, dropped = 0, hits;
+    u32 used = 0, room, mask, depth, i, recur_times = 0;
+    u8 default_addr[LPM_LEVEL_MAX];
+    lpm_result_t ret;
+
+    if (table == NULL || walker == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (table->btrie_root == NULL) {
+        lpm_debug_alg(table, "B-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    for (shard = __atomic_load_n(&table->hit.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        used += shard->used;
+    }
+    /* Merge is at most half full, slots added during merging may not find room */
+    for (mask = 4; mask < used * 2; mask <<= 1) {
+        ;
+    }
+    room = used;
+    merge = calloc(mask, sizeof(lpm_hit_merge_t));
+    if (merge == NULL) {
+        return LPM_ERR_RESOURCES;
+    }
+    mask--;
+
+    /* Lookup matching data at depth matches the longest prefix not longer than depth bytes */
+    for (shard = __atomic_load_n(&table->hit.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        misses += shard->misses;
+        dropped += shard->dropped;
+        for (i = 0; i <= shard->mask; i++) {
+            slot = &shard->slot[i];
+            depth = __atomic_load_n(&slot->depth, __ATOMIC_ACQUIRE);
+            if (depth == 0) {
+                continue;
+            }
+            hits = slot->hits;
+            node = btrie_match_node(table->btrie_root, slot->key, depth << 0x3);
+            if (node == NULL) {
+                /* Prefix is deleted since */
+                misses += hits;
+                continue;
+            }
+            m = lpm_hit_merge_find(merge, mask, node);
+            if (m->node == NULL) {
+                if (room == 0) {
+                    dropped += hits;
+                    continue;
+                }
+                room--;
+                m->node = node;
+            }
+            m->hits += hits;
+        }
+    }
+    if (dropped != 0) {
+        lpm_con_print("%s %lu hits not counted, lpm_hit_enable() with more slots\n", __func__, dropped);
+    }
+
+    ret = __btrie_hit_walk(table->btrie_root, merge, mask, walker, &recur_times);
+    free(merge);
+
+    if (ret == LPM_SUCCESS && (misses != 0 || table->default_data != NULL)) {
+        memset(default_addr, 0, sizeof(default_addr));
+        if (table->default_data != NULL) {
+            memcpy(default_addr, table->default_addr, sizeof(default_addr));
+        }
+        if ((*walker)(default_addr, (table->default_data != NULL) ? table->default_masklen : 0,
+                      table->default_data, misses) != 0) {
+            ret = LPM_ERR_EXOTIC;
+        }
+    }
+
+    lpm_log_print(table, "walk hits using walker <%p>\n", walker);
+
+    return ret;
+}
+
+/*******************************
+ * Latency rel. codes
+ */
+
+/* Shard of calling thread, by table and generation */
+static __thread struct {
+    lpm_lkup_table_t *table;
+    unsigned long gen;
+    lpm_latency_shard_t *shard;             /* NULL for failing to get one */
+} lpm_latency_cache;
+static __thread int lpm_latency_countdown;  /* lookups of thread before next sample */
+static unsigned long lpm_latency_gen;
+static double lpm_latency_ticks_per_ns;
+static unsigned long lpm_latency_overhead;  /* ticks of timing nothing, taken from samples */
+
+/* Time stamp counter, lookup is not started before and is finished after reading it */
+static inline unsigned long lpm_latency_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned long ticks;
+
+    _mm_lfence();
+    ticks = __rdtsc();
+    _mm_lfence();
+
+    return ticks;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+static void lpm_latency_calibrate(void)
+{
+    struct timespec t0, t1, delay = {0, LPM_LATENCY_CALIBRATE_NS};
+    unsigned long ticks, min = ~0UL;
+    double ns;
+    int i;
+
+    if (lpm_latency_ticks_per_ns > 0) {
+        return;
+    }
+
+    for (i = 0; i < LPM_PERF_CALIBRATE; i++) {
+        ticks = lpm_latency_ticks();
+        ticks = lpm_latency_ticks() - ticks;
+        if (ticks < min) {
+            min = ticks;
+        }
+    }
+    lpm_latency_overhead = min;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ticks = lpm_latency_ticks();
+    nanosleep(&delay, NULL);
+    ticks = lpm_latency_ticks() - ticks;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    lpm_latency_ticks_per_ns = (ns > 0 && ticks > 0) ? (ticks / ns) : 1.0;
+}
+
+static inline u32 lpm_latency_bucket(unsigned long ticks)
+{
+    u32 e;
+
+    if (ticks < LPM_LATENCY_SUB_BUCKETS) {
+        return ticks;
+    }
+    if (ticks >> 32) {
+        return LPM_LATENCY_BUCKETS - 1;
+    }
+    e = 31 - __builtin_clz((u32)ticks);     /* 3 at least */
+
+    return (e - 2) * LPM_LATENCY_SUB_BUCKETS + ((ticks >> (e - 3)) & (LPM_LATENCY_SUB_BUCKETS - 1));
+}
+
+unsigned long lpm_latency_bucket_low(u32 bucket)
+{
+    u32 e, sub;
+
+    if (bucket < LPM_LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    if (bucket >= LPM_LATENCY_BUCKETS) {
+        bucket = LPM_LATENCY_BUCKETS - 1;
+    }
+    e = bucket / LPM_LATENCY_SUB_BUCKETS + 2;
+    sub = bucket % LPM_LATENCY_SUB_BUCKETS;
+
+    return ((unsigned long)(LPM_LATENCY_SUB_BUCKETS + sub)) << (e - 3);
+}
+
+/* Whether lookup of calling thread is sampled */
+static inline int lpm_latency_sampled(lpm_lkup_table_t *table)
+{
+    if (--lpm_latency_countdown > 0) {
+        return 0;
+    }
+    lpm_latency_countdown = table->latency.every;
+
+    return 1;
+}
+
+/* Shard of calling thread, found in table's shards or newly added to them */
+static lpm_latency_shard_t *lpm_latency_shard_get(lpm_lkup_table_t *table)
+{
+    void *owner = &lpm_latency_cache;       /* unique among live threads */
+    lpm_latency_shard_t *shard;
+
+    if (lpm_latency_cache.table == table && lpm_latency_cache.gen == table->latency.gen) {
+        return lpm_latency_cache.shard;
+    }
+
+    for (shard = __atomic_load_n(&table->latency.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        if (shard->owner == owner) {
+            break;
+        }
+    }
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(lpm_latency_shard_t));
+        if (shard != NULL) {
+            shard->owner = owner;
+            shard->next = __atomic_load_n(&table->latency.shards, __ATOMIC_ACQUIRE);
+            while (!__atomic_compare_exchange_n(&table->latency.shards, &shard->next, shard, 0,
+                                                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                ;
+            }
+        } else {
+            lpm_debug_mem(table, "latency histograms allocate failed\n");
+        }
+    }
+
+    lpm_latency_cache.table = table;
+    lpm_latency_cache.gen = table->latency.gen;
+    lpm_latency_cache.shard = shard;
+
+    return shard;
+}
+
+static void lpm_latency_record(lpm_lkup_table_t *table, unsigned long ticks, u32 depth)
+{
+    lpm_latency_shard_t *shard = lpm_latency_shard_get(table);
+
+    if (shard == NULL || depth > LPM_LATENCY_DEPTH_MAX) {
+        return;
+    }
+    shard->hist[depth][lpm_latency_bucket(ticks)]++;
+}
+
+static void lpm_latency_free(lpm_lkup_table_t *table)
+{
+    lpm_latency_shard_t *shard, *next;
+
+    for (shard = table->latency.shards; shard != NULL; shard = next) {
+        next = shard->next;
+        free(shard);
+    }
+    table->latency.shards = NULL;
+    table->latency.every = 0;
+}
+
+lpm_result_t lpm_latency_enable(lpm_lkup_table_t *table, u32 every)
+{
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (every >= (0x1U << 31)) {         /* countdown is int */
+        return LPM_ERR_INVALID;
+    }
+
+    lpm_latency_free(table);
+    if (every != 0) {
+        lpm_latency_calibrate();
+        table->latency.gen = __atomic_add_fetch(&lpm_latency_gen, 1, __ATOMIC_RELAXED);
+        table->latency.every = every;
+    }
+
+    lpm_log_print(table, "sample one in every %u lookups\n", every);
+
+    return LPM_SUCCESS;
+}
+
+lpm_result_t lpm_latency_read(lpm_lkup_table_t *table, lpm_latency_stat_t *stat)
+{
+    lpm_latency_shard_t *shard;
+    unsigned long n;
+    u32 depth, b;
+
+    if (table == NULL || stat == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    stat->every = table->latency.every;
+    stat->ticks_per_ns = (lpm_latency_ticks_per_ns > 0) ? lpm_latency_ticks_per_ns : 1.0;
+    for (shard = __atomic_load_n(&table->latency.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        for (depth = 1; depth <= LPM_LATENCY_DEPTH_MAX; depth++) {
+            for (b = 0; b < LPM_LATENCY_BUCKETS; b++) {
+                n = shard->hist[depth][b];
+                stat->hist[depth][b] += n;
+                stat->hist[0][b] += n;
+                stat->samples += n;
+            }
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+double lpm_latency_percentile(lpm_latency_stat_t *stat, u32 depth, double percent)
+{
+    unsigned long total = 0, target, sum = 0;
+    u32 b;
+
+    if (stat == NULL || depth > LPM_LATENCY_DEPTH_MAX || percent <= 0 || percent > 100) {
+        return 0;
+    }
+
+    for (b = 0; b < LPM_LATENCY_BUCKETS; b++) {
+        total += stat->hist[depth][b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    target = (unsigned long)(total * percent / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+    for (b = 0; b < LPM_LATENCY_BUCKETS - 1; b++) {
+        sum += stat->hist[depth][b];
+        if (sum >= target) {
+            break;
+        }
+    }
+
+    return (lpm_latency_bucket_low(b) + lpm_latency_bucket_low(b + 1)) / 2.0 / stat->ticks_per_ns;
+}
+
+void lpm_latency_report(lpm_lkup_table_t *table)
+{
+    lpm_latency_stat_t *stat;
+    unsigned long n;
+    u32 depth, b;
+    char label[16];
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return;
+    }
+    stat = malloc(sizeof(*stat));
+    if (stat == NULL) {
+        return;
+    }
+    (void)lpm_latency_read(table, stat);
+
+    lpm_con_print("LPM Table [%s] lookup latency, one in every %u lookups sampled, %lu samples:\n",
+                        table->name, stat->every, stat->samples);
+    for (depth = 0; depth <= LPM_LATENCY_DEPTH_MAX; depth++) {
+        for (n = 0, b = 0; b < LPM_LATENCY_BUCKETS; b++) {
+            n += stat->hist[depth][b];
+        }
+        if (n == 0) {
+            continue;
+        }
+        if (depth == 0) {
+            snprintf(label, sizeof(label), "all");
+        } else {
+            snprintf(label, sizeof(label), "depth %u", depth);
+        }
+        lpm_con_print("\t%-9s %lu samples, p50 %.1f ns, p90 %.1f ns, p99 %.1f ns, p99.9 %.1f ns\n",
+                            label, n,
+                            lpm_latency_percentile(stat, depth, 50), lpm_latency_percentile(stat, depth, 90),
+                            lpm_latency_percentile(stat, depth, 99), lpm_latency_percentile(stat, depth, 99.9));
+    }
+    free(stat);
+}
+
+/*******************************
+ * Perf rel. codes
+ */
+
+#if LPM_PERF_EVENT
+static __thread lpm_perf_thread_t lpm_perf_thread;
+static unsigned long lpm_perf_gen;
+
+/* Type and config of perf_event_open(2) for LPM_PERF_XXX event */
+static const struct {
+    u32 type;
+    unsigned long config;
+} lpm_perf_events[LPM_PERF_EVENT_MAX] = {
+    [LPM_PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [LPM_PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [LPM_PERF_LLC_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+                                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [LPM_PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Count of event read in user space by rdpmc, from the counter and the offset kernel keeps in
+ * mmap'd page, again if kernel updates the page meanwhile. Return -1 when rdpmc is not allowed
+ * or event is not on the counter now.
+ */
+static inline int lpm_perf_rdpmc(struct perf_event_mmap_page *pc, unsigned long *value)
+{
+    u32 seq, idx, width;
+    int64_t pmc;
+    uint64_t count;
+
+    do {
+        seq = __atomic_load_n(&pc->lock, __ATOMIC_ACQUIRE);
+        idx = pc->index;
+        if (!pc->cap_user_rdpmc || idx == 0) {
+            return -1;
+        }
+        count = pc->offset;
+        width = pc->pmc_width;
+        pmc = (int64_t)__rdpmc(idx - 1);
+        /* Counter is width bits, sign extended */
+        pmc = (int64_t)((uint64_t)pmc << (64 - width)) >> (64 - width);
+        count += pmc;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&pc->lock, __ATOMIC_RELAXED) != seq);
+
+    *value = count;
+
+    return 0;
+}
+#endif
+
+/*
+ * Read all counters of calling thread, by rdpmc when it is allowed for all, by one group read
+ * otherwise. Event not opened reads 0.
+ */
+static inline void lpm_perf_sample(lpm_perf_thread_t *pt, unsigned long *value)
+{
+    uint64_t buf[LPM_PERF_EVENT_MAX + 1];   /* nr, then values in group order */
+    int i;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (pt->rdpmc) {
+        for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+            if (pt->fd[i] < 0) {
+                value[i] = 0;
+            } else if (lpm_perf_rdpmc(pt->page[i], &value[i]) != 0) {
+                break;
+            }
+        }
+        if (i == LPM_PERF_EVENT_MAX) {
+            return;
+        }
+    }
+#endif
+
+    if (read(pt->leader, buf, sizeof(uint64_t) * (pt->cnt + 1)) < 0) {
+        memset(value, 0, sizeof(unsigned long) * LPM_PERF_EVENT_MAX);
+        return;
+    }
+    for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+        value[i] = (pt->fd[i] >= 0) ? buf[1 + pt->slot[i]] : 0;
+    }
+}
+
+/*
+ * Open counters of calling thread in one group, user space only, and map their pages for
+ * rdpmc. Overhead of reading them twice is calibrated and taken off from every measurement.
+ */
+static void lpm_perf_open(lpm_perf_thread_t *pt)
+{
+    struct perf_event_attr attr;
+    unsigned long begin[LPM_PERF_EVENT_MAX], end[LPM_PERF_EVENT_MAX];
+    int i, j;
+
+    pt->leader = -1;
+    pt->cnt = 0;
+    pt->valid = 0;
+    pt->rdpmc = 1;
+    for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+        pt->page[i] = NULL;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = lpm_perf_events[i].type;
+        attr.config = lpm_perf_events[i].config;
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        pt->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, pt->leader, 0);
+        if (pt->fd[i] < 0) {
+            continue;
+        }
+        if (pt->leader < 0) {
+            pt->leader = pt->fd[i];
+        }
+        pt->slot[i] = pt->cnt++;
+        pt->valid |= (0x1U << i);
+
+        pt->page[i] = mmap(NULL, LPM_PAGE_SIZE, PROT_READ, MAP_SHARED, pt->fd[i], 0);
+        if (pt->page[i] == MAP_FAILED) {
+            pt->page[i] = NULL;
+            pt->rdpmc = 0;
+        }
+    }
+    if (pt->leader < 0) {
+        lpm_con_print("%s no performance counter supported, thread is not measured\n", __func__);
+        pt->state = -1;
+        return;
+    }
+
+    for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+        pt->overhead[i] = ~0UL;
+    }
+    for (j = 0; j < LPM_PERF_CALIBRATE; j++) {
+        lpm_perf_sample(pt, begin);
+        lpm_perf_sample(pt, end);
+        for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+            if (end[i] - begin[i] < pt->overhead[i]) {
+                pt->overhead[i] = end[i] - begin[i];
+            }
+        }
+    }
+    pt->state = 1;
+}
+
+static inline int lpm_perf_begin(lpm_lkup_table_t *table, unsigned long *begin)
+{
+    lpm_perf_thread_t *pt = &lpm_perf_thread;
+
+    if (likely(table == NULL || !table->perf.on)) {
+        return 0;
+    }
+    if (unlikely(pt->state == 0)) {
+        lpm_perf_open(pt);
+    }
+    if (pt->state < 0) {
+        return 0;
+    }
+    lpm_perf_sample(pt, begin);
+
+    return 1;
+}
+
+/* Shard of calling thread, found in table's shards or newly added to them */
+static lpm_perf_shard_t *lpm_perf_shard_get(lpm_lkup_table_t *table, lpm_perf_thread_t *pt)
+{
+    lpm_perf_shard_t *shard;
+    void *p;
+
+    if (pt->table == table && pt->gen == table->perf.gen) {
+        return pt->shard;
+    }
+
+    for (shard = __atomic_load_n(&table->perf.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        if (shard->owner == pt) {
+            break;
+        }
+    }
+    /* Shard takes whole cache lines, threads do not share any */
+    if (shard == NULL &&
+        posix_memalign(&p, LPM_CACHE_LINE,
+                       (sizeof(lpm_perf_shard_t) + LPM_CACHE_LINE - 1) & (~(LPM_CACHE_LINE - 1))) == 0) {
+        shard = p;
+        memset(shard, 0, sizeof(lpm_perf_shard_t));
+        shard->owner = pt;
+        shard->next = __atomic_load_n(&table->perf.shards, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&table->perf.shards, &shard->next, shard, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            ;
+        }
+    } else if (shard == NULL) {
+        lpm_debug_mem(table, "performance counters shard allocate failed\n");
+    }
+
+    pt->table = table;
+    pt->gen = table->perf.gen;
+    pt->shard = shard;
+
+    return shard;
+}
+
+static inline void lpm_perf_end(lpm_lkup_table_t *table, lpm_perf_op_t op, unsigned long *begin)
+{
+    lpm_perf_thread_t *pt = &lpm_perf_thread;
+    unsigned long end[LPM_PERF_EVENT_MAX], delta;
+    lpm_perf_shard_t *shard;
+    int i;
+
+    lpm_perf_sample(pt, end);
+    shard = lpm_perf_shard_get(table, pt);
+    if (shard == NULL) {
+        return;
+    }
+    for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+        delta = end[i] - begin[i];
+        delta = (delta > pt->overhead[i]) ? (delta - pt->overhead[i]) : 0;
+        shard->count[op][i] += delta;
+    }
+    shard->ops[op]++;
+    shard->valid |= pt->valid;
+}
+
+/* ret = call, measured as operation op of table when counters are on */
+#define LPM_PERF_CALL(table, op, ret, call) \
+    do { \
+        unsigned long __perf_begin[LPM_PERF_EVENT_MAX]; \
+        int __perf_on = lpm_perf_begin((table), __perf_begin); \
+        (ret) = (call); \
+        if (__perf_on) { \
+            lpm_perf_end((table), (op), __perf_begin); \
+        } \
+    } while (0)
+#else
+#define LPM_PERF_CALL(table, op, ret, call) \
+    do { \
+        (ret) = (call); \
+    } while (0)
+#endif
+
+static void lpm_perf_free(lpm_lkup_table_t *table)
+{
+    lpm_perf_shard_t *shard, *next;
+
+    for (shard = table->perf.shards; shard != NULL; shard = next) {
+        next = shard->next;
+        free(shard);
+    }
+    table->perf.shards = NULL;
+}
+
+lpm_result_t lpm_perf_enable(lpm_lkup_table_t *table, int on)
+{
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+#if LPM_PERF_EVENT
+    if (on != 0 && on != 1) {
+        return LPM_ERR_INVALID;
+    }
+    if (on) {
+        lpm_perf_free(table);
+        table->perf.gen = __atomic_add_fetch(&lpm_perf_gen, 1, __ATOMIC_RELAXED);
+    }
+    table->perf.on = on;
+
+    lpm_log_print(table, "performance counters <%d>\n", on);
+
+    return LPM_SUCCESS;
+#else
+    lpm_con_print("%s LPM is built without LPM_PERF_EVENT\n", __func__);
+
+    return LPM_ERR_INVALID;
+#endif
+}
+
+lpm_result_t lpm_perf_read(lpm_lkup_table_t *table, lpm_perf_op_t op, lpm_perf_stat_t *stat)
+{
+    lpm_perf_shard_t *shard;
+    int i;
+
+    if (table == NULL || op >= LPM_PERF_OP_MAX || stat == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    for (shard = __atomic_load_n(&table->perf.shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+        stat->ops += shard->ops[op];
+        for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+            stat->count[i] += shard->count[op][i];
+            stat->valid[i] |= (shard->valid >> i) & 0x1;
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+void lpm_perf_report(lpm_lkup_table_t *table)
+{
+    static const char *op_name[LPM_PERF_OP_MAX] = {"search", "add", "update", "delete"};
+    static const char *event_name[LPM_PERF_EVENT_MAX] = {"cycles", "instructions",
+                                                         "LLC-misses", "dTLB-misses"};
+    lpm_perf_stat_t stat;
+    char buf[256];
+    int op, i, len;
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return;
+    }
+
+    lpm_con_print("LPM Table [%s] performance counters per operation:\n", table->name);
+    for (op = 0; op < LPM_PERF_OP_MAX; op++) {
+        (void)lpm_perf_read(table, op, &stat);
+        if (stat.ops == 0) {
+            continue;
+        }
+        len = 0;
+        for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+            if (stat.valid[i]) {
+                len += snprintf(buf + len, sizeof(buf) - len, ", %s %.2f", event_name[i],
+                                ((double)stat.count[i]) / stat.ops);
+            } else {
+                len += snprintf(buf + len, sizeof(buf) - len, ", %s n/a", event_name[i]);
+            }
+        }
+        lpm_con_print("\t%-7s %lu ops%s\n", op_name[op], stat.ops, buf);
+    }
+}
+
+/*******************************
+ * LPM rel. codes
+ */
+static lpm_result_t lpm_journal_append(lpm_lkup_table_t *table, lpm_journal_op_t op,
+                                       u8 *addr, u32 masklen, void *data);
+static void lpm_journal_fill(lpm_journal_rec_t *rec, u32 seq, lpm_journal_op_t op,
+                             u8 *addr, u32 masklen, void *data);
+static lpm_result_t lpm_journal_write(lpm_lkup_table_t *table, lpm_journal_rec_t *recs, u32 cnt);
+static void lpm_journal_close_fd(lpm_lkup_table_t *table);
+
+static lpm_lkup_table_t *lpm_mem_alloc(lpm_allocator_t *allocator)
+{
+    lpm_lkup_table_t *ret;
+    
+    if (allocator != NULL) {
+        ret = allocator->alloc(allocator->ctx, sizeof(lpm_lkup_table_t), sizeof(void *), -1);
+    } else {
+        ret = malloc(sizeof(lpm_lkup_table_t));
+    }
+    
+#if LPM_DEBUG_ALLOC_FAIL
+    if (ret != NULL && !lpm_mem_success(101)) {
+        if (allocator != NULL) {
+            allocator->free(allocator->ctx, ret, sizeof(lpm_lkup_table_t));
+        } else {
+            free(ret);
+        }
+        ret = NULL;
+    }
+#endif
+
+    if (ret != NULL) {
+        memset(ret, 0, sizeof(lpm_lkup_table_t));
+        if (allocator != NULL) {
+            ret->allocator = *allocator;
+        }
+    }
+    
+    return ret;
+}
+
+static void lpm_mem_free(lpm_lkup_table_t *p)
+{
+    lpm_allocator_t allocator;
+
+    if (p == NULL) {
+        return;
+    }
+
+    if (p->allocator.alloc != NULL) {
+        /* Allocator lives in the table which is being released */
+        allocator = p->allocator;
+        allocator.free(allocator.ctx, p, sizeof(lpm_lkup_table_t));
+    } else {
+        free(p);
+    }
+}
+
+lpm_result_t lpm_debug_support(lpm_lkup_table_t *table, lpm_debug_t debug, int on)
+{
+    if (table == NULL) {
+        lpm_con_print("%s table not found..\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    if (on == 1) {          /* open */
+        switch (debug) {
+        case DEBUG_NORMAL:
+            table->debug_flag |= LPM_DEBUG_NORM;
+            break;
+        case DEBUG_MEMORY:
+            table->debug_flag |= LPM_DEBUG_MEM;
+            break;
+        case DEBUG_ALGORITHM:
+            table->debug_flag |= LPM_DEBUG_ALG;
+            break;
+        case DEBUG_ALL:
+            table->debug_flag |= LPM_DEBUG_MASK;
+            break;
+        case LOGGING:
+            table->debug_flag |= LPM_LOGGING;
+            break;
+        default:
+            lpm_debug_norm(table, "Unknown debug <%d>\n", debug);
+            return LPM_ERR_INVALID;
+        }
+    } else if (on == 0){    /* close */
+        switch (debug) {
+        case DEBUG_NORMAL:
+            table->debug_flag &= (~LPM_DEBUG_NORM);
+            break;
+        case DEBUG_MEMORY:
+            table->debug_flag &= (~LPM_DEBUG_MEM);
+            break;
+        case DEBUG_ALGORITHM:
+            table->debug_flag &= (~LPM_DEBUG_ALG);
+            break;
+        case DEBUG_ALL:
+            table->debug_flag &= (~LPM_DEBUG_MASK);
+            break;
+        case LOGGING:
+            table->debug_flag &= (~LPM_LOGGING);
+            break;
+        default:
+            lpm_debug_norm(table, "Unknown debug <%d>\n", debug);
+            return LPM_ERR_INVALID;
+        }
+    } else {
+        lpm_debug_norm(table, "Unknown on <%d>\n", on);
+        return LPM_ERR_INVALID;
+    }
+
+    lpm_log_print(table, "debug<%d>, on<%d>\n", debug, on);
+
+    return LPM_SUCCESS;
+}
+
+void lpm_table_statistic(lpm_lkup_table_t *table)
+{
+    struct lpm_lkup_table_stat *stat;
+    lpm_mtrie_t *mtrie;
+    float btrie_mem, mtrie_mem;
+    float cnt;
+    u32 i, j;
+    char buf[128], *p;
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return;
+    }
+    
+    lpm_log_print(table, "print LPM statistic\n");
+
+    stat = &table->stat;
+    btrie_mem = ((float)lpm_slab_mem_size(&table->btrie_slab)) / 1000000.0;
+    mtrie_mem = 0;
+    for_each_mtrie(table, mtrie) {
+        mtrie_mem += ((float)lpm_slab_mem_size(&mtrie->arena)) / 1000000.0;
+        mtrie_mem += ((float)lpm_slab_mem_size(&mtrie->sparse_arena)) / 1000000.0;
+    }
+
+    lpm_con_print("LPM Table [%s] statistic:\n", table->name);
+    lpm_con_print("\tB-trie allocated nodes: %d nodes, [%.3f MB]\n",
+                        stat->btrie_node_alloc_stat, btrie_mem);
+    lpm_con_print("\tB-trie allocated slabs: %u slabs, [%u nodes per slab]\n",
+                        table->btrie_slab.slab_cnt, table->btrie_slab.obj_per_slab);
+    lpm_con_print("\tB-trie allocated failure: %u times\n", stat->btrie_node_alloc_fail_stat);
+    lpm_con_print("\tM-trie allocated blocks: %d blocks, [%.3f MB]\n",
+                        stat->mtrie_block_alloc_stat, mtrie_mem);
+    for_each_mtrie(table, mtrie) {
+        if (mtrie->numa_node >= 0) {
+            lpm_con_print("\tM-trie replica on NUMA node %d:\n", mtrie->numa_node);
+        }
+        lpm_con_print("\tM-trie allocated arenas: %u arenas, [%u blocks per arena]\n",
+                            mtrie->arena.slab_cnt, mtrie->arena.obj_per_slab);
+        if (table->flags & (LPM_TABLE_HUGEPAGE | LPM_TABLE_HUGEPAGE_1G)) {
+            lpm_con_print("\tM-trie arenas on hugetlbfs pages: %u arenas, others on transparent huge pages\n",
+                                mtrie->arena.huge_cnt);
+        }
+        if (mtrie->region.base != NULL) {
+            lpm_con_print("\tM-trie block region: %.3f MB carved, [%.3f MB reserved]%s\n",
+                                ((float)mtrie->region.used) / 1000000.0,
+                                ((float)mtrie->region.size) / 1000000.0,
+                                (table->shm != NULL) ? " in shared memory" : "");
+        }
+    }
+    lpm_con_print("\tM-trie allocated failure: %u times\n", stat->mtrie_block_alloc_fail_stat);
+    lpm_con_print("\tM-trie uniform blocks: %u folded, %u expanded again\n",
+                        stat->mtrie_block_fold_stat, stat->mtrie_block_unfold_stat);
+    lpm_con_print("\tM-trie compacted blocks: %u relocated\n", stat->mtrie_block_compact_stat);
+    lpm_con_print("\tM-trie writes: %lu entries written, %lu blocks allocated, %lu blocks freed\n",
+                        stat->mtrie_entry_write_stat, stat->mtrie_block_alloc_total_stat,
+                        stat->mtrie_block_free_total_stat);
+    if (stat->write_updates != 0) {
+        lpm_con_print("\tM-trie writes per update: %.1f entries, worst %lu entries by /%u, %lu updates failed\n",
+                            ((float)stat->mtrie_entry_write_stat) / stat->write_updates,
+                            stat->write_max.entries, stat->write_max_masklen, stat->write_failed);
+    }
+    if (table->flags & LPM_TABLE_SPARSE) {
+        lpm_con_print("\tM-trie sparse blocks: %d blocks, %u upgraded, %u downgraded\n",
+                            stat->mtrie_sparse_alloc_stat, stat->mtrie_sparse_upgrade_stat,
+                            stat->mtrie_sparse_downgrade_stat);
+    }
+    lpm_con_print("\tLPM Table valid data total count: [%d]\n", stat->data_total);
+    if (table->budget.limit != 0) {
+        lpm_con_print("\tMemory limit: %.3f MB, [%.3f MB used]\n",
+                            ((float)table->budget.limit) / 1000000.0,
+                            ((float)table->budget.used) / 1000000.0);
+    }
+    if (table->expected_prefixes != 0) {
+        lpm_con_print("\tMemory reserved for %u prefixes, never grows\n", table->expected_prefixes);
+    }
+    if (table->allocator.alloc != NULL) {
+        lpm_con_print("\tMemory from user allocator\n");
+    }
+
+    if (LPM_DEBUGGING_NORM(table)) {
+        for (i = 0; i <= LPM_MASKLEN_MAX; i++) {
+            if (stat->data_per_masklen[i] == 0) {
+                continue;
+            }
+#define TOTAL_ASTERISK_PRINT 100
+            assert(stat->data_total > 0);
+            cnt = ((float)(stat->data_per_masklen[i] * TOTAL_ASTERISK_PRINT)) / ((float)(stat->data_total));
+            j = (u32)cnt;
+            if (j == 0) {
+                j = 1;
+            }
+            if (j > TOTAL_ASTERISK_PRINT) {
+                lpm_debug_alg(table, "data of masklen /%u is larger than total count\n", i);
+                j = TOTAL_ASTERISK_PRINT;
+            }
+            for (p = buf; j > 0; j--, p++) {
+                *p = '*';
+            }
+            *p = '\0';
+            lpm_debug_norm(table, "\t  /%-3u [%4u]: %s\n", i, stat->data_per_masklen[i], buf);
+        }
+    }
+
+    lpm_con_print("\tTotal memory size: %.3f MB\n", (btrie_mem + mtrie_mem));
+}
+
+/* Add block of level and blocks below it to info, reach is the address space share of block */
+static void __lpm_introspect_block(lpm_mtrie_t *mtrie, mtrie_node_t *base, u32 level, double reach,
+                                   lpm_table_info_t *info)
+{
+    lpm_level_info_t *li = &info->level[level];
+    mtrie_node_t *entry, *prev = NULL, *sub;
+    int i;
+
+    li->blocks++;
+    if (MTRIE_IS_SPARSE(base)) {
+        li->sparse_blocks++;
+        li->memory += sizeof(mtrie_sparse_t);
+    } else {
+        li->memory += sizeof(mtrie_node_t) * MTRIE_BLOCK_ENTRY;
+    }
+    li->reach += reach;
+    if (level + 1 > info->levels) {
+        info->levels = level + 1;
+    }
+
+    for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+        entry = mtrie_entry(base, i);
+        if (prev == NULL || entry->data != prev->data || entry->base != prev->base) {
+            li->runs++;
+        }
+        prev = entry;
+
+        sub = mtrie_base(mtrie, entry->base);
+        if (sub == NULL) {
+            continue;
+        }
+        li->child_entries++;
+        if (sub == MTRIE_UNIFORM_BLOCK) {
+            /* Lookup reads the shared block and stops there */
+            li->folded_entries++;
+            if (level + 1 < LPM_INFO_LEVEL_MAX) {
+                info->level[level + 1].reach += reach / MTRIE_BLOCK_ENTRY;
+            }
+            continue;
+        }
+        if (level + 1 >= LPM_INFO_LEVEL_MAX) {
+            /* XXX BUG */
+            lpm_con_print("*BUG* m-trie deeper than %d levels\n", LPM_INFO_LEVEL_MAX);
+            assert(0);  /* XXX: suicide */
+            continue;
+        }
+        __lpm_introspect_block(mtrie, sub, level + 1, reach / MTRIE_BLOCK_ENTRY, info);
+    }
+}
+
+lpm_result_t lpm_table_introspect(lpm_lkup_table_t *table, lpm_table_info_t *info)
+{
+    lpm_level_info_t *li;
+    lpm_mtrie_t *mtrie;
+    mtrie_node_t *root;
+    u32 i;
+
+    if (table == NULL || info == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "M-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->prefixes = table->stat.data_total;
+    info->btrie_nodes = table->stat.btrie_node_alloc_stat;
+
+    mtrie = &(table->mtrie[0]);
+    if (table->flags & LPM_TABLE_ATTACHED) {
+        root = mtrie_base(mtrie, (mtrie_base_t)(unsigned long)
+                                 __atomic_load_n(&table->shm->root, __ATOMIC_ACQUIRE));
+    } else {
+        root = mtrie_base(mtrie, mtrie->hi256_table_base);
+    }
+    if (root != NULL) {
+        __lpm_introspect_block(mtrie, root, 0, 1.0, info);
+    }
+
+    for (i = 0; i < LPM_INFO_LEVEL_MAX; i++) {
+        li = &info->level[i];
+        info->blocks += li->blocks;
+        info->memory += li->memory;
+        info->expected_depth += li->reach;
+        if (li->blocks == 0) {
+            continue;
+        }
+        li->runs_per_block = ((double)li->runs) / li->blocks;
+        li->child_fraction = ((double)li->child_entries) / ((double)li->blocks * MTRIE_BLOCK_ENTRY);
+    }
+
+    lpm_log_print(table, "introspect %u blocks in %u levels\n", info->blocks, info->levels);
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * lpm_create_table never fail to allocate 1-trie root node and m-trie root trie block.
+ * After LPM table is created, 1-trie root node and m-trie root trie block will never be NULL,
+ * otherwise it is LPM algorithm internal error.
+ */
+lpm_lkup_table_t *lpm_create_table_ex(char *name, lpm_table_param_t *param)
+{
+    lpm_lkup_table_t *table;
+
+    lpm_con_print("%s with name <%s>\n", __func__, name);
+
+    if (param != NULL && param->allocator != NULL &&
+        (param->allocator->alloc == NULL || param->allocator->free == NULL)) {
+        lpm_con_print("%s allocator without alloc or free\n", __func__);
+        return NULL;
+    }
+    /* Pointers in m-trie blocks are meaningless in other processes */
+    if (param != NULL && param->shm_name != NULL && !LPM_MTRIE_INDEX32) {
+        lpm_con_print("%s shared table needs LPM_MTRIE_INDEX32\n", __func__);
+        return NULL;
+    }
+
+    table = lpm_mem_alloc((param != NULL) ? param->allocator : NULL);
+    if (table == NULL) {
+        lpm_con_print("%s allocate LPM table failed\n", __func__);
+        return NULL;
+    }
+    table->journal.fd = -1;
+    if (name == NULL) {
+        sprintf(table->name, LPM_TABLE_DEFAULT_NAME);
+    } else {
+        strncpy(table->name, name, (LPM_TABLE_NAME_LEN - 1));
+    }
+    if (param != NULL) {
+        table->flags = param->flags;
+        table->budget.limit = param->mem_limit;
+        table->expected_prefixes = param->expected_prefixes;
+        if (param->shm_name != NULL) {
+            strncpy(table->shm_name, param->shm_name, (LPM_SHM_NAME_LEN - 1));
+        }
+    }
+    
+    if (btrie_init(table) != LPM_SUCCESS) {
+        lpm_debug_norm(table, "B-trie initial failed\n");
+        goto error_btrie;
+    }
+
+    if (mtrie_init(table) != LPM_SUCCESS) {
+        lpm_debug_norm(table, "M-trie initial failed\n");
+        goto error_mtrie;
+    }
+
+    if (lpm_reserve_table(table) != LPM_SUCCESS) {
+        lpm_debug_norm(table, "Reserve for %u prefixes failed\n", table->expected_prefixes);
+        goto error_reserve;
+    }
+
+    lpm_log_print(table, "name <%s>, flags <0x%x>, success\n", table->name, table->flags);
+
+    return table;
+
+error_reserve:
+    mtrie_destroy(table);
+
+error_mtrie:
+    btrie_destroy(table);
+
+error_btrie:
+    lpm_mem_free(table);
+
+    return NULL;
+}
+
+lpm_lkup_table_t *lpm_create_table(char *name)
+{
+    return lpm_create_table_ex(name, NULL);
+}
+
+lpm_result_t lpm_destroy_table(lpm_lkup_table_t *table)
+{
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    lpm_log_print(table, "I am done...\n");
+
+    lpm_journal_close_fd(table);
+    lpm_hit_free(table);
+    lpm_latency_free(table);
+    lpm_perf_free(table);
+    mtrie_destroy(table);
+    btrie_destroy(table);
+    lpm_mem_free(table);
+    
+    return LPM_SUCCESS;
+}
+
+/* M-trie mapped from snapshot or attached from shared memory is never written */
+static lpm_result_t lpm_check_writable(lpm_lkup_table_t *table)
+{
+    if (table->flags & LPM_TABLE_READONLY) {
+        lpm_con_print("%s table <%s> is %s, read-only\n", __func__, table->name,
+                      (table->flags & LPM_TABLE_ATTACHED) ? "attached" : "loaded from snapshot");
+        return LPM_ERR_INVALID;
+    }
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * All 1-trie nodes and m-trie blocks are dropped by resetting slab and arena, memory is kept for
+ * the coming prefixes. Root node and root block are allocated again from the kept memory.
+ */
+lpm_result_t lpm_clear_table(lpm_lkup_table_t *table)
+{
+    lpm_mtrie_t *mtrie;
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
+    }
+
+    for_each_mtrie(table, mtrie) {
+        lpm_slab_reset(&mtrie->arena);
+        lpm_slab_reset(&mtrie->sparse_arena);
+        mtrie->hi256_table_base = mtrie_base_of(mtrie, NULL);
+        mtrie_compact_forget(mtrie);
+    }
+    table->stat.mtrie_block_alloc_stat = 0;
+    table->stat.mtrie_sparse_alloc_stat = 0;
+
+    lpm_slab_reset(&table->btrie_slab);
+    table->btrie_root = NULL;
+    table->stat.btrie_node_alloc_stat = 0;
+
+    table->stat.data_total = 0;
+    memset((void *)table->stat.data_per_masklen, 0, sizeof(table->stat.data_per_masklen));
+
+    table->default_data = NULL;
+    table->default_masklen = 0;
+    memset(&(table->default_addr), 0, sizeof(table->default_addr));
+
+    table->btrie_root = btrie_alloc_node(table);
+    if (table->btrie_root == NULL) {
+        lpm_debug_mem(table, "root node alloc failed\n");
+        return LPM_ERR_RESOURCES;
+    }
+    for_each_mtrie(table, mtrie) {
+        mtrie->hi256_table_base = mtrie_base_of(mtrie, mtrie_alloc_block(table, mtrie));
+        if (!mtrie->hi256_table_base) {
+            lpm_debug_mem(table, "root block alloc failed\n");
+            return LPM_ERR_RESOURCES;
+        }
+    }
+    lpm_shm_publish(table);
+
+    lpm_log_print(table, "clear table success\n");
+
+    return lpm_journal_append(table, LPM_JOURNAL_CLEAR, NULL, 0, NULL);
+}
+
+/*
+ * Relocation goes on from where the former call stops, every replica is relocated once in
+ * one round. Round restarts when all replicas are done, or when updates allocate or free
+ * blocks between calls, as queued references may be in freed blocks then. Blocks relocated
+ * by the former call are released first, lookups have finished with them since then.
+ */
+lpm_result_t lpm_compact(lpm_lkup_table_t *table, u32 budget)
+{
+    lpm_result_t ret = LPM_SUCCESS, r;
+    lpm_mtrie_t *mtrie;
+    unsigned long stamp;
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
+    }
+    if (table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "M-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    for_each_mtrie(table, mtrie) {
+        mtrie_compact_release(table, mtrie);
+    }
+
+    /* Compacting itself is not counted, it carves and frees blocks from arena directly */
+    stamp = table->stat.mtrie_block_alloc_total_stat + table->stat.mtrie_block_free_total_stat;
+    if (stamp != table->compact_stamp) {
+        for_each_mtrie(table, mtrie) {
+            if (mtrie->compact_state != LPM_COMPACT_IDLE) {
+                lpm_debug_norm(table, "blocks are allocated or freed since last compacting, round restarts\n");
+            }
+            mtrie->compact_state = LPM_COMPACT_IDLE;
+        }
+        table->compact_stamp = stamp;
+    }
+
+    for_each_mtrie(table, mtrie) {
+        if (mtrie->compact_state == LPM_COMPACT_DONE) {
+            continue;
+        }
+        r = mtrie_compact(table, mtrie, budget);
+        if (r != LPM_SUCCESS) {
+            ret = r;
+            break;
+        }
+    }
+
+    for_each_mtrie(table, mtrie) {
+        if (ret == LPM_SUCCESS) {
+            /* Round is done, queue is not kept for the next round */
+            free(mtrie->compact_queue);
+            mtrie->compact_queue = NULL;
+            mtrie->compact_queue_max = 0;
+            mtrie->compact_state = LPM_COMPACT_IDLE;
+        }
+        /*
+         * Slabs are recycled after a round, or after as many blocks as table holds are
+         * relocated when updates keep restarting rounds, walking slabs is paid by relocating.
+         */
+        if (ret == LPM_SUCCESS ||
+            mtrie->compact_moved > (u32)(table->stat.mtrie_block_alloc_stat + table->stat.mtrie_sparse_alloc_stat)) {
+            mtrie->compact_moved = 0;
+            mtrie->compact_recycle = 1;
+        }
+    }
+    /* Root block may be relocated */
+    lpm_shm_publish(table);
+
+    lpm_log_print(table, "compact with budget %u return %d\n", budget, ret);
+
+    return ret;
+}
+
+static lpm_result_t lpm_check_arg(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    if (table == NULL) {                /* table should be valid */
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    if (masklen > LPM_MASKLEN_MAX) {
+        lpm_con_print("%s masklen [%u] is too large\n", __func__, masklen);
+        return LPM_ERR_INVALID;
+    }
+
+    if (masklen > 0 && addr == NULL) {  /* addr should be valid while masklen is not 0 */
+        lpm_con_print("%s address CAN NOT be NULL while masklen > 0\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    return LPM_SUCCESS;
+}
+
+void *lpm_find_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    void *data = NULL;
+
+    if (lpm_check_arg(table, addr, masklen) != LPM_SUCCESS) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return NULL;
+    }
+
+    if (table->btrie_root == NULL) {
+        lpm_debug_alg(table, "B-trie of LPM not exists\n");
+        return NULL;
+    }
+
+    data = btrie_find_data(table->btrie_root, addr, masklen);
+
+    lpm_log_print(table, "accurately find result %p\n", data);
+
+    return data;
+}
+
+/*
+ * Longest prefix matching search, performance is the KEY.
+ * Return default data when do not find valid data in m-trie, and set the value to 1 pointed by
+ * using_default.
+ */
+static inline void *__lpm_search_table(lpm_lkup_table_t *table, u8 *addr, u8 *using_default, u32 *depth)
+{
+    u8 *idx, *matched = addr;
+    mtrie_node_t *entry, *base;
+    lpm_mtrie_t *mtrie;
+    void *data = NULL;
+
+    if (table == NULL || addr == NULL || using_default == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return NULL;
+    }
+
+    mtrie = &(table->mtrie[0]);
+    if (table->mtrie_cnt > 1) {
+        /* Replicated m-trie, using the one on local NUMA node */
+        mtrie = &(table->mtrie[table->numa_mtrie[lpm_numa_local_node()]]);
+    }
+    if (table->flags & LPM_TABLE_ATTACHED) {
+        /* Root block is published by writer process */
+        base = mtrie_base(mtrie, (mtrie_base_t)(unsigned long)
+                                 __atomic_load_n(&table->shm->root, __ATOMIC_ACQUIRE));
+    } else {
+        base = mtrie_base(mtrie, mtrie->hi256_table_base);
+    }
+    idx = addr;
+    *using_default = 0;
+    while (base != NULL) {
+        entry = mtrie_entry(base, *idx);
+        idx++;
+        base = mtrie_base(mtrie, entry->base);
+        if (entry->data) {
+            data = mtrie_data(entry);
+            /* Folded data is of prefixes in the uniform block below, whose byte tells them */
+            matched = idx + (base == MTRIE_UNIFORM_BLOCK);
+        }
+    }
+    if (unlikely(table->hit.slots != 0)) {
+        lpm_hit_count(table, addr, matched - addr);
+    }
+    if (depth != NULL) {
+        *depth = idx - addr;
+    }
+
+    if (data == NULL) {
+        data = table->default_data;
+        if (table->flags & LPM_TABLE_ATTACHED) {
+            data = (void *)(unsigned long)table->shm->default_data;
+        }
+        *using_default = 1;
+    }
+    
+    return data;
+}
+
+void *lpm_search_table(lpm_lkup_table_t *table, u8 *addr, u8 *using_default)
+{
+    void *data;
+    unsigned long ticks;
+    u32 depth = 0;                          /* invalid lookup is not counted */
+
+    if (unlikely(table != NULL && table->latency.every != 0) && lpm_latency_sampled(table)) {
+        ticks = lpm_latency_ticks();
+        data = __lpm_search_table(table, addr, using_default, &depth);
+        ticks = lpm_latency_ticks() - ticks;
+        ticks = (ticks > lpm_latency_overhead) ? (ticks - lpm_latency_overhead) : 0;
+        lpm_latency_record(table, ticks, depth);
+        return data;
+    }
+
+    LPM_PERF_CALL(table, LPM_PERF_SEARCH, data, __lpm_search_table(table, addr, using_default, NULL));
+
+    return data;
+}
+
+/* Write data in m-trie block *ref, *ref is updated when sparse block is upgraded */
+static lpm_result_t lpm_pattern_generate(lpm_lkup_table_t *table,
+                                         lpm_mtrie_t *mtrie,
+                                         mtrie_base_t *ref,
+                                         u8 idx,
+                                         u32 bitpos,
+                                         void *data)
+{
+    u8 mask;
+    u32 tmp_idx, end_idx;
+    u32 masklen = (bitpos + 1) % 8;
+
+    if (BOUNDARY_BIT_POSITION(bitpos)) {
+        mask = 0xFF;
+    } else {
+        mask = ~((0x1 << (8 - masklen)) - 1);
+    }
+
+    tmp_idx = idx & mask;
+    idx |= (~mask);
+    end_idx = idx;
+
+    return mtrie_set_data(table, mtrie, ref, tmp_idx, end_idx, data);
+}
+
+/*
+ * Base holding block of level in trie chain. It is the upper level entry's base when the
+ * block is hooked, and the entry owns its slot since it has sub-block.
+ */
+#define TRIE_CHAIN_REF(level) \
+    (((level) == 0 || trie_chain_alloc[(level)] == TRIE_CHAIN_ALLOC) ? &trie_chain[(level)] : \
+     &(mtrie_entry(mtrie_base(mtrie, trie_chain[(level) - 1]), trie_idx[(level) - 1])->base))
+
+/* Operation is only confined to a certain m-trie block */
+static lpm_result_t lpm_gen_combinations(lpm_lkup_table_t *table,
+                                         lpm_mtrie_t *mtrie,
+                                         u8 *addr,
+                                         u32 temp_bitpos,
+                                         void *data,
+                                         char nextbit)
+{
+    lpm_result_t ret = LPM_SUCCESS;
+    mtrie_base_t mtrie_table_base, *ref;
+    mtrie_node_t *frontier_trie, *pre_entry;
+    mtrie_base_t trie_chain[LPM_LEVEL_MAX] = {0};   /* trie base */
+    u8 trie_idx[LPM_LEVEL_MAX] = {0};
+    
+#define TRIE_CHAIN_ALLOC 0x10
+    u8 trie_chain_alloc[LPM_LEVEL_MAX] = {0};   /* 0x10 stands for newly allocating */
+
+    int trie_count;                             /* the count of tries which will be operated */
+    int level;
+    u8 idx = 0;
+
+    assert(temp_bitpos < LPM_MASKLEN_MAX);
+    assert(addr != NULL);
+    assert(table != NULL);
+    mtrie_table_base = mtrie->hi256_table_base;
+    assert(mtrie_table_base);
+    assert((nextbit == -1) || (nextbit == 0) || (nextbit == 1));
+
+    if (temp_bitpos < 8) {
+        idx = addr[0];
+        switch (nextbit) {
+        case 0: /* next bit should set to 0 */
+            assert(temp_bitpos != 7);
+            idx &= (0xFF ^ (0x1 << (7 - (temp_bitpos + 1))));
+            ret = lpm_pattern_generate(table, mtrie, &mtrie_table_base, idx, (temp_bitpos + 1), data);
+            break;
+        case 1: /* next bit should set to 1 */
+            assert(temp_bitpos != 7);
+            idx |= (0x1 << (7 - (temp_bitpos + 1)));
+            ret = lpm_pattern_generate(table, mtrie, &mtrie_table_base, idx, (temp_bitpos + 1), data);
+            break;
+        case -1:/* next bit need no touch */
+            ret = lpm_pattern_generate(table, mtrie, &mtrie_table_base, idx, temp_bitpos, data);
+            break;
+        }
+
+        return ret;
+    }
+
+    /* temp_bitpos >= 8 */
+    trie_count = (temp_bitpos >> 3) + 1;
+
+    /* Build trie chain, allocate new trie block when necessary */
+    for (level = 0, frontier_trie = mtrie_base(mtrie, mtrie_table_base); level < trie_count; level++) {
+        if (frontier_trie == MTRIE_UNIFORM_BLOCK) {
+            /* Folded block on the path, it is hooked again by unfolding */
+            assert(level > 0);
+            frontier_trie = mtrie_unfold_block(table,
+                                               mtrie,
+                                               mtrie_entry(mtrie_base(mtrie, trie_chain[level - 1]),
+                                                           trie_idx[level - 1]),
+                                               addr,
+                                               level - 1);
+            if (frontier_trie == NULL) {
+                goto not_reserved;
+            }
+        } else if (frontier_trie == NULL) {
+            frontier_trie = mtrie_alloc_sub_block(table, mtrie);
+            if (frontier_trie == NULL) {
+                goto not_reserved;
+            }
+            trie_chain_alloc[level] = TRIE_CHAIN_ALLOC;
+        }
+        trie_chain[level] = mtrie_base_of(mtrie, frontier_trie);
+        trie_idx[level] = addr[level];
+
+        frontier_trie = mtrie_base(mtrie, mtrie_entry(frontier_trie, trie_idx[level])->base);
+    }
+
+    /*
+     * XXX: backward hook from low to high level trie block, for the sake of data plane reading.
+     *      Since control plane bind to core 0, we only need disable preemption when multiple
+     *      control threads are co-exist.
+     */
+    for (level = trie_count - 1; level > 0; level--) {
+        if (trie_chain_alloc[level] == TRIE_CHAIN_ALLOC) {
+            /*
+             * Hook newly allocating trie block to upper level trie block entry's base.
+             * Upper level sparse block may be upgraded for the entry, chain is updated then.
+             */
+            ref = TRIE_CHAIN_REF(level - 1);
+            pre_entry = mtrie_own_entry(table, mtrie, ref, trie_idx[level - 1]);
+            if (pre_entry == NULL) {
+                goto not_reserved;
+            }
+            trie_chain[level - 1] = *ref;
+            pre_entry->base = trie_chain[level];
+        } else {
+            pre_entry = mtrie_entry(mtrie_base(mtrie, trie_chain[level - 1]), trie_idx[level - 1]);
+            /* Inconsistence check */
+            if (pre_entry->base != trie_chain[level]) {
+                /* XXX BUG */
+                lpm_debug_alg(table, "*BUG* *FATAL ERROR* trie_chain[%d]=%p, pre_node->base=%p, *INCONSISTENT*\n",
+                                      level, mtrie_base(mtrie, trie_chain[level]),
+                                      mtrie_base(mtrie, pre_entry->base));
+                lpm_log_print(table, "*FATAL ERROR* : *inconsistent*\n");
+                lpm_con_print("*FATAL ERROR* : *inconsistent*\n");
+                assert(0);  /* XXX suicide */
+                return LPM_ERR_INTERNAL;
+            }
+        }
+    }
+    /* All blocks in chain are hooked now */
+    memset(&trie_chain_alloc, 0, sizeof(trie_chain_alloc));
+
+    ref = TRIE_CHAIN_REF(trie_count - 1);   /* lowest level trie block */
+    idx = trie_idx[trie_count - 1];         /* index in lowest level trie block */
+
+    /* trie_chain: mtrie_table_base -> ... -> frontier_trie */
+    switch (nextbit) {
+    case 0: /* next bit should set to 0 */
+        assert(!BOUNDARY_BIT_POSITION(temp_bitpos));
+        idx &= (0xFF ^ (0x1 << (7 - ((temp_bitpos + 1) & 7))));
+        ret = lpm_pattern_generate(table, mtrie, ref, idx, (temp_bitpos + 1), data);
+        break;
+    case 1: /* next bit should set to 1 */
+        assert(!BOUNDARY_BIT_POSITION(temp_bitpos));
+        idx |= (0x1 << (7 - ((temp_bitpos + 1) & 7)));
+        ret = lpm_pattern_generate(table, mtrie, ref, idx, (temp_bitpos + 1), data);
+        break;
+    case -1:/* next bit need no touch */
+        ret = lpm_pattern_generate(table, mtrie, ref, idx, temp_bitpos, data);
+        break;
+    }
+
+    return ret;
+
+not_reserved:
+    /* XXX BUG: blocks on the path are reserved by caller, allocating never fails */
+    lpm_debug_alg(table, "*BUG* *FATAL ERROR* mtrie block [%d Bytes] not reserved, level %d\n",
+                            (int)MTRIE_BLOCK_ALLOC_SIZE, level);
+    lpm_con_print("*FATAL ERROR* : *mtrie block not reserved*\n");
+    assert(0);  /* XXX suicide */
+    return LPM_ERR_INTERNAL;
+}
+
+/*
+ * temp_root is the first 1-trie node at or below bit position (temp_bitpos + 1), a compressed
+ * path may skip over the position, in which case temp_root->masklen is bigger.
+ */
+static lpm_result_t __lpm_prefix_expansion(lpm_lkup_table_t *table,
+                                         lpm_mtrie_t *mtrie,
+                                         u8 *addr,
+                                         u32 masklen,
+                                         u32 temp_bitpos,
+                                         btrie_node_t *temp_root,
+                                         void *data,
+                                         u32 *recur_times)
+{
+    lpm_result_t ret;
+    btrie_node_t *side[2];
+    u32 pos;
+    int i;
+    
+#if LPM_DEBUG_RECURSION
+    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
+        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
+    }
+    *recur_times = *recur_times + 1;
+#endif
+
+    /* Boundary bit specify only one entry in m-trie block. Combinations directly. */
+    if (BOUNDARY_BIT_POSITION(temp_bitpos)) {
+        return lpm_gen_combinations(table, mtrie, addr, temp_bitpos, data, -1);
+    }
+
+    pos = temp_bitpos + 1;
+    if (temp_root->masklen == pos) {
+        side[0] = temp_root->child[0];
+        side[1] = temp_root->child[1];
+    } else {
+        /* Position is skipped by compressed path, only one side has more specific data */
+        assert(temp_root->masklen > pos);
+        i = bit_at_position(temp_root->key, pos);
+        side[i] = temp_root;
+        side[i ^ 1] = NULL;
+    }
+
+    if ((side[0] == NULL) && (side[1] == NULL)) {
+        /* No children in 1-trie, which means I AM the most specific data. Combinations directly. */
+        return lpm_gen_combinations(table, mtrie, addr, temp_bitpos, data, -1);
+    }
+
+    /* Take care left sub-tree, then right sub-tree */
+    for (i = 0; i < 2; i++) {
+        if (side[i] == NULL) {
+            /* Sub-tree not exist, combination directly in this sub-tree. */
+            ret = lpm_gen_combinations(table, mtrie, addr, temp_bitpos, data, i);
+            if (ret != LPM_SUCCESS) {
+                return ret;
+            }
+            continue;
+        }
+
+        if (side[i]->masklen == pos + 1 && side[i]->data != NULL) {
+            /*
+             * The side[i]->data is not NULL, which means it is the more specific data,
+             * and it will take over all below nodes. We have done our job now.
+             */
+            continue;
+        }
+
+        /* More specific data maybe exist in sub-tree, take care it recursively */
+        if (i == 0) {
+            CLEAR_BIT_AT_POSITION(addr, pos);
+        } else {
+            SET_BIT_AT_POSITION(addr, pos);
+        }
+
+        ret = __lpm_prefix_expansion(table,
+                                     mtrie,
+                                     addr,
+                                     masklen,
+                                     pos,
+                                     side[i],
+                                     data,
+                                     recur_times);
+
+#if LPM_DEBUG_RECURSION
+        *recur_times = *recur_times - 1;
+#endif
+
+        if (ret != LPM_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+/* Prefix expansion in every m-trie replica, written block is folded if fold is set */
+static lpm_result_t lpm_prefix_expansion_ex(lpm_lkup_table_t *table,
+                                            u8 *addr,
+                                            u32 masklen,
+                                            u32 temp_bitpos,
+                                            btrie_node_t *temp_root,
+                                            void *data,
+                                            int fold)
+{
+    lpm_result_t ret = LPM_SUCCESS;
+    lpm_mtrie_t *mtrie;
+    u8 temp_addr[LPM_LEVEL_MAX];
+    u32 recur_times;
+    unsigned long written = table->stat.mtrie_entry_write_stat;
+
+    /* Expansion covers entries of bit positions below temp_bitpos in its block */
+    LPM_TRACE_POINT(LPM_TRACE_EXPAND_ENTRY, table, addr, masklen,
+                    (0x1UL << (7 - (temp_bitpos & 0x7))) * table->mtrie_cnt, LPM_SUCCESS);
+
+    for_each_mtrie(table, mtrie) {
+        /* addr is changed by expansion, every replica starts from the same one */
+        memcpy(&temp_addr, addr, sizeof(temp_addr));
+        recur_times = 0;
+        ret = __lpm_prefix_expansion(table, mtrie, temp_addr, masklen, temp_bitpos, temp_root,
+                                     data, &recur_times);
+        if (ret != LPM_SUCCESS) {
+            break;
+        }
+
+        /* Expansion writes only one block, fold it if it becomes uniform */
+        if (fold) {
+            mtrie_fold_path(table, mtrie, addr, (temp_bitpos >> 0x3));
+        }
+    }
+
+    LPM_TRACE_POINT(LPM_TRACE_EXPAND_EXIT, table, addr, masklen,
+                    table->stat.mtrie_entry_write_stat - written, ret);
+
+    return ret;
+}
+
+static lpm_result_t lpm_prefix_expansion(lpm_lkup_table_t *table,
+                                         u8 *addr,
+                                         u32 masklen,
+                                         u32 temp_bitpos,
+                                         btrie_node_t *temp_root,
+                                         void *data)
+{
+    return lpm_prefix_expansion_ex(table, addr, masklen, temp_bitpos, temp_root, data, 1);
+}
+
+/* Update LPM default data, accroding to addr/masklen prefix. */
+lpm_result_t lpm_update_default_data(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    void *data = NULL;
+    int cnt;
+    u8 mask;
+
+    if (lpm_check_arg(table, addr, masklen) != LPM_SUCCESS) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
+    }
+
+    if (table->btrie_root == NULL) {
+        lpm_debug_alg(table, "B-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    data = btrie_find_data(table->btrie_root, addr, masklen);
+    if (data == NULL) {
+        lpm_debug_norm(table, "not find valid data to update default\n");
+        return LPM_ERR_NOTFOUND;
+    }
+
+    table->default_data = data;
+    table->default_masklen = masklen;
+    memset(&(table->default_addr), 0, sizeof(table->default_addr));
+    if (masklen > 0) {
+        cnt = ((masklen - 1) >> 0x3) + 1;
+        memcpy(&(table->default_addr), addr, cnt);
+        mask = 0xFF ^ ((1 << (0x7 - ((masklen - 1) & 0x7))) - 1);
+        table->default_addr[cnt - 1] &= mask;
+    }
+    lpm_shm_publish(table);
+    
+    lpm_log_print(table, "update default data with <%p> success\n", data);
+
+    return lpm_journal_append(table, LPM_JOURNAL_DEFAULT, addr, masklen, NULL);
+}
+
+/*
+ * Take care of "more specifc" data, and do not overwriting it.
+ */
+static lpm_result_t __lpm_add_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+{
+    btrie_node_t *newnode = NULL;
+    lpm_result_t ret;
+    u32 bitpos;
+    u8 temp_addr[LPM_LEVEL_MAX], cnt;
+
+    ret = lpm_check_arg(table, addr, masklen);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+    ret = lpm_check_writable(table);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+    if (data == NULL) {
+        lpm_con_print("%s can not add NULL data\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (!mtrie_data_valid(data)) {
+        lpm_con_print("%s data <%p> does not fit in 32-bit handle\n", __func__, data);
+        return LPM_ERR_INVALID;
+    }
+    if (table->btrie_root == NULL || table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    /* Existing data is reported without reserving anything, table may be out of memory */
+    newnode = btrie_find_node(table->btrie_root, addr, masklen);
+    if (newnode != NULL && newnode->data != NULL) {
+        if (newnode->data == data) {
+            lpm_debug_norm(table, "data <%p> alreadly exists\n", data);
+            return LPM_ERR_EXISTS;
+        }
+        lpm_debug_norm(table, "data <%p> conflict with new data <%p>\n", newnode->data, data);
+        return LPM_ERR_CONFLICT;
+    }
+
+    /*
+     * At most two 1-trie nodes are added, and m-trie blocks on the prefix's path are
+     * reserved in every replica before touching anything. Nothing fails after that, so
+     * there is nothing to roll back.
+     */
+    if (lpm_slab_reserve(&table->btrie_slab, 2) != LPM_SUCCESS) {
+        lpm_debug_mem(table, "reserve btrie nodes failed\n");
+        table->stat.btrie_node_alloc_fail_stat++;
+        return LPM_ERR_RESOURCES;
+    }
+    ret = mtrie_reserve_path(table, addr, masklen);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+
+    /* btrie_add_node will never fail to return a 1-trie node, nodes are reserved */
+    ret = btrie_add_node(table, addr, masklen, &newnode);
+    if (ret != LPM_SUCCESS && ret != LPM_ERR_EXISTS) {
+        /* XXX BUG */
+        lpm_debug_alg(table, "*BUG* *ERROR* btrie node failed, ret %d\n", ret);
+        assert(0);  /* XXX: suicide */
+        return LPM_ERR_INTERNAL;
+    }
+
+    assert(newnode != NULL);
+    assert(newnode->data == NULL);      /* existing data is reported above */
+
+    /* add data in 1-trie */
+    newnode->data = data;
+    table->stat.data_total++;
+    table->stat.data_per_masklen[masklen]++;
+
+    /*
+     * Zero route can be done now.
+     */
+    if (masklen == 0) {
+        lpm_log_print(table, "add data<%p> success\n", data);
+        return lpm_journal_append(table, LPM_JOURNAL_ADD, addr, masklen, data);
+    }
+
+    memset(&temp_addr, 0, sizeof(temp_addr));
+    cnt = ((masklen - 1) >> 0x3) + 1;
+    memcpy(&temp_addr, addr, cnt);  /* Copy addr information to local variable */
+
+    bitpos = masklen - 1;
+    ret = lpm_prefix_expansion(table, temp_addr, masklen, bitpos, newnode, data);
+    if (ret != LPM_SUCCESS) {
+        /* XXX BUG */
+        lpm_debug_alg(table, "*BUG* *ERROR* mtrie block failed, ret %d\n", ret);
+        lpm_con_print("*BUG* *ERROR* mtrie block failed, ret %d\n", ret);
+        assert(0);  /* XXX: suicide */
+        return LPM_ERR_INTERNAL;
+    }
+
+    lpm_log_print(table, "add data<%p> success\n", data);
+
+    return lpm_journal_append(table, LPM_JOURNAL_ADD, addr, masklen, data);
+}
+
+lpm_result_t lpm_add_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+{
+    lpm_write_count_t begin;
+    unsigned long written;
+    lpm_result_t ret;
+    int counted;
+
+    counted = lpm_write_begin(table, addr, masklen, &begin);
+    LPM_PERF_CALL(table, LPM_PERF_ADD, ret, __lpm_add_entry(table, addr, masklen, data));
+    if (counted) {
+        written = lpm_write_end(table, &begin, addr, masklen, ret);
+        LPM_TRACE_POINT(LPM_TRACE_ADD, table, addr, masklen, written, ret);
+    }
+
+    return ret;
+}
+
+static lpm_result_t __lpm_update_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+{
+    lpm_result_t ret;
+    btrie_node_t *stored_node;
+    void *old_data;
+    u32 bitpos;
+    u8 temp_addr[LPM_LEVEL_MAX], cnt;
+
+    ret = lpm_check_arg(table, addr, masklen);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+    ret = lpm_check_writable(table);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+    if (data == NULL) {
+        lpm_con_print("%s can not using NULL data to update\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (!mtrie_data_valid(data)) {
+        lpm_con_print("%s data <%p> does not fit in 32-bit handle\n", __func__, data);
+        return LPM_ERR_INVALID;
+    }
+    if (table->btrie_root == NULL || table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    stored_node = btrie_find_node(table->btrie_root, addr, masklen);
+    if ((stored_node == NULL) || (stored_node->data == NULL)) {
+        lpm_con_print("%s not find valid data; please use lpm_add_entry() first\n", __func__);
+        return LPM_ERR_NOTFOUND;
+    }
+    
+    /* Folded blocks on the prefix's path may be expanded again, reserve them first */
+    ret = mtrie_reserve_path(table, addr, masklen);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+
+    old_data = stored_node->data;
+    if (stored_node->data == data) {
+        lpm_debug_norm(table, "data <%p> are the same\n", data);
+    } else {
+        /* update data in 1-btrie */
+        stored_node->data = data;
+    }
+
+    if (masklen == 0) {
+        lpm_log_print(table, "update success\n");
+        return lpm_journal_append(table, LPM_JOURNAL_UPDATE, addr, masklen, data);
+    }
+    
+    memset(&temp_addr, 0, sizeof(temp_addr));
+    cnt = ((masklen - 1) >> 0x3) + 1;
+    memcpy(&temp_addr, addr, cnt);
+
+    bitpos = masklen - 1;
+    /* Update data in m-trie */
+    ret = lpm_prefix_expansion(table, temp_addr, masklen, bitpos, stored_node, data);
+    if (ret != LPM_SUCCESS) {
+        /* Rollback to old data, expanded blocks are kept */
+        lpm_debug_alg(table, "update failed, ret %d, rollback\n", ret);
+        stored_node->data = old_data;
+        (void)lpm_prefix_expansion(table, temp_addr, masklen, bitpos, stored_node, old_data);
+        return ret;
+    }
+
+    lpm_log_print(table, "update success\n");
+
+    return lpm_journal_append(table, LPM_JOURNAL_UPDATE, addr, masklen, data);
+}
+
+lpm_result_t lpm_update_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+{
+    lpm_write_count_t begin;
+    unsigned long written;
+    lpm_result_t ret;
+    int counted;
+
+    counted = lpm_write_begin(table, addr, masklen, &begin);
+    LPM_PERF_CALL(table, LPM_PERF_UPDATE, ret, __lpm_update_entry(table, addr, masklen, data));
+    if (counted) {
+        written = lpm_write_end(table, &begin, addr, masklen, ret);
+        LPM_TRACE_POINT(LPM_TRACE_UPDATE, table, addr, masklen, written, ret);
+    }
+
+    return ret;
+}
+
+/* Add prefix, or update it when it exists with other data */
+static lpm_result_t lpm_upsert_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+{
+    lpm_result_t ret;
+
+    ret = lpm_add_entry(table, addr, masklen, data);
+    if (ret == LPM_ERR_CONFLICT) {
+        ret = lpm_update_entry(table, addr, masklen, data);
+    } else if (ret == LPM_ERR_EXISTS) {
+        ret = LPM_SUCCESS;
+    }
+
+    return ret;
+}
+
+/* Address order first, longer prefix first for the same address */
+static int lpm_entry_cmp(const void *a, const void *b)
+{
+    const lpm_entry_t *x = a, *y = b;
+    int ret;
+
+    ret = memcmp(x->addr, y->addr, sizeof(x->addr));
+    if (ret != 0) {
+        return ret;
+    }
+
+    return (x->masklen < y->masklen) - (x->masklen > y->masklen);
+}
+
+/* Prefix of batch whose data is changed in 1-trie */
+typedef struct lpm_batch_s {
+    btrie_node_t *node;
+    void *old_data;                         /* NULL for prefix newly added */
+    u8 *addr;                               /* prefix of entry, host bits are cleared */
+    u32 masklen;
+    u32 level;                              /* level of m-trie block prefix is expanded in */
+    u32 cnt;                                /* entries of the prefix in batch */
+    u32 expanded;
+} lpm_batch_t;
+
+/*
+ * Blocks in address order, upper level block first for the same address, then longer prefix
+ * first in the same block.
+ */
+static int lpm_batch_cmp(const void *a, const void *b)
+{
+    const lpm_batch_t *x = a, *y = b;
+    int ret;
+
+    ret = memcmp(x->addr, y->addr, (x->level < y->level) ? x->level : y->level);
+    if (ret != 0) {
+        return ret;
+    }
+    if (x->level != y->level) {
+        return (x->level < y->level) ? -1 : 1;
+    }
+    if (x->masklen != y->masklen) {
+        return (x->masklen > y->masklen) ? -1 : 1;
+    }
+
+    return memcmp(x->addr, y->addr, LPM_LEVEL_MAX);
+}
+
+/* Give data back to prefixes of batch not expanded, prefixes newly added are released */
+static void lpm_batch_rollback(lpm_lkup_table_t *table, lpm_batch_t *batch, u32 cnt)
+{
+    u32 i;
+
+    for (i = 0; i < cnt; i++) {
+        batch[i].node->data = batch[i].old_data;
+        if (batch[i].old_data == NULL) {
+            assert(table->stat.data_total > 0);
+            table->stat.data_total--;
+            table->stat.data_per_masklen[batch[i].masklen]--;
+        }
+    }
+    for (i = 0; i < cnt; i++) {
+        if (batch[i].old_data == NULL) {
+            btrie_release_node(table, batch[i].addr, batch[i].masklen);
+        }
+    }
+}
+
+/*
+ * Bulk insert. The whole batch goes into 1-trie first, then prefixes are expanded block by
+ * block. Expansion writes only entries of its block that no more specific prefix owns, so no
+ * m-trie entry is written twice, and blocks are folded once at last. Longer prefixes of a
+ * block are expanded first, so when expanding fails, prefixes not expanded yet can be taken
+ * out of 1-trie without leaving holes under shorter prefixes expanded before.
+ */
+static lpm_result_t __lpm_add_entries(lpm_lkup_table_t *table, lpm_entry_t *entries, u32 cnt, u32 *added)
+{
+    lpm_result_t ret = LPM_SUCCESS, eret = LPM_SUCCESS, jret = LPM_SUCCESS;
+    lpm_batch_t *batch, *b = NULL;
+    lpm_journal_rec_t *recs = NULL;
+    btrie_node_t *node;
+    lpm_mtrie_t *mtrie;
+    u32 i, j, n = 0, done = 0;
+    u8 *addr;
+
+    batch = malloc(cnt * sizeof(lpm_batch_t));
+    if (batch == NULL) {
+        return LPM_ERR_RESOURCES;
+    }
+
+    /* Host bits are cleared so that entries of the same prefix are neighbours after sorting */
+    for (i = 0; i < cnt; i++) {
+        if (entries[i].masklen >= LPM_MASKLEN_MAX) {
+            continue;
+        }
+        addr = entries[i].addr;
+        if (entries[i].masklen & 0x7) {
+            addr[entries[i].masklen >> 0x3] &= (u8)(0xFF << (8 - (entries[i].masklen & 0x7)));
+        }
+        memset(addr + ((entries[i].masklen + 7) >> 0x3), 0,
+               sizeof(entries[i].addr) - ((entries[i].masklen + 7) >> 0x3));
+    }
+    qsort(entries, cnt, sizeof(lpm_entry_t), lpm_entry_cmp);
+
+    /* Data of every prefix in 1-trie, stopping at the first failure */
+    for (i = 0; i < cnt; i++) {
+        addr = entries[i].addr;
+        ret = lpm_check_arg(table, addr, entries[i].masklen);
+        if (ret != LPM_SUCCESS) {
+            break;
+        }
+        if (entries[i].data == NULL || !mtrie_data_valid(entries[i].data)) {
+            lpm_con_print("%s data <%p> of entry is invalid\n", __func__, entries[i].data);
+            ret = LPM_ERR_INVALID;
+            break;
+        }
+
+        if (b != NULL && b->masklen == entries[i].masklen &&
+            memcmp(b->addr, addr, sizeof(entries[i].addr)) == 0) {
+            /* Prefix given again in batch, data of the latter in sorted order is taken */
+            b->node->data = entries[i].data;
+            b->cnt++;
+            continue;
+        }
+
+        if (lpm_slab_reserve(&table->btrie_slab, 2) != LPM_SUCCESS) {
+            lpm_debug_mem(table, "reserve btrie nodes failed\n");
+            table->stat.btrie_node_alloc_fail_stat++;
+            ret = LPM_ERR_RESOURCES;
+            break;
+        }
+        /* btrie_add_node will never fail to return a 1-trie node, nodes are reserved */
+        ret = btrie_add_node(table, addr, entries[i].masklen, &node);
+        if (ret != LPM_SUCCESS && ret != LPM_ERR_EXISTS) {
+            /* XXX BUG */
+            lpm_debug_alg(table, "*BUG* *ERROR* btrie node failed, ret %d\n", ret);
+            assert(0);  /* XXX: suicide */
+            ret = LPM_ERR_INTERNAL;
+            break;
+        }
+        ret = LPM_SUCCESS;
+
+        if (node->data == entries[i].data) {
+            /* Loading a table again is harmless */
+            b = NULL;
+            done++;
+            continue;
+        }
+
+        b = &batch[n++];
+        b->node = node;
+        b->old_data = node->data;
+        b->addr = addr;
+        b->masklen = entries[i].masklen;
+        b->level = (b->masklen != 0) ? ((b->masklen - 1) >> 0x3) : 0;
+        b->cnt = 1;
+        b->expanded = 0;
+        node->data = entries[i].data;
+        if (b->old_data == NULL) {
+            table->stat.data_total++;
+            table->stat.data_per_masklen[node->masklen]++;
+        }
+    }
+
+    qsort(batch, n, sizeof(lpm_batch_t), lpm_batch_cmp);
+    for (i = 0; i < n; i++) {
+        b = &batch[i];
+        node = b->node;
+        if (b->masklen != 0) {
+            lpm_trace_begin(table, b->addr, b->masklen);
+            eret = mtrie_reserve_path(table, b->addr, b->masklen);
+            if (eret != LPM_SUCCESS) {
+                lpm_trace_end(table);
+                break;
+            }
+            eret = lpm_prefix_expansion_ex(table, b->addr, b->masklen, b->masklen - 1, node,
+                                           node->data, 0);
+            lpm_trace_end(table);
+            if (eret != LPM_SUCCESS) {
+                /* XXX BUG */
+                lpm_debug_alg(table, "*BUG* *ERROR* mtrie block failed, ret %d\n", eret);
+                lpm_con_print("*BUG* *ERROR* mtrie block failed, ret %d\n", eret);
+                assert(0);  /* XXX: suicide */
+                break;
+            }
+        }
+        b->expanded = 1;
+        done += b->cnt;
+    }
+    if (i < n) {
+        lpm_batch_rollback(table, batch + i, n - i);
+    }
+
+    /* Every written block is folded once, prefixes of the same block are neighbours */
+    for (i = 0; i < n && batch[i].expanded; i++) {
+        b = &batch[i];
+        if (b->masklen == 0 ||
+            (i > 0 && b[-1].masklen != 0 && b->level == b[-1].level && memcmp(b->addr, b[-1].addr, b->level) == 0)) {
+            continue;
+        }
+        for_each_mtrie(table, mtrie) {
+            mtrie_fold_path(table, mtrie, b->addr, b->level);
+        }
+    }
+
+    /* Batch is journaled in one write */
+    if (table->journal.fd >= 0 && n != 0) {
+        recs = malloc(n * sizeof(lpm_journal_rec_t));
+        if (recs == NULL) {
+            lpm_con_print("%s table <%s> journal write failed, call lpm_checkpoint()\n", __func__, table->name);
+            jret = LPM_ERR_EXOTIC;
+        } else {
+            for (j = 0; j < n && batch[j].expanded; j++) {
+                b = &batch[j];
+                lpm_journal_fill(&recs[j], table->journal.seq + j + 1,
+                                 (b->old_data == NULL) ? LPM_JOURNAL_ADD : LPM_JOURNAL_UPDATE,
+                                 b->addr, b->masklen, b->node->data);
+            }
+            if (j != 0) {
+                jret = lpm_journal_write(table, recs, j);
+            }
+            free(recs);
+        }
+    }
+
+    free(batch);
+    *added = done;
+
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+
+    return (eret != LPM_SUCCESS) ? eret : jret;
+}
+
+lpm_result_t lpm_add_entries(lpm_lkup_table_t *table, lpm_entry_t *entries, u32 cnt, u32 *added)
+{
+    lpm_result_t ret;
+    u32 done = 0;
+
+    if (added != NULL) {
+        *added = 0;
+    }
+    if (table == NULL || (entries == NULL && cnt != 0)) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
+    }
+    if (table->btrie_root == NULL || table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+    if (cnt == 0) {
+        return LPM_SUCCESS;
+    }
+
+    ret = __lpm_add_entries(table, entries, cnt, &done);
+    if (added != NULL) {
+        *added = done;
+    }
+
+    lpm_log_print(table, "add %u of %u entries return %d\n", done, cnt, ret);
+
+    return ret;
+}
+
+/* Take care only default route and data in LPM table */
+lpm_result_t lpm_del_default_data(lpm_lkup_table_t *table)
+{
+    if (table == NULL) {
+        lpm_con_print("%s failed, table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
+    }
+
+    if (table->default_data == NULL) {
+        lpm_debug_norm(table, "default data do not exist\n");
+        return LPM_ERR_NOTFOUND;
+    }
+
+    table->default_data = NULL;
+    table->default_masklen = 0;
+    memset(&(table->default_addr), 0, sizeof(table->default_addr));
+    lpm_shm_publish(table);
+
+    lpm_log_print(table, "success\n");
+
+    return lpm_journal_append(table, LPM_JOURNAL_DEL_DEFAULT, NULL, 0, NULL);
+}
+
+/* Zero out corresponding entrys' data in m-trie block */
+static lpm_result_t zero_out_data(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, u8 *addr, u32 masklen)
+{
+    lpm_result_t ret = LPM_SUCCESS;
+    u8 idx;
+    int level;
+    mtrie_node_t *entry, *trie;
+    mtrie_base_t table_base = mtrie->hi256_table_base;
+
+    idx = addr[0];
+
+    if (masklen <= 8) { /* hi256_table_base operating directly */
+        return lpm_pattern_generate(table, mtrie, &table_base, idx, (masklen - 1), NULL);
+    }
+
+    entry = mtrie_entry(mtrie_base(mtrie, table_base), idx);
+    trie = mtrie_base(mtrie, entry->base);
+    if (trie == MTRIE_UNIFORM_BLOCK) {
+        trie = mtrie_unfold_block(table, mtrie, entry, addr, 0);
+        if (trie == NULL) {
+            return LPM_ERR_RESOURCES;
+        }
+    }
+    entry->data = mtrie_data_of(NULL);
+    if (trie == NULL) {
+        lpm_debug_alg(table, "mtrie block do not exist\n");
+        return LPM_ERR_INTERNAL;
+    }
+    for (level = 1; (trie != NULL) && (level < 16); level++) {
+        idx = addr[level];
+        if ((masklen - (level << 3)) <= 8) {
+            /* we are in this trie block */
+            lpm_debug_norm(table, "idx<%u>, bitpos<%u>\n", idx, masklen - 1);
+            ret = lpm_pattern_generate(table, mtrie, &entry->base, idx, (masklen - 1), NULL);
+            break;
+        }
+        entry = mtrie_entry(trie, idx);
+        trie = mtrie_base(mtrie, entry->base);
+        if (trie == MTRIE_UNIFORM_BLOCK) {
+            /* Folded block on the path, expand it again before zero out */
+            trie = mtrie_unfold_block(table, mtrie, entry, addr, level);
+            if (trie == NULL) {
+                return LPM_ERR_RESOURCES;
+            }
+        }
+        entry->data = mtrie_data_of(NULL);
+    }
+
+    return ret;
+}
+
+static void delete_trie_block(lpm_lkup_table_t *table, lpm_mtrie_t *mtrie, u8 *addr, u32 bitpos)
+{
+    u8 idx;
+    int level, trie_count, i;
+    mtrie_node_t *entry, *trie;
+
+    assert(BOUNDARY_BIT_POSITION(bitpos));  /* must be boundary */
+    lpm_debug_norm(table, "bitpos %u must be boundary\n", bitpos);
+
+    trie_count = (bitpos >> 3) + 1;
+    trie = mtrie_base(mtrie, mtrie->hi256_table_base);
+
+    /* Find the trie block to delete */
+    for (level = 0; (trie != NULL) && (level < trie_count); level++) {
+        idx = addr[level];
+        
+        entry = mtrie_entry(trie, idx);
+        trie = mtrie_base(mtrie, entry->base);
+        if (trie == MTRIE_UNIFORM_BLOCK) {
+            /* Folded block holds data, nothing to delete */
+            return;
+        }
+    }
+
+    entry->base = mtrie_base_of(mtrie, NULL);   /* delete trie block from LPM m-trie */
+    if (trie != NULL) {
+        for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
+            /* Inconsistence check */
+            entry = mtrie_entry(trie, i);
+            if (entry->base) {
+                /* XXX BUG */
+                lpm_debug_alg(table, "*BUG*, bitpos %u, sub-block entry[%d]'s base not null\n",
+                                        bitpos, i);
+                lpm_log_print(table, "*BUG*, bitpos %u, sub-block entry[%d]'s base not null\n",
+                                        bitpos, i);
+                lpm_con_print("*BUG*, bitpos %u, sub-block entry[%d]'s base not null\n", bitpos, i);
+                exit(-1);
+            }
+        }
+        mtrie_free_block(table, mtrie, trie);
+    }
+}
+
+static lpm_result_t __lpm_del_prefix(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    lpm_result_t ret = LPM_SUCCESS;
+    btrie_node_t *node;
+    btrie_node_t *last_known_node;
+    void *last_known_data = NULL, *data;
+    u32 last_known_bitpos = 0, bitpos = 0, level;
+    int last_known_hit_trie, node_hit_trie;
+    lpm_mtrie_t *mtrie;
+
+    node = table->btrie_root;
+    /* XXX: last_known_node will never be assigned by zero route data */
+    last_known_node = node;
+    while (node->masklen < masklen) {
+        if ((node->data != NULL) && (node != table->btrie_root)) {
+            last_known_node = node;         /* Record less specific node data */
+            last_known_data = node->data;
+            last_known_bitpos = node->masklen - 1;
+        }
+        node = node->child[bit_at_position(addr, node->masklen)];
+        if (node == NULL) {
+            lpm_debug_norm(table, "do not find corresponding node in b-trie\n");
+            return LPM_ERR_NOTFOUND;
+        }
+    }
+
+    if (node->masklen != masklen || !btrie_key_match(node, addr, masklen)) {
+        lpm_debug_norm(table, "do not find corresponding node in b-trie\n");
+        return LPM_ERR_NOTFOUND;
+    }
+
+    if (node->data == NULL) {
+        lpm_debug_norm(table, "do not find valid data in b-trie\n");
+        return LPM_ERR_NOTFOUND;
+    }
+
+    bitpos = masklen - 1;
+    /* Delete data in 1-trie. */
+    data = node->data;
+    node->data = NULL;
+    assert(table->stat.data_total > 0);
+    table->stat.data_total--;
+    table->stat.data_per_masklen[masklen]--;
+
+    if (last_known_data != NULL) {
+        /* Less specific data exists, using it to restore deleted data in m-trie */
+        node_hit_trie = bitpos >> 3;
+        last_known_hit_trie = last_known_bitpos >> 3;
+        if (node_hit_trie == last_known_hit_trie) {
+            /* Less specific data and deleted data are in the same trie block, restore directly. */
+            ret = lpm_prefix_expansion(table,
+                                       addr,
+                                       masklen,
+                                       last_known_bitpos,
+                                       last_known_node,
+                                       last_known_data);
+        } else {
+            /*
+             * Less specific data and deleted data are NOT in the same trie block,
+             * zero out directly just like adding NULL data at addr/masklen.
+             */
+            ret = lpm_prefix_expansion(table,
+                                       addr,
+                                       masklen,
+                                       bitpos,
+                                       node,
+                                       NULL);
+        }
+    } else {
+        /* Less specific data is not existing. */
+        if ((node->child[0] != NULL) || (node->child[1] != NULL)) {
+            /*
+             * Since more specific data existes, we need zero out just like add NULL data at
+             * the addr/masklen prefix.
+             */
+            ret = lpm_prefix_expansion(table,
+                                       addr,
+                                       masklen,
+                                       bitpos,
+                                       node,
+                                       NULL);
+        } else {
+            /* More specific data is not existing too, just zero out all data top-down. */
+            for_each_mtrie(table, mtrie) {
+                ret = zero_out_data(table, mtrie, addr, masklen);
+                if (ret != LPM_SUCCESS) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if (ret != LPM_SUCCESS) {
+        /*
+         * Only expanding folded block again can fail, rollback by restoring data in 1-trie and
+         * expanding it again, expanded blocks are kept.
+         */
+        lpm_debug_alg(table, "delete failed, ret %d, rollback\n", ret);
+        node->data = data;
+        table->stat.data_total++;
+        table->stat.data_per_masklen[masklen]++;
+        (void)lpm_prefix_expansion(table, addr, masklen, bitpos, node, data);
+        return ret;
+    }
+
+    btrie_release_node(table, addr, masklen);
+
+    /*
+     * Release m-trie blocks which hold no data any more, from lowest level to highest level.
+     * Block at level L only holds data of prefixes longer than L * 8 under addr.
+     */
+    for (level = (masklen - 1) >> 0x3; level > 0; level--) {
+        if (btrie_has_more_specific(table->btrie_root, addr, level << 0x3)) {
+            break;
+        }
+        for_each_mtrie(table, mtrie) {
+            delete_trie_block(table, mtrie, addr, (level << 0x3) - 1);
+        }
+    }
+
+    if (level != ((masklen - 1) >> 0x3)) {
+        /* Sub-block is released, the remaining block may become uniform */
+        for_each_mtrie(table, mtrie) {
+            mtrie_fold_path(table, mtrie, addr, level);
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * TODO FIXME XXX: when delete the prefix which is assigned to be default route, how ???
+ */
+static lpm_result_t __lpm_del_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    lpm_result_t ret;
+    u8 temp_addr[LPM_LEVEL_MAX], cnt;
+
+    ret = lpm_check_arg(table, addr, masklen);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+    ret = lpm_check_writable(table);
+    if (ret != LPM_SUCCESS) {
+        return ret;
+    }
+    if (table->btrie_root == NULL || table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
         return LPM_ERR_INTERNAL;
     }
 
-    data = btrie_find_data(table->btrie_root, addr, masklen);
-    if (data == NULL) {
-        lpm_debug_norm(table, "not find valid data to update default\n");
-        return LPM_ERR_NOTFOUND;
+    if (masklen == 0) {
+        if (table->btrie_root->data == NULL) {
+            lpm_debug_norm(table, "do not find valid data in b-trie\n");
+            ret = LPM_ERR_NOTFOUND;
+            goto finish;
+        }
+        
+        table->btrie_root->data = NULL;
+        assert(table->stat.data_total > 0);
+        table->stat.data_total--;
+        table->stat.data_per_masklen[masklen]--;
+
+        ret = LPM_SUCCESS;
+        goto finish;
     }
+    
+    memset(&temp_addr, 0, sizeof(temp_addr));
+    cnt = ((masklen - 1) >> 0x3) + 1;
+    memcpy(&temp_addr, addr, cnt);
 
-    table->default_data = data;
-    table->default_masklen = masklen;
-    memset(&(table->default_addr), 0, sizeof(table->default_addr));
-    if (masklen > 0) {
-        cnt = ((masklen - 1) >> 0x3) + 1;
-        memcpy(&(table->default_addr), addr, cnt);
-        mask = 0xFF ^ ((1 << (0x7 - ((masklen - 1) & 0x7))) - 1);
-        table->default_addr[cnt - 1] &= mask;
+    /* Missing prefix never costs a reservation, which may fail on a table out of memory */
+    if (btrie_find_data(table->btrie_root, addr, masklen) == NULL) {
+        lpm_debug_norm(table, "do not find valid data in b-trie\n");
+        ret = LPM_ERR_NOTFOUND;
+        goto finish;
+    }
+
+    /* Folded blocks on the prefix's path may be expanded again, reserve them first */
+    ret = mtrie_reserve_path(table, addr, masklen);
+    if (ret != LPM_SUCCESS) {
+        goto finish;
+    }
+
+    ret = __lpm_del_prefix(table, temp_addr, masklen);
+
+finish:
+    if (ret == LPM_SUCCESS) {
+        ret = lpm_journal_append(table, LPM_JOURNAL_DEL, addr, masklen, NULL);
+    }
+    
+    lpm_log_print(table, "delete entry return %d\n", ret);
+
+    return ret;
+}
+
+lpm_result_t lpm_del_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+{
+    lpm_write_count_t begin;
+    unsigned long written;
+    lpm_result_t ret;
+    int counted;
+
+    counted = lpm_write_begin(table, addr, masklen, &begin);
+    LPM_PERF_CALL(table, LPM_PERF_DEL, ret, __lpm_del_entry(table, addr, masklen));
+    if (counted) {
+        written = lpm_write_end(table, &begin, addr, masklen, ret);
+        LPM_TRACE_POINT(LPM_TRACE_DEL, table, addr, masklen, written, ret);
+    }
+
+    return ret;
+}
+
+/* Depth first traversal. Traversing all 1-trie data and then print default data */
+lpm_result_t lpm_walk_entry(lpm_lkup_table_t *table, lpm_data_walker_func_t walker)
+{
+    lpm_result_t ret = LPM_SUCCESS;
+
+    if (table == NULL) {
+        lpm_con_print("%s table not found...\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+
+    if (walker == NULL) {
+        lpm_con_print("%s walker function not valid\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (table->btrie_root == NULL) {
+        lpm_debug_alg(table, "B-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    ret = btrie_dfs_walk(table->btrie_root, walker);
+
+    if (table->default_data != NULL) {
+        /* Print default data */
+        lpm_con_print("Default data: ----------------\n");
+        if ((*walker)(table->default_addr, table->default_masklen, table->default_data) != 0) {
+            ret = LPM_ERR_EXOTIC;
+        }
+    }
+
+    lpm_log_print(table, "using walker <%p>\n", walker);
+
+    return ret;
+}
+
+/*******************************
+ * Snapshot rel. codes
+ */
+static lpm_result_t __btrie_save(btrie_node_t *node, FILE *fp, u32 *cnt, u32 *recur_times)
+{
+    lpm_snapshot_prefix_t rec;
+    lpm_result_t ret;
+    int i;
+
+#if LPM_DEBUG_RECURSION
+    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
+        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
+    }
+    *recur_times = *recur_times + 1;
+#endif
+
+    if (node->data != NULL) {
+        memset(&rec, 0, sizeof(rec));
+        memcpy(rec.addr, node->key, sizeof(rec.addr));
+        rec.masklen = node->masklen;
+        rec.data = (uint64_t)(unsigned long)node->data;
+        if (fwrite(&rec, sizeof(rec), 1, fp) != 1) {
+            return LPM_ERR_EXOTIC;
+        }
+        (*cnt)++;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (node->child[i] == NULL) {
+            continue;
+        }
+
+        ret = __btrie_save(node->child[i], fp, cnt, recur_times);
+
+#if LPM_DEBUG_RECURSION
+        *recur_times = *recur_times - 1;
+#endif
+
+        if (ret != LPM_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return LPM_SUCCESS;
+}
+
+/*
+ * Snapshot is written into "<path>.tmp" and renamed to path, so a table loaded from the former
+ * snapshot at path keeps its mapping of the old file.
+ */
+lpm_result_t lpm_save_table(lpm_lkup_table_t *table, char *path)
+{
+    lpm_result_t ret;
+    lpm_snapshot_hdr_t hdr;
+    lpm_mtrie_t *mtrie;
+    u32 recur_times = 0;
+    char *tmp;
+    FILE *fp;
+
+    if (table == NULL || path == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (table->btrie_root == NULL || table->mtrie_cnt == 0) {
+        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
+        return LPM_ERR_INTERNAL;
+    }
+
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp == NULL) {
+        return LPM_ERR_RESOURCES;
+    }
+    sprintf(tmp, "%s.tmp", path);
+    fp = fopen(tmp, "wb");
+    if (fp == NULL) {
+        lpm_con_print("%s open <%s> failed\n", __func__, tmp);
+        free(tmp);
+        return LPM_ERR_EXOTIC;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LPM_SNAPSHOT_MAGIC;
+    hdr.version = LPM_SNAPSHOT_VERSION;
+    memcpy(hdr.name, table->name, sizeof(hdr.name));
+    hdr.flags = table->flags & (~LPM_TABLE_SNAPSHOT);
+    if (table->default_data != NULL) {
+        hdr.default_valid = 1;
+        hdr.default_masklen = table->default_masklen;
+        memcpy(hdr.default_addr, table->default_addr, sizeof(hdr.default_addr));
+    }
+
+    /* Header is written again when records are counted */
+    ret = LPM_ERR_EXOTIC;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        goto finish;
+    }
+    ret = __btrie_save(table->btrie_root, fp, &hdr.prefix_cnt, &recur_times);
+    if (ret != LPM_SUCCESS) {
+        goto finish;
+    }
+
+    /* Blocks are addressed by index in region, region is saved as it is */
+    mtrie = &(table->mtrie[0]);
+    if (LPM_MTRIE_INDEX32 && mtrie->region.base != NULL) {
+        hdr.entry_size = sizeof(mtrie_node_t);
+        hdr.sparse_size = sizeof(mtrie_sparse_t);
+        hdr.root = (u32)(unsigned long)mtrie->hi256_table_base;
+        hdr.block_cnt = table->stat.mtrie_block_alloc_stat;
+        hdr.sparse_cnt = table->stat.mtrie_sparse_alloc_stat;
+        hdr.region_off = (ftell(fp) + LPM_SNAPSHOT_ALIGN - 1) & (~((uint64_t)LPM_SNAPSHOT_ALIGN - 1));
+        hdr.region_len = mtrie->region.used;
+        ret = LPM_ERR_EXOTIC;
+        if (fseek(fp, (long)hdr.region_off, SEEK_SET) != 0 ||
+            fwrite(mtrie->region.base, mtrie->region.used, 1, fp) != 1) {
+            goto finish;
+        }
+    }
+
+    ret = LPM_ERR_EXOTIC;
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        goto finish;
+    }
+    ret = LPM_SUCCESS;
+
+finish:
+    /* Snapshot is on disk before it replaces the former one, journal may be truncated then */
+    if (ret == LPM_SUCCESS && (fflush(fp) != 0 || fsync(fileno(fp)) != 0)) {
+        ret = LPM_ERR_EXOTIC;
+    }
+    if (fclose(fp) != 0 && ret == LPM_SUCCESS) {
+        ret = LPM_ERR_EXOTIC;
+    }
+    if (ret == LPM_SUCCESS && rename(tmp, path) != 0) {
+        ret = LPM_ERR_EXOTIC;
+    }
+    if (ret != LPM_SUCCESS) {
+        lpm_con_print("%s save <%s> failed, ret %d\n", __func__, path, ret);
+        (void)remove(tmp);
+    }
+    free(tmp);
+
+    lpm_log_print(table, "save %u prefixes to <%s> return %d\n", hdr.prefix_cnt, path, ret);
+
+    return ret;
+}
+
+/* Add prefix into 1-trie only, m-trie is mapped from snapshot */
+static lpm_result_t lpm_load_btrie_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+{
+    btrie_node_t *node = NULL;
+    lpm_result_t ret;
+
+    if (lpm_slab_reserve(&table->btrie_slab, 2) != LPM_SUCCESS) {
+        table->stat.btrie_node_alloc_fail_stat++;
+        return LPM_ERR_RESOURCES;
+    }
+    ret = btrie_add_node(table, addr, masklen, &node);
+    if (ret != LPM_SUCCESS && ret != LPM_ERR_EXISTS) {
+        return ret;
+    }
+    if (node->data != NULL) {
+        return LPM_ERR_EXISTS;
+    }
+
+    node->data = data;
+    table->stat.data_total++;
+    table->stat.data_per_masklen[masklen]++;
+
+    return LPM_SUCCESS;
+}
+
+/* Map m-trie region of snapshot as the only m-trie replica, read-only */
+static lpm_result_t lpm_load_mtrie(lpm_lkup_table_t *table, lpm_snapshot_hdr_t *hdr, int fd)
+{
+    lpm_mtrie_t *mtrie;
+    void *p;
+
+    p = mmap(NULL, hdr->region_len, PROT_READ, MAP_PRIVATE, fd, (off_t)hdr->region_off);
+    if (p == MAP_FAILED) {
+        lpm_debug_mem(table, "map snapshot region [%lu Bytes] failed\n", (unsigned long)hdr->region_len);
+        return LPM_ERR_RESOURCES;
     }
-    
-    lpm_log_print(table, "update default data with <%p> success\n", data);
+    (void)madvise(p, hdr->region_len, MADV_WILLNEED);
+
+    mtrie_destroy(table);
+    mtrie = &(table->mtrie[0]);
+    mtrie->region.base = p;
+    mtrie->region.size = hdr->region_len;
+    mtrie->region.used = hdr->region_len;
+    mtrie->hi256_table_base = (mtrie_base_t)(unsigned long)hdr->root;
+    mtrie->numa_node = -1;
+    table->mtrie_cnt = 1;
+    table->flags |= LPM_TABLE_SNAPSHOT;
+    table->stat.mtrie_block_alloc_stat = hdr->block_cnt;
+    table->stat.mtrie_sparse_alloc_stat = hdr->sparse_cnt;
 
     return LPM_SUCCESS;
 }
 
 /*
- * Take care of "more specifc" data, and do not overwriting it.
+ * 1-trie is always rebuilt from prefix records, it is fast without prefix expansion. M-trie is
+ * mapped when map is set and snapshot's region has the same entry layout, otherwise prefixes
+ * are expanded again, and table is writable.
  */
-lpm_result_t lpm_add_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+static lpm_lkup_table_t *__lpm_load_table(char *path, int map)
 {
-    btrie_node_t *newnode = NULL, *append_point = NULL;
-    lpm_result_t ret;
-    u32 bitpos;
-    u8 temp_addr[LPM_LEVEL_MAX], cnt, append_bit = 0;
-    int already_exist = 0;
+    lpm_snapshot_hdr_t hdr;
+    lpm_snapshot_prefix_t rec;
+    lpm_table_param_t param;
+    lpm_lkup_table_t *table;
+    lpm_result_t ret = LPM_SUCCESS;
+    int mapped;
+    u32 i;
+    FILE *fp;
 
-    ret = lpm_check_arg(table, addr, masklen);
-    if (ret != LPM_SUCCESS) {
-        return ret;
+    if (path == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return NULL;
     }
-    if (data == NULL) {
-        lpm_con_print("%s can not add NULL data\n", __func__);
-        return LPM_ERR_INVALID;
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        lpm_con_print("%s open <%s> failed\n", __func__, path);
+        return NULL;
     }
-    if (table->btrie_root == NULL || table->hi256_table_base == NULL) {
-        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
-        return LPM_ERR_INTERNAL;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        hdr.magic != LPM_SNAPSHOT_MAGIC || hdr.version != LPM_SNAPSHOT_VERSION) {
+        lpm_con_print("%s <%s> is not LPM snapshot of version %u\n", __func__, path, LPM_SNAPSHOT_VERSION);
+        fclose(fp);
+        return NULL;
     }
+    hdr.name[LPM_TABLE_NAME_LEN - 1] = '\0';
 
-    /*
-     * btrie_add_entry will never fail to return a 1-trie node.
-     * If node is newly added, append_point will be used in rollback.
-     */
-    ret = btrie_add_node(table, addr, masklen, &newnode, &append_point, &append_bit);
-    if (ret != LPM_SUCCESS) {
-        if (ret == LPM_ERR_RESOURCES) {
-            lpm_debug_mem(table, "get b-trie node [%d Bytes] failed, due to memory allocate\n",
-                                    sizeof(btrie_node_t));
-            /*
-             * Rollback operation due to b-trie node adding failure.
-             * Since variable newnode is not used, it can be used as temporary variable.
-             */
-            newnode = append_point->child[append_bit];
-            append_point->child[append_bit] = NULL;
-            btrie_del_appended(table, newnode);
-            return LPM_ERR_RESOURCES;
-        } else if (ret == LPM_ERR_EXISTS) { /* 1-trie node exists already */
-            already_exist = 1;
-        } else {                            /* Other error must return directly */
-            return ret;
-        }
+    mapped = map && LPM_MTRIE_INDEX32 && hdr.region_len != 0 && hdr.entry_size == sizeof(mtrie_node_t) &&
+             hdr.sparse_size == sizeof(mtrie_sparse_t);
+
+    memset(&param, 0, sizeof(param));
+    param.flags = hdr.flags;
+    if (mapped) {
+        /* Mapped file is the only replica, its pages are in page cache */
+        param.flags &= ~(LPM_TABLE_NUMA_REPLICA | LPM_TABLE_HUGEPAGE | LPM_TABLE_HUGEPAGE_1G);
+    }
+    table = lpm_create_table_ex(hdr.name, &param);
+    if (table == NULL) {
+        fclose(fp);
+        return NULL;
     }
 
-    assert(newnode != NULL);
-    
-    if (newnode->data != NULL) {
-        /* data has already exists */
-        if (newnode->data == data) {
-            lpm_debug_norm(table, "data <%p> alreadly exists\n", data);
-            return LPM_ERR_EXISTS;
+    for (i = 0; i < hdr.prefix_cnt && ret == LPM_SUCCESS; i++) {
+        if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.masklen > LPM_MASKLEN_MAX) {
+            ret = LPM_ERR_INVALID;
+            break;
+        }
+        if (mapped) {
+            ret = lpm_load_btrie_entry(table, rec.addr, rec.masklen, (void *)(unsigned long)rec.data);
         } else {
-            lpm_debug_norm(table, "data <%p> conflict with new data <%p>\n", newnode->data, data);
-            return LPM_ERR_CONFLICT;
+            ret = lpm_add_entry(table, rec.addr, rec.masklen, (void *)(unsigned long)rec.data);
         }
     }
-
-    /* add data in 1-trie */
-    newnode->data = data;
-    table->stat.data_total++;
-    table->stat.data_per_masklen[masklen]++;
-
-    /*
-     * Zero route can be done now.
-     */
-    if (masklen == 0) {
-        lpm_log_print(table, "add data<%p> success\n", data);
-        return LPM_SUCCESS;
+    if (ret == LPM_SUCCESS && hdr.default_valid) {
+        ret = lpm_update_default_data(table, hdr.default_addr, hdr.default_masklen);
     }
+    if (ret == LPM_SUCCESS && mapped) {
+        ret = lpm_load_mtrie(table, &hdr, fileno(fp));
+    }
+    fclose(fp);
 
-    memset(&temp_addr, 0, sizeof(temp_addr));
-    cnt = ((masklen - 1) >> 0x3) + 1;
-    memcpy(&temp_addr, addr, cnt);  /* Copy addr information to local variable */
-
-    bitpos = masklen - 1;
-    ret = lpm_prefix_expansion(table, temp_addr, masklen, bitpos, newnode, data);
     if (ret != LPM_SUCCESS) {
-        if (ret == LPM_ERR_RESOURCES) {
-            newnode->data = NULL;
-            table->stat.data_total--;
-            table->stat.data_per_masklen[masklen]--;
-            if (already_exist) {
-                /* The newnode is not NEWLY added, this is easy situation */
-                lpm_debug_alg(table, "btrie node already exists, but mtrie block alloc failed\n");
-            } else {
-                /*
-                 * XXX: rollback 1-trie, newnode can be used as temporary variable.
-                 */
-                newnode = append_point->child[append_bit];
-                append_point->child[append_bit] = NULL;
-                btrie_del_appended(table, newnode);
-                lpm_debug_alg(table, "btrie node alloc success but mtrie block failed\n");
-            }
-        } else {
-            /* XXX BUG */
-            lpm_debug_alg(table, "*BUG* *ERROR* mtrie block failed, ret %d\n", ret);
-            lpm_con_print("*BUG* *ERROR* mtrie block failed, ret %d\n", ret);
-            assert(0);  /* XXX: suicide */
-            return LPM_ERR_INTERNAL;
-        }
+        lpm_con_print("%s load <%s> failed at prefix %u, ret %d\n", __func__, path, i, ret);
+        lpm_destroy_table(table);
+        return NULL;
     }
 
-    lpm_log_print(table, "add data<%p> success\n", data);
+    lpm_log_print(table, "load %u prefixes from <%s>, m-trie %s\n",
+                            hdr.prefix_cnt, path, mapped ? "mapped" : "rebuilt");
 
-    return ret;
+    return table;
 }
 
-lpm_result_t lpm_update_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data)
+lpm_lkup_table_t *lpm_load_table(char *path)
 {
-    lpm_result_t ret;
-    btrie_node_t *stored_node;
-    u32 bitpos;
-    u8 temp_addr[LPM_LEVEL_MAX], cnt;
+    return __lpm_load_table(path, 1);
+}
 
-    ret = lpm_check_arg(table, addr, masklen);
-    if (ret != LPM_SUCCESS) {
-        return ret;
+/* Map shared m-trie region of writer process as the only m-trie replica, read-only */
+static lpm_result_t lpm_attach_mtrie(lpm_lkup_table_t *table, int fd, size_t size)
+{
+    lpm_mtrie_t *mtrie;
+    lpm_shm_hdr_t *shm;
+
+    mtrie_destroy(table);
+    table->flags |= LPM_TABLE_ATTACHED;
+    mtrie = &(table->mtrie[0]);
+    if (lpm_region_init(&mtrie->region, size, LPM_HUGEPAGE_SIZE, fd, PROT_READ) != LPM_SUCCESS) {
+        lpm_debug_mem(table, "map shared memory [%lu Bytes] failed\n", (unsigned long)size);
+        return LPM_ERR_RESOURCES;
     }
-    if (data == NULL) {
-        lpm_con_print("%s can not using NULL data to update\n", __func__);
+    mtrie->region.used = size;
+    mtrie->numa_node = -1;
+    table->mtrie_cnt = 1;
+
+    shm = (lpm_shm_hdr_t *)mtrie->region.base;
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != LPM_SHM_MAGIC ||
+        shm->version != LPM_SHM_VERSION || shm->entry_size != sizeof(mtrie_node_t) ||
+        shm->sparse_size != sizeof(mtrie_sparse_t) || shm->size != size) {
+        lpm_debug_norm(table, "shared memory is not LPM table of version %u\n", LPM_SHM_VERSION);
         return LPM_ERR_INVALID;
     }
-    if (table->btrie_root == NULL || table->hi256_table_base == NULL) {
-        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
-        return LPM_ERR_INTERNAL;
+    table->shm = shm;
+    /* Only for statistic and dumping, lookups follow root of header */
+    mtrie->hi256_table_base = (mtrie_base_t)(unsigned long)shm->root;
+    /* Name in shared memory may be unterminated */
+    snprintf(table->name, sizeof(table->name), "%.*s", (int)sizeof(shm->name) - 1, shm->name);
+
+    return LPM_SUCCESS;
+}
+
+lpm_lkup_table_t *lpm_attach_table(char *shm_name)
+{
+    lpm_lkup_table_t *table;
+    lpm_result_t ret;
+    struct stat st;
+    int fd;
+
+    if (shm_name == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return NULL;
+    }
+    if (!LPM_MTRIE_INDEX32) {
+        lpm_con_print("%s shared table needs LPM_MTRIE_INDEX32\n", __func__);
+        return NULL;
+    }
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) {
+        lpm_con_print("%s open shared memory <%s> failed\n", __func__, shm_name);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= LPM_CACHE_LINE) {
+        lpm_con_print("%s shared memory <%s> is not LPM table\n", __func__, shm_name);
+        close(fd);
+        return NULL;
     }
 
-    stored_node = btrie_find_node(table->btrie_root, addr, masklen);
-    if ((stored_node == NULL) || (stored_node->data == NULL)) {
-        lpm_con_print("%s not find valid data; please use lpm_add_entry() first\n", __func__);
-        return LPM_ERR_NOTFOUND;
+    table = lpm_create_table(shm_name);
+    if (table == NULL) {
+        close(fd);
+        return NULL;
     }
-    
-    if (stored_node->data == data) {
-        lpm_debug_norm(table, "data <%p> are the same\n", data);
-    } else {
-        /* update data in 1-btrie */
-        stored_node->data = data;
+    ret = lpm_attach_mtrie(table, fd, (size_t)st.st_size);
+    close(fd);
+    if (ret != LPM_SUCCESS) {
+        lpm_con_print("%s attach <%s> failed, ret %d\n", __func__, shm_name, ret);
+        lpm_destroy_table(table);
+        return NULL;
     }
 
-    if (masklen == 0) {
-        lpm_log_print(table, "update success\n");
+    lpm_log_print(table, "attach to <%s>, %lu Bytes\n", shm_name, (unsigned long)st.st_size);
+
+    return table;
+}
+
+/*******************************
+ * Journal rel. codes
+ */
+static u32 lpm_journal_checksum(lpm_journal_rec_t *rec)
+{
+    lpm_journal_rec_t tmp = *rec;
+    u8 *p = (u8 *)&tmp;
+    u32 sum = 2166136261U;
+    u32 i;
+
+    tmp.checksum = 0;
+    for (i = 0; i < sizeof(tmp); i++) {
+        sum = (sum ^ p[i]) * 16777619U;
+    }
+
+    return sum;
+}
+
+static void lpm_journal_fill(lpm_journal_rec_t *rec, u32 seq, lpm_journal_op_t op,
+                             u8 *addr, u32 masklen, void *data)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->magic = LPM_JOURNAL_MAGIC;
+    rec->seq = seq;
+    rec->op = op;
+    rec->masklen = masklen;
+    if (addr != NULL && masklen > 0) {
+        memcpy(rec->addr, addr, ((masklen - 1) >> 0x3) + 1);
+    }
+    rec->data = (uint64_t)(unsigned long)data;
+    rec->checksum = lpm_journal_checksum(rec);
+}
+
+/* Write records filled from sequence journal.seq + 1 on, in one write */
+static lpm_result_t lpm_journal_write(lpm_lkup_table_t *table, lpm_journal_rec_t *recs, u32 cnt)
+{
+    size_t size = (size_t)cnt * sizeof(lpm_journal_rec_t);
+
+    /* One write for records, they are in page cache and survive crash of process */
+    if (write(table->journal.fd, recs, size) != (ssize_t)size) {
+        lpm_con_print("%s table <%s> journal write failed, call lpm_checkpoint()\n", __func__, table->name);
+        /* Drop torn records, records after them would never be replayed */
+        (void)ftruncate(table->journal.fd, (off_t)table->journal.seq * sizeof(lpm_journal_rec_t));
+        return LPM_ERR_EXOTIC;
+    }
+    table->journal.seq += cnt;
+
+    return LPM_SUCCESS;
+}
+
+/* Append record of a successful update, update is kept in table even if appending fails */
+static lpm_result_t lpm_journal_append(lpm_lkup_table_t *table, lpm_journal_op_t op,
+                                       u8 *addr, u32 masklen, void *data)
+{
+    lpm_journal_rec_t rec;
+
+    if (table->journal.fd < 0) {
         return LPM_SUCCESS;
     }
-    
-    memset(&temp_addr, 0, sizeof(temp_addr));
-    cnt = ((masklen - 1) >> 0x3) + 1;
-    memcpy(&temp_addr, addr, cnt);
 
-    bitpos = masklen - 1;
-    /* Update data in m-trie */
-    ret = lpm_prefix_expansion(table, temp_addr, masklen, bitpos, stored_node, data);
+    lpm_journal_fill(&rec, table->journal.seq + 1, op, addr, masklen, data);
 
-    lpm_log_print(table, "update success\n");
+    return lpm_journal_write(table, &rec, 1);
+}
 
-    return ret;
+static void lpm_journal_close_fd(lpm_lkup_table_t *table)
+{
+    if (table->journal.fd >= 0) {
+        close(table->journal.fd);
+    }
+    free(table->journal.snapshot);
+    table->journal.fd = -1;
+    table->journal.seq = 0;
+    table->journal.snapshot = NULL;
 }
 
-/* Take care only default route and data in LPM table */
-lpm_result_t lpm_del_default_data(lpm_lkup_table_t *table)
+lpm_result_t lpm_checkpoint(lpm_lkup_table_t *table)
 {
-    lpm_result_t ret = LPM_SUCCESS;
+    lpm_result_t ret;
 
-    if (table == NULL) {
-        lpm_con_print("%s failed, table not found...\n", __func__);
+    if (table == NULL || table->journal.fd < 0) {
+        lpm_con_print("%s table or journal not found...\n", __func__);
         return LPM_ERR_INVALID;
     }
 
-    if (table->default_data == NULL) {
-        lpm_debug_norm(table, "default data do not exist\n");
-        return LPM_ERR_NOTFOUND;
+    ret = lpm_save_table(table, table->journal.snapshot);
+    if (ret != LPM_SUCCESS) {
+        return ret;
     }
+    /*
+     * Snapshot has all records now. Records are replayed again on it if crash comes before
+     * truncating, which is harmless, see lpm_journal_replay().
+     */
+    if (ftruncate(table->journal.fd, 0) != 0) {
+        lpm_con_print("%s table <%s> truncate journal failed\n", __func__, table->name);
+        return LPM_ERR_EXOTIC;
+    }
+    table->journal.seq = 0;
 
-    table->default_data = NULL;
-    table->default_masklen = 0;
-    memset(&(table->default_addr), 0, sizeof(table->default_addr));
-
-    lpm_log_print(table, "success\n");
+    lpm_log_print(table, "checkpoint to <%s> success\n", table->journal.snapshot);
 
-    return ret;
+    return LPM_SUCCESS;
 }
 
-/* Zero out corresponding entrys' data in m-trie block */
-static lpm_result_t zero_out_data(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+lpm_result_t lpm_journal_open(lpm_lkup_table_t *table, char *snapshot, char *journal)
 {
-    lpm_result_t ret = LPM_SUCCESS;
-    u8 idx;
-    int level;
-    mtrie_node_t *entry, *trie;
-    mtrie_node_t *table_base = table->hi256_table_base;
+    lpm_result_t ret;
 
-    idx = addr[0];
+    if (table == NULL || snapshot == NULL || journal == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
+    }
+    if (table->journal.fd >= 0) {
+        lpm_debug_norm(table, "journal already opened\n");
+        return LPM_ERR_EXISTS;
+    }
 
-    if (masklen <= 8) { /* hi256_table_base operating directly */
-        lpm_pattern_generate(table_base, idx, (masklen - 1), NULL);
-        return LPM_SUCCESS;
+    table->journal.snapshot = strdup(snapshot);
+    if (table->journal.snapshot == NULL) {
+        return LPM_ERR_RESOURCES;
+    }
+    table->journal.fd = open(journal, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (table->journal.fd < 0) {
+        lpm_con_print("%s open <%s> failed\n", __func__, journal);
+        lpm_journal_close_fd(table);
+        return LPM_ERR_EXOTIC;
     }
 
-    entry = (mtrie_node_t *)(table_base + idx);
-    entry->data = NULL;
-    trie = entry->base;
-    if (trie == NULL) {
-        lpm_debug_alg(table, "mtrie block do not exist\n");
-        return LPM_ERR_INTERNAL;
+    /* Journal holds updates after snapshot, so it begins with a checkpoint */
+    ret = lpm_checkpoint(table);
+    if (ret != LPM_SUCCESS) {
+        lpm_journal_close_fd(table);
+        return ret;
     }
-    for (level = 1; (trie != NULL) && (level < 16); level++) {
-        idx = addr[level];
-        if ((masklen - (level << 3)) <= 8) {
-            /* we are in this trie block */
-            lpm_debug_norm(table, "idx<%u>, bitpos<%u>\n", idx, masklen - 1);
-            lpm_pattern_generate(trie, idx, (masklen - 1), NULL);
-            break;
-        }
-        entry = (mtrie_node_t *)(trie + idx);
-        entry->data = NULL;
-        trie = entry->base;
+
+    lpm_log_print(table, "journal to <%s> success\n", journal);
+
+    return LPM_SUCCESS;
+}
+
+lpm_result_t lpm_journal_close(lpm_lkup_table_t *table)
+{
+    if (table == NULL || table->journal.fd < 0) {
+        lpm_con_print("%s table or journal not found...\n", __func__);
+        return LPM_ERR_INVALID;
     }
 
-    return ret;
+    lpm_journal_close_fd(table);
+
+    lpm_log_print(table, "journal closed\n");
+
+    return LPM_SUCCESS;
 }
 
-static void delete_trie_block(lpm_lkup_table_t *table, u8 *addr, u32 bitpos)
+/*
+ * Every record sets or removes one prefix (or default data) as a whole, replaying is idempotent
+ * as long as records are replayed in order. Records already in snapshot, by crash between
+ * saving snapshot and truncating journal, do no harm then.
+ */
+static lpm_result_t lpm_journal_replay(lpm_lkup_table_t *table, lpm_journal_rec_t *rec)
 {
-    u8 idx;
-    int level, trie_count, i;
-    mtrie_node_t *entry, *trie;
+    void *data = (void *)(unsigned long)rec->data;
+    lpm_result_t ret;
 
-    assert(BOUNDARY_BIT_POSITION(bitpos));  /* must be boundary */
-    lpm_debug_norm(table, "bitpos %u must be boundary\n", bitpos);
+    switch (rec->op) {
+    case LPM_JOURNAL_ADD:
+    case LPM_JOURNAL_UPDATE:
+        ret = lpm_upsert_entry(table, rec->addr, rec->masklen, data);
+        break;
+    case LPM_JOURNAL_DEL:
+        ret = lpm_del_entry(table, rec->addr, rec->masklen);
+        break;
+    case LPM_JOURNAL_DEFAULT:
+        ret = lpm_update_default_data(table, rec->addr, rec->masklen);
+        break;
+    case LPM_JOURNAL_DEL_DEFAULT:
+        ret = lpm_del_default_data(table);
+        break;
+    case LPM_JOURNAL_CLEAR:
+        ret = lpm_clear_table(table);
+        break;
+    default:
+        ret = LPM_ERR_INVALID;
+        break;
+    }
 
-    trie_count = (bitpos >> 3) + 1;
-    trie = table->hi256_table_base;
+    return (ret == LPM_ERR_NOTFOUND) ? LPM_SUCCESS : ret;
+}
 
-    /* Find the trie block to delete */
-    for (level = 0; (trie != NULL) && (level < trie_count); level++) {
-        idx = addr[level];
-        
-        entry = (mtrie_node_t *)(trie + idx);
-        trie = entry->base;
+lpm_lkup_table_t *lpm_recover(char *snapshot, char *journal)
+{
+    lpm_lkup_table_t *table;
+    lpm_journal_rec_t rec;
+    lpm_result_t ret = LPM_SUCCESS;
+    u32 seq = 0;
+    FILE *fp;
+
+    if (snapshot == NULL || journal == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return NULL;
+    }
+
+    /* Journal is replayed on the table, so m-trie is rebuilt rather than mapped */
+    table = __lpm_load_table(snapshot, 0);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    fp = fopen(journal, "rb");
+    if (fp == NULL) {
+        lpm_log_print(table, "journal <%s> not found, recover from snapshot only\n", journal);
+        return table;
+    }
+    /* Replay stops at torn record, the update of which has never been reported as done */
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if (rec.magic != LPM_JOURNAL_MAGIC || rec.seq != seq + 1 ||
+            rec.checksum != lpm_journal_checksum(&rec) || rec.masklen > LPM_MASKLEN_MAX) {
+            lpm_debug_norm(table, "journal record %u is torn, replay stops\n", seq + 1);
+            break;
+        }
+        ret = lpm_journal_replay(table, &rec);
+        if (ret != LPM_SUCCESS) {
+            break;
+        }
+        seq++;
     }
+    fclose(fp);
 
-    entry->base = NULL;                     /* delete trie block from LPM m-trie */
-    if (trie != NULL) {
-        for (i = 0; i < MTRIE_BLOCK_ENTRY; i++) {
-            /* Inconsistence check */
-            entry = (mtrie_node_t *)(trie + i);
-            if (entry->base != NULL) {
-                /* XXX BUG */
-                lpm_debug_alg(table, "*BUG*, bitpos %u, sub-block entry[%d]'s base not null\n",
-                                        bitpos, i);
-                lpm_log_print(table, "*BUG*, bitpos %u, sub-block entry[%d]'s base not null\n",
-                                        bitpos, i);
-                lpm_con_print("*BUG*, bitpos %u, sub-block entry[%d]'s base not null\n", bitpos, i);
-                exit(-1);
-            }
-        }
-        mtrie_free_block(table, trie);
+    if (ret != LPM_SUCCESS) {
+        lpm_con_print("%s replay <%s> failed at record %u, ret %d\n", __func__, journal, seq + 1, ret);
+        lpm_destroy_table(table);
+        return NULL;
     }
+
+    lpm_log_print(table, "recover from <%s>, %u journal records replayed\n", snapshot, seq);
+
+    return table;
 }
 
-/*
- * Recursively check and delete sub-tree in 1-trie and m-trie.
+/*******************************
+ * Loader rel. codes
  */
-static int __delete_subtree(lpm_lkup_table_t *table,
-                            u8 *addr,
-                            btrie_node_t *temp_root,
-                            u32 bitpos,
-                            u32 *recur_times)
-{
-    int delete_left = 1;
-    int delete_right = 1;
-    
-#if LPM_DEBUG_RECURSION
-    if (*recur_times > LPM_RECUR_DEPTH_WARN) {
-        lpm_con_print("%s *BUG WARNING* recursion times = %u, too deep\n", __func__, *recur_times);
-    }
-    *recur_times = *recur_times + 1;
-#endif
-
-    if ((temp_root->child[0] == NULL) && (temp_root->child[1] == NULL)) {
-        if (temp_root->data == NULL) {
-            /* temp_root has no data, can delete it. */
-            return 1;
-        } else {
-            /* temp_root has data, so do not touch it. */
-            return 0;
+/* Map file read-only, nothing is mapped for empty file */
+static lpm_result_t lpm_file_map(char *path, const char **file, size_t *size, int advice)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    *file = NULL;
+    *size = 0;
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        lpm_con_print("%s open <%s> failed\n", __func__, path);
+        if (fd >= 0) {
+            close(fd);
         }
+        return LPM_ERR_EXOTIC;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return LPM_SUCCESS;
     }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        lpm_con_print("%s map <%s> failed\n", __func__, path);
+        return LPM_ERR_RESOURCES;
+    }
+    (void)madvise(p, st.st_size, advice);
+    *file = p;
+    *size = st.st_size;
 
-    /* Left sub-tree operation */
-    if (temp_root->child[0] != NULL) {
-        delete_left = __delete_subtree(table,
-                                       addr,
-                                       temp_root->child[0],
-                                       bitpos + 1,
-                                       recur_times);
+    return LPM_SUCCESS;
+}
 
-#if LPM_DEBUG_RECURSION
-        *recur_times = *recur_times - 1;
-#endif
+#define LPM_TEXT_BLANK(c)   ((c) == ' ' || (c) == '\t' || (c) == '\r')
 
-        if (delete_left) {
-            /* Left sub-tree can be destroyed. */
-            btrie_destroy_subtree(table, temp_root->child[0]);
-            temp_root->child[0] = NULL;
-        } else {
-            /* Left sub-tree has more specific data, do not touch it. */
-            return 0;
-        }
+/* Parse "addr/masklen value" line, return 1 for entry, 0 for blank or comment, -1 for malformed */
+static int lpm_text_parse_line(const char *p, const char *end, lpm_entry_t *entry)
+{
+    char buf[INET6_ADDRSTRLEN];
+    const char *tok;
+    unsigned long value = 0, digit;
+    u32 masklen = 0, base = 10;
+    int af;
+
+    while (p < end && LPM_TEXT_BLANK(*p)) {
+        p++;
+    }
+    if (p == end || *p == '#') {
+        return 0;
     }
 
-    /* Right sub-tree operation */
-    if (temp_root->child[1] != NULL) {
-        delete_right = __delete_subtree(table,
-                                        addr,
-                                        temp_root->child[1],
-                                        bitpos + 1,
-                                        recur_times);
+    tok = p;
+    while (p < end && *p != '/' && !LPM_TEXT_BLANK(*p)) {
+        p++;
+    }
+    if (p == end || *p != '/' || p == tok || (size_t)(p - tok) >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, tok, p - tok);
+    buf[p - tok] = '\0';
+    af = (memchr(buf, ':', p - tok) != NULL) ? AF_INET6 : AF_INET;
+    memset(entry->addr, 0, sizeof(entry->addr));
+    if (inet_pton(af, buf, entry->addr) != 1) {
+        return -1;
+    }
 
-#if LPM_DEBUG_RECURSION
-        *recur_times = *recur_times - 1;
-#endif
+    for (tok = ++p; p < end && *p >= '0' && *p <= '9' && p - tok < 3; p++) {
+        masklen = masklen * 10 + (*p - '0');
+    }
+    if (p == tok || masklen > ((af == AF_INET) ? 32 : LPM_MASKLEN_MAX)) {
+        return -1;
+    }
 
-        if (delete_right) {
-            btrie_destroy_subtree(table, temp_root->child[1]);
-            temp_root->child[1] = NULL;
+    for (tok = p; p < end && LPM_TEXT_BLANK(*p); p++);
+    if (p == tok) {
+        return -1;
+    }
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+    for (tok = p; p < end && !LPM_TEXT_BLANK(*p); p++) {
+        if (*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        } else if (base == 16 && (*p | 0x20) >= 'a' && (*p | 0x20) <= 'f') {
+            digit = (*p | 0x20) - 'a' + 10;
         } else {
-            return 0;
+            return -1;
         }
-    }
-
-    if ((delete_left && delete_right) && (temp_root != table->btrie_root)) {
-        if (BOUNDARY_BIT_POSITION(bitpos)) {
-            /*
-             * While recusively deleting 1-trie node from lowest to highest level, if we meet
-             * boundary bit, we delete mtrie block too. */
-            delete_trie_block(table, addr, bitpos);
+        if (value > (~0UL - digit) / base) {
+            return -1;
         }
-
-        /*
-         * temp_root's left and right sub-tree is clear now, we can delete temp_root now.
-         */
-        return 1;
+        value = value * base + digit;
+    }
+    while (p < end && LPM_TEXT_BLANK(*p)) {
+        p++;
+    }
+    if (p == tok || p != end || value == 0) {
+        return -1;
     }
 
-    return 0;
+    entry->masklen = masklen;
+    entry->data = (void *)value;
+
+    return 1;
 }
 
-static int delete_subtree(lpm_lkup_table_t * table,
-                            u8 * addr,
-                            btrie_node_t * temp_root,
-                            u32 bitpos)
+static void *lpm_text_parse(void *arg)
 {
-    u32 recur_times = 0;
+    lpm_text_chunk_t *chunk = arg;
+    const char *p = chunk->start, *eol;
+    lpm_entry_t *entries;
+    int r;
+
+    while (p < chunk->end) {
+        eol = memchr(p, '\n', chunk->end - p);
+        if (eol == NULL) {
+            eol = chunk->end;
+        }
+        chunk->lines++;
+
+        if (chunk->cnt == chunk->size) {
+            chunk->size = (chunk->size == 0) ? 1024 : (chunk->size * 2);
+            entries = realloc(chunk->entries, chunk->size * sizeof(lpm_entry_t));
+            if (entries == NULL) {
+                chunk->ret = LPM_ERR_RESOURCES;
+                break;
+            }
+            chunk->entries = entries;
+        }
+        r = lpm_text_parse_line(p, eol, &chunk->entries[chunk->cnt]);
+        if (r < 0) {
+            chunk->bad_line = chunk->lines;
+            chunk->ret = LPM_ERR_INVALID;
+            break;
+        }
+        chunk->cnt += r;
+        p = eol + 1;
+    }
 
-    return __delete_subtree(table, addr, temp_root, bitpos, &recur_times);
+    return NULL;
 }
 
-static lpm_result_t __lpm_del_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+lpm_result_t lpm_load_text(lpm_lkup_table_t *table, char *path, u32 threads, u32 *added)
 {
+    lpm_text_chunk_t *chunks;
+    pthread_t tids[LPM_LOAD_THREADS_MAX];
     lpm_result_t ret = LPM_SUCCESS;
-    btrie_node_t *node;
-    btrie_node_t *last_known_node;
-    void *last_known_data = NULL;
-    u32 last_known_bitpos = 0, bitpos = 0;
-    int last_known_hit_trie, node_hit_trie;
-    u8 bit;
+    const char *file, *end;
+    size_t size;
+    u32 i, lines = 0, cnt, total = 0;
+    long cpus;
 
-    node = table->btrie_root;
-    /* XXX: last_known_node will never be assigned by zero route data */
-    last_known_node = node;
-    for (bitpos = 0; bitpos < masklen; bitpos++) {
-        bit = bit_at_position(addr, bitpos);
-        node = node->child[bit];
-        if (node == NULL) {
-            lpm_debug_norm(table, "do not find corresponding node in b-trie\n");
-            return LPM_ERR_NOTFOUND;
-        }
-        if ((node->data != NULL) && (bitpos != (masklen - 1))) {
-            last_known_node = node;         /* Record less specific node data */
-            last_known_data = node->data;
-            last_known_bitpos = bitpos;
-        }
+    if (added != NULL) {
+        *added = 0;
+    }
+    if (table == NULL || path == NULL) {
+        lpm_con_print("%s invalid argument\n", __func__);
+        return LPM_ERR_INVALID;
+    }
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
     }
 
-    if (node->data == NULL) {
-        lpm_debug_norm(table, "do not find valid data in b-trie\n");
-        return LPM_ERR_NOTFOUND;
+    ret = lpm_file_map(path, &file, &size, MADV_WILLNEED);
+    if (ret != LPM_SUCCESS || size == 0) {
+        return ret;
     }
 
-    bitpos = masklen - 1;
-    /* Delete data in 1-trie. */
-    node->data = NULL;
-    assert(table->stat.data_total > 0);
-    table->stat.data_total--;
-    table->stat.data_per_masklen[masklen]--;
-    
-    /* XXX FIXME TODO: rollback needed while deletion fails ??? */
+    if (threads == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (u32)cpus : 1;
+    }
+    if (threads > LPM_LOAD_THREADS_MAX) {
+        threads = LPM_LOAD_THREADS_MAX;
+    }
+    if ((size_t)threads > size / LPM_LOAD_CHUNK_MIN + 1) {
+        threads = size / LPM_LOAD_CHUNK_MIN + 1;
+    }
+    chunks = calloc(threads, sizeof(lpm_text_chunk_t));
+    if (chunks == NULL) {
+        munmap((void *)file, size);
+        return LPM_ERR_RESOURCES;
+    }
 
-    if (last_known_data != NULL) {
-        /* Less specific data exists, using it to restore deleted data in m-trie */
-        node_hit_trie = bitpos >> 3;
-        last_known_hit_trie = last_known_bitpos >> 3;
-        if (node_hit_trie == last_known_hit_trie) {
-            /* Less specific data and deleted data are in the same trie block, restore directly. */
-            ret = lpm_prefix_expansion(table,
-                                       addr,
-                                       masklen,
-                                       last_known_bitpos,
-                                       last_known_node,
-                                       last_known_data);
-        } else {
-            /*
-             * Less specific data and deleted data are NOT in the same trie block,
-             * zero out directly just like adding NULL data at addr/masklen.
-             */
-            ret = lpm_prefix_expansion(table,
-                                       addr,
-                                       masklen,
-                                       bitpos,
-                                       node,
-                                       NULL);
+    /* Chunks end at line boundaries, the calling thread parses the first one */
+    for (i = 0, end = file; i < threads; i++) {
+        chunks[i].start = end;
+        end = file + (size * (i + 1)) / threads;
+        if (end < chunks[i].start) {
+            end = chunks[i].start;
         }
-    } else {
-        /* Less specific data is not existing. */
-        if ((node->child[0] != NULL) || (node->child[1] != NULL)) {
-            /*
-             * Since more specific data existes, we need zero out just like add NULL data at
-             * the addr/masklen prefix.
-             */
-            ret = lpm_prefix_expansion(table,
-                                       addr,
-                                       masklen,
-                                       bitpos,
-                                       node,
-                                       NULL);
-        } else {
-            /* More specific data is not existing too, just zero out all data top-down. */
-            ret = zero_out_data(table, addr, masklen);
+        while (end < file + size && end > file && end[-1] != '\n') {
+            end++;
+        }
+        chunks[i].end = end;
+    }
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, lpm_text_parse, &chunks[i]) != 0) {
+            tids[i] = 0;
+            lpm_text_parse(&chunks[i]);
+        }
+    }
+    lpm_text_parse(&chunks[0]);
+    for (i = 1; i < threads; i++) {
+        if (tids[i] != 0) {
+            pthread_join(tids[i], NULL);
         }
     }
 
-    if (ret != LPM_SUCCESS) {
-        return ret;
+    /* Malformed file adds nothing */
+    for (i = 0; i < threads; i++) {
+        if (chunks[i].ret != LPM_SUCCESS) {
+            ret = chunks[i].ret;
+            lpm_con_print("%s <%s> line %u is malformed, ret %d\n", __func__, path,
+                          lines + chunks[i].bad_line, ret);
+            break;
+        }
+        lines += chunks[i].lines;
+    }
+    for (i = 0; i < threads && ret == LPM_SUCCESS; i++) {
+        ret = lpm_add_entries(table, chunks[i].entries, chunks[i].cnt, &cnt);
+        total += cnt;
     }
 
-    /* When the less specific data not exists, we check and delete subtree from 1-trie root. */
-    if (last_known_node == table->btrie_root) {
-        last_known_bitpos = -1;
+    for (i = 0; i < threads; i++) {
+        free(chunks[i].entries);
+    }
+    free(chunks);
+    munmap((void *)file, size);
+    if (added != NULL) {
+        *added = total;
     }
 
-    delete_subtree(table, addr, last_known_node, last_known_bitpos);
+    lpm_log_print(table, "load %u entries from <%s> with %u threads return %d\n", total, path, threads, ret);
 
-    return LPM_SUCCESS;
+    return ret;
 }
 
-/*
- * TODO FIXME XXX: when delete the prefix which is assigned to be default route, how ???
- */
-lpm_result_t lpm_del_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen)
+static inline u32 lpm_get_be16(const u8 *p)
 {
-    lpm_result_t ret;
-    u8 temp_addr[LPM_LEVEL_MAX], cnt;
+    return ((u32)p[0] << 8) | p[1];
+}
 
-    ret = lpm_check_arg(table, addr, masklen);
-    if (ret != LPM_SUCCESS) {
-        return ret;
-    }
-    if (table->btrie_root == NULL || table->hi256_table_base == NULL) {
-        lpm_debug_alg(table, "B-trie or M-trie of LPM not exists\n");
-        return LPM_ERR_INTERNAL;
-    }
+static inline u32 lpm_get_be32(const u8 *p)
+{
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
 
-    if (masklen == 0) {
-        if (table->btrie_root->data == NULL) {
-            lpm_debug_norm(table, "do not find valid data in b-trie\n");
-            ret = LPM_ERR_NOTFOUND;
-            goto finish;
-        }
-        
-        table->btrie_root->data = NULL;
-        assert(table->stat.data_total > 0);
-        table->stat.data_total--;
-        table->stat.data_per_masklen[masklen]--;
+/* Next hop in BGP path attributes, return next hop length, 0 for not found */
+static u32 lpm_mrt_nexthop(const u8 *attr, u32 len, int af, const u8 **nexthop)
+{
+    const u8 *val;
+    u32 hdr, alen;
 
-        ret = LPM_SUCCESS;
-        goto finish;
-    }
-    
-    memset(&temp_addr, 0, sizeof(temp_addr));
-    cnt = ((masklen - 1) >> 0x3) + 1;
-    memcpy(&temp_addr, addr, cnt);
+    while (len >= 3) {
+        if (attr[0] & LPM_BGP_ATTR_EXTENDED_LEN) {
+            if (len < 4) {
+                return 0;
+            }
+            hdr = 4;
+            alen = lpm_get_be16(attr + 2);
+        } else {
+            hdr = 3;
+            alen = attr[2];
+        }
+        if (hdr + alen > len) {
+            return 0;
+        }
+        val = attr + hdr;
 
-    ret = __lpm_del_entry(table, temp_addr, masklen);
+        if (af == AF_INET && attr[1] == LPM_BGP_ATTR_NEXT_HOP && alen == 4) {
+            *nexthop = val;
+            return 4;
+        }
+        if (af == AF_INET6 && attr[1] == LPM_BGP_ATTR_MP_REACH_NLRI) {
+            /* RFC 6396 keeps next hop length and next hop only, full attribute starts with AFI 0 */
+            if (alen >= 1 && val[0] != 0 && 1 + (u32)val[0] <= alen) {
+                *nexthop = val + 1;
+                return val[0];
+            }
+            if (alen >= 4 && 4 + (u32)val[3] <= alen) {
+                *nexthop = val + 4;
+                return val[3];
+            }
+            return 0;
+        }
 
-finish:
-    
-    lpm_log_print(table, "delete entry return %d\n", ret);
+        attr += hdr + alen;
+        len -= hdr + alen;
+    }
 
-    return ret;
+    return 0;
 }
 
-/* Depth first traversal. Traversing all 1-trie data and then print default data */
-lpm_result_t lpm_walk_entry(lpm_lkup_table_t *table, lpm_data_walker_func_t walker)
+/* Add prefix of RIB record, skipped is set for prefix skipped by nexthop_func */
+static lpm_result_t lpm_mrt_rib(lpm_lkup_table_t *table, const u8 *rec, u32 len, int af, int addpath,
+                                lpm_mrt_nexthop_func_t nexthop_func, void *ctx, int *skipped)
 {
-    lpm_result_t ret = LPM_SUCCESS;
+    u8 addr[LPM_LEVEL_MAX];
+    const u8 *p, *end = rec + len, *nexthop = NULL;
+    u32 masklen, bytes, entries, nexthop_len = 0, attr_len;
+    void *data = (void *)1UL;
 
-    if (table == NULL) {
-        lpm_con_print("%s table not found...\n", __func__);
+    /* Sequence number, prefix length, prefix, entry count */
+    if (len < 5) {
+        return LPM_ERR_INVALID;
+    }
+    masklen = rec[4];
+    bytes = (masklen + 7) >> 0x3;
+    if (masklen > ((af == AF_INET) ? 32 : LPM_MASKLEN_MAX) || 5 + bytes + 2 > len) {
         return LPM_ERR_INVALID;
     }
+    memset(addr, 0, sizeof(addr));
+    memcpy(addr, rec + 5, bytes);
+    p = rec + 5 + bytes;
+    entries = lpm_get_be16(p);
+    p += 2;
+
+    if (nexthop_func != NULL) {
+        /* Peer index, originated time, path identifier of ADD-PATH, attribute length */
+        if (entries > 0) {
+            if (end - p < 6 + (addpath ? 4 : 0) + 2) {
+                return LPM_ERR_INVALID;
+            }
+            p += 6 + (addpath ? 4 : 0);
+            attr_len = lpm_get_be16(p);
+            p += 2;
+            if (end - p < attr_len) {
+                return LPM_ERR_INVALID;
+            }
+            nexthop_len = lpm_mrt_nexthop(p, attr_len, af, &nexthop);
+        }
+        data = nexthop_func((u8 *)nexthop, nexthop_len, ctx);
+        if (data == NULL) {
+            *skipped = 1;
+            return LPM_SUCCESS;
+        }
+    }
 
-    if (walker == NULL) {
-        lpm_con_print("%s walker function not valid\n", __func__);
+    return lpm_upsert_entry(table, addr, masklen, data);
+}
+
+lpm_result_t lpm_load_mrt(lpm_lkup_table_t *table, char *path, int af,
+                          lpm_mrt_nexthop_func_t nexthop_func, void *ctx, u32 *added)
+{
+    lpm_result_t ret;
+    const char *file;
+    const u8 *p;
+    size_t size, off;
+    u32 type, subtype, len, total = 0;
+    int skipped;
+
+    if (added != NULL) {
+        *added = 0;
+    }
+    if (table == NULL || path == NULL || (af != AF_INET && af != AF_INET6)) {
+        lpm_con_print("%s invalid argument\n", __func__);
         return LPM_ERR_INVALID;
     }
-    if (table->btrie_root == NULL) {
-        lpm_debug_alg(table, "B-trie of LPM not exists\n");
-        return LPM_ERR_INTERNAL;
+    if (lpm_check_writable(table) != LPM_SUCCESS) {
+        return LPM_ERR_INVALID;
     }
 
-    ret = btrie_dfs_walk(table->btrie_root, walker);
+    ret = lpm_file_map(path, &file, &size, MADV_SEQUENTIAL);
+    if (ret != LPM_SUCCESS || size == 0) {
+        return ret;
+    }
 
-    if (table->default_data != NULL) {
-        /* Print default data */
-        lpm_con_print("Default data: ----------------\n");
-        if ((*walker)(table->default_addr, table->default_masklen, table->default_data) != 0) {
-            ret = LPM_ERR_EXOTIC;
+    /* Records are read in place, RIB dumps are in prefix order, which suits adding */
+    for (off = 0; off < size && ret == LPM_SUCCESS; off += LPM_MRT_HDR_LEN + len) {
+        p = (const u8 *)file + off;
+        if (size - off < LPM_MRT_HDR_LEN ||
+            size - off - LPM_MRT_HDR_LEN < (len = lpm_get_be32(p + 8))) {
+            ret = LPM_ERR_INVALID;
+            break;
+        }
+        type = lpm_get_be16(p + 4);
+        subtype = lpm_get_be16(p + 6);
+        if (type != LPM_MRT_TABLE_DUMP_V2) {
+            continue;
+        }
+
+        skipped = 0;
+        if ((af == AF_INET && subtype == LPM_MRT_RIB_IPV4_UNICAST) ||
+            (af == AF_INET6 && subtype == LPM_MRT_RIB_IPV6_UNICAST)) {
+            ret = lpm_mrt_rib(table, p + LPM_MRT_HDR_LEN, len, af, 0, nexthop_func, ctx, &skipped);
+        } else if ((af == AF_INET && subtype == LPM_MRT_RIB_IPV4_UNICAST_ADDPATH) ||
+                   (af == AF_INET6 && subtype == LPM_MRT_RIB_IPV6_UNICAST_ADDPATH)) {
+            ret = lpm_mrt_rib(table, p + LPM_MRT_HDR_LEN, len, af, 1, nexthop_func, ctx, &skipped);
+        } else {
+            continue;
         }
+        if (ret == LPM_SUCCESS && !skipped) {
+            total++;
+        }
+    }
+    if (ret != LPM_SUCCESS) {
+        lpm_con_print("%s <%s> record at offset %lu failed, ret %d\n", __func__, path, (unsigned long)off, ret);
     }
 
-    lpm_log_print(table, "using walker <%p>\n", walker);
+    munmap((void *)file, size);
+    if (added != NULL) {
+        *added = total;
+    }
+
+    lpm_log_print(table, "load %u prefixes from <%s> return %d\n", total, path, ret);
 
     return ret;
 }
@@ -20,6 +20,7 @@
 #define _LPM_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
 typedef uint32_t u32;
 typedef uint16_t u16;
@@ -49,6 +50,7 @@ typedef enum lpm_result_e {
     LPM_ERR_EXISTS,     /* Data already exist (be the same) */
     LPM_ERR_CONFLICT,   /* Data already exist (not the same) */
     LPM_ERR_EXOTIC,     /* Exotic errors, not from LPM, eg. data_walker callback function */
+    LPM_ERR_AGAIN,      /* Operation is not finished, call it again */
 } lpm_result_t;
 
 /**
@@ -57,6 +59,43 @@ typedef enum lpm_result_e {
 struct lpm_lkup_table_s;
 typedef struct lpm_lkup_table_s lpm_lkup_table_t;
 
+/**
+ * LPM table creation options, used in lpm_table_param_t flags.
+ */
+#define LPM_TABLE_HUGEPAGE      (0x1 << 0)  /* m-trie blocks on 2MB huge pages */
+#define LPM_TABLE_HUGEPAGE_1G   (0x1 << 1)  /* m-trie blocks on 1GB huge pages */
+#define LPM_TABLE_NUMA_REPLICA  (0x1 << 2)  /* one m-trie replica per NUMA node */
+#define LPM_TABLE_SPARSE        (0x1 << 3)  /* nearly empty m-trie blocks in sparse form */
+
+/**
+ * LPM memory allocator operations, used in lpm_table_param_t.
+ * @alloc: allocate size bytes aligned to align (power of 2), on NUMA node (-1 for any node),
+ *         return NULL for failure
+ * @free: release memory returned by alloc, size is the same as allocating
+ * @ctx: opaque pointer passed to alloc and free
+ *
+ * Table control block and slabs of 1-trie nodes and m-trie blocks come from alloc. Slabs are
+ * large (eg. 2MB with LPM_TABLE_HUGEPAGE) and aligned to their size, which is power of 2,
+ * nodes and blocks are carved from them internally. When LPM is built with LPM_MTRIE_INDEX32,
+ * m-trie blocks are carved from a region reserved by mmap instead, see lpm_internal.h.
+ */
+typedef struct lpm_allocator_s {
+    void *(*alloc)(void *ctx, size_t size, size_t align, int numa_node);
+    void (*free)(void *ctx, void *p, size_t size);
+    void *ctx;
+} lpm_allocator_t;
+
+/**
+ * LPM table creation parameters, used in lpm_create_table_ex().
+ */
+typedef struct lpm_table_param_s {
+    u32 flags;                              /* LPM_TABLE_XXX options */
+    size_t mem_limit;                       /* hard cap of memory in bytes, 0 for no cap */
+    u32 expected_prefixes;                  /* reserve memory for prefixes, 0 for growing */
+    lpm_allocator_t *allocator;             /* memory allocator, NULL for built-in */
+    char *shm_name;                         /* shared memory object of m-trie, NULL for private */
+} lpm_table_param_t;
+
 /**
  * lpm_create_table - create LPM table
  * @name: name string of LPM table, eg. "IPv4" or "IPv6"
@@ -66,6 +105,49 @@ typedef struct lpm_lkup_table_s lpm_lkup_table_t;
  */
 lpm_lkup_table_t *lpm_create_table(char *name);
 
+/**
+ * lpm_create_table_ex - create LPM table with creation parameters
+ * @name: name string of LPM table, eg. "IPv4" or "IPv6"
+ * @param: creation parameters, NULL is the same as lpm_create_table()
+ *
+ * With LPM_TABLE_HUGEPAGE(_1G), m-trie blocks are allocated from huge pages (hugetlbfs pages
+ * first, transparent huge pages when hugetlbfs pages are not available), so lookups walking
+ * through m-trie blocks need only a handful of TLB entries.
+ *
+ * With LPM_TABLE_NUMA_REPLICA, every online NUMA node has its own m-trie replica allocated
+ * on that node. All replicas are updated from the single 1-trie, and lpm_search_table() uses
+ * the replica of calling thread's NUMA node.
+ *
+ * With LPM_TABLE_SPARSE, m-trie blocks with only a few distinct entries are kept in a sparse
+ * form of 1/8 size, which suits IPv6 tables where most blocks carry one or two prefixes.
+ * Blocks are converted between sparse and dense form automatically by occupancy, lookups
+ * through a sparse block read one more cache line.
+ *
+ * With mem_limit, memory of 1-trie and m-trie never goes beyond it, adding or updating
+ * fails with LPM_ERR_RESOURCES instead. ATTENTION memory is counted in slabs, 2MB or 1GB
+ * each with LPM_TABLE_HUGEPAGE(_1G).
+ *
+ * With expected_prefixes, memory for that many prefixes is reserved at creation and the
+ * table never gets more memory later, so lpm_add_entry() never calls malloc and fails fast
+ * with LPM_ERR_RESOURCES before touching the table once the reservation is used up. M-trie
+ * blocks are estimated as one block per LPM_RESERVE_PREFIXES_PER_BLOCK(8) prefixes. Deleting
+ * or updating may fail the same way when a folded m-trie block has to be expanded again.
+ *
+ * With allocator, all memory of the table comes from allocator instead of malloc or mmap,
+ * allocator is copied into the table. LPM_TABLE_HUGEPAGE(_1G) is passed to allocator as slab
+ * size and alignment, LPM_TABLE_NUMA_REPLICA as NUMA node hint, allocator is in charge of
+ * backing pages then.
+ *
+ * With shm_name, m-trie blocks live in the named POSIX shared memory object (eg. "/lpm-ipv4"),
+ * created exclusively and unlinked when the table is destroyed. Other processes attach to it
+ * with lpm_attach_table(). Table has a single m-trie replica then, and it needs LPM built
+ * with LPM_MTRIE_INDEX32, whose blocks link to each other by offset.
+ *
+ * Return pointer of LPM table for success,
+ *      or NULL for failure.
+ */
+lpm_lkup_table_t *lpm_create_table_ex(char *name, lpm_table_param_t *param);
+
 /**
  * lpm_destroy_table - destroy and release LPM table
  * @table: LPM table pointer
@@ -74,6 +156,139 @@ lpm_lkup_table_t *lpm_create_table(char *name);
  */
 lpm_result_t lpm_destroy_table(lpm_lkup_table_t *table);
 
+/**
+ * lpm_clear_table - delete all prefixes and data in LPM table, but keep LPM table itself
+ * @table: LPM table pointer
+ *
+ * Memory of 1-trie and m-trie is kept for reuse, so clearing is O(1) no matter how large
+ * the table is. ATTENTION lpm_search_table() should not run on the table while clearing.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_clear_table(lpm_lkup_table_t *table);
+
+/**
+ * lpm_compact - relocate m-trie blocks for lookup locality
+ * @table: LPM table pointer
+ * @budget: maximum m-trie blocks relocated in every replica by one call, 0 for no limit
+ *
+ * After a long time of updating, m-trie blocks are scattered in memory in allocating order.
+ * Blocks are relocated breadth-first from hi256_table_base into never used memory, so blocks
+ * of the same level and of the same subtree are contiguous again. Lookups may go on while
+ * compacting, every block is copied before its parent is switched to the copy.
+ *
+ * Call goes on from where the former one stops and costs about its budget, so it can run in
+ * background between updates. Updates allocating or freeing m-trie blocks between calls
+ * restart the round from hi256_table_base. Old blocks are released by the next call, so
+ * lookups in progress never read reused memory, and slabs left without blocks are carved
+ * again by later compacting and updates. With
+ * LPM_MTRIE_INDEX32, pages of those slabs are given back to the system, and punched out of the
+ * shared memory object of table created with shm_name.
+ *
+ * Return LPM_SUCCESS when all blocks are relocated,
+ *      or LPM_ERR_AGAIN when budget is used up, call it again to go on,
+ *      or other LPM operation results for failure.
+ */
+lpm_result_t lpm_compact(lpm_lkup_table_t *table, u32 budget);
+
+/**
+ * lpm_save_table - save LPM table into versioned snapshot file
+ * @table: LPM table pointer
+ * @path: snapshot file path, replaced atomically
+ *
+ * Prefixes of 1-trie and default prefix are saved with data values, so data should be handles
+ * (eg. next hop index) rather than pointers if snapshot is loaded by another process. When LPM
+ * is built with LPM_MTRIE_INDEX32, m-trie blocks of the first replica are saved as they are,
+ * since they are position independent.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_save_table(lpm_lkup_table_t *table, char *path);
+
+/**
+ * lpm_load_table - create LPM table from snapshot file
+ * @path: snapshot file path
+ *
+ * 1-trie is rebuilt from saved prefixes. When snapshot holds m-trie blocks of the same entry
+ * layout, m-trie is mapped from the file with mmap, without expanding any prefix again, so a
+ * full table is ready in milliseconds. Such table has one m-trie replica and is read-only,
+ * lpm_add_entry(), lpm_update_entry(), lpm_del_entry(), lpm_clear_table() and lpm_compact()
+ * return LPM_ERR_INVALID, eg. it serves lookups while a writable table is built in background.
+ * Otherwise m-trie is rebuilt by adding the prefixes, and the table is writable.
+ *
+ * Return pointer of LPM table for success,
+ *      or NULL for failure.
+ */
+lpm_lkup_table_t *lpm_load_table(char *path);
+
+/**
+ * lpm_attach_table - attach to LPM table shared by another process
+ * @shm_name: shared memory object name, the same as shm_name of lpm_create_table_ex()
+ *
+ * M-trie of the writer process is mapped read-only, and lpm_search_table() walks it directly,
+ * following root block and default data the writer publishes, so updates of the writer are
+ * seen without any copy. Data should be handles rather than pointers, and the table is
+ * read-only, adding, updating, deleting (default data included), clearing and compacting
+ * return LPM_ERR_INVALID. lpm_find_entry() and lpm_walk_entry() find nothing, as 1-trie stays
+ * in the writer process. Call lpm_destroy_table() to detach.
+ *
+ * Return pointer of LPM table for success,
+ *      or NULL for failure.
+ */
+lpm_lkup_table_t *lpm_attach_table(char *shm_name);
+
+/**
+ * lpm_journal_open - start journaling updates of LPM table for warm restart
+ * @table: LPM table pointer
+ * @snapshot: snapshot file path of checkpoints
+ * @journal: journal file path
+ *
+ * Table is saved into snapshot by lpm_checkpoint() first, then every successful adding,
+ * updating, deleting, default data changing and clearing appends one record to journal with
+ * one write(2), before the update returns. Records survive crash of process, and they are
+ * replayed on snapshot by lpm_recover(). When appending fails, the update is kept in table
+ * but returns LPM_ERR_EXOTIC, call lpm_checkpoint() to make table durable again.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_journal_open(lpm_lkup_table_t *table, char *snapshot, char *journal);
+
+/**
+ * lpm_checkpoint - save LPM table into snapshot and truncate journal
+ * @table: LPM table pointer, journal is opened by lpm_journal_open()
+ *
+ * Call it periodically, so journal and replaying of lpm_recover() stay short. ATTENTION it
+ * saves the whole table, see lpm_save_table().
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_checkpoint(lpm_lkup_table_t *table);
+
+/**
+ * lpm_journal_close - stop journaling updates of LPM table
+ * @table: LPM table pointer
+ *
+ * Journal is closed by lpm_destroy_table() too.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_journal_close(lpm_lkup_table_t *table);
+
+/**
+ * lpm_recover - rebuild LPM table from snapshot and journal after crash
+ * @snapshot: snapshot file path, the same as lpm_journal_open()
+ * @journal: journal file path, the same as lpm_journal_open(), may not exist
+ *
+ * Snapshot is loaded as lpm_load_table() does, but m-trie is always rebuilt so that the table
+ * is writable, then journal records since the last checkpoint are replayed in order. Record
+ * torn by crash at the tail of journal is dropped. Journal is not opened for the returned
+ * table, call lpm_journal_open() with the same paths to go on.
+ *
+ * Return pointer of LPM table for success,
+ *      or NULL for failure.
+ */
+lpm_lkup_table_t *lpm_recover(char *snapshot, char *journal);
+
 /**
  * lpm_table_statistic - print LPM table statistic
  * @table: LPM table pointer
@@ -82,6 +297,342 @@ lpm_result_t lpm_destroy_table(lpm_lkup_table_t *table);
  */
 void lpm_table_statistic(lpm_lkup_table_t *table);
 
+/**
+ * Structure of one m-trie level, see lpm_table_introspect(). Level 0 is the root block.
+ * @blocks: blocks of level, sparse ones included
+ * @sparse_blocks: blocks of level in sparse form
+ * @memory: bytes of blocks of level
+ * @runs: runs of adjacent entries with the same data and sub-block, summed over blocks
+ * @child_entries: entries with sub-block, folded uniform blocks included
+ * @folded_entries: entries whose uniform sub-block is folded into them
+ * @runs_per_block: runs / blocks, 1 for a uniform block and 256 for a fully distinct one
+ * @child_fraction: child_entries over all entries of level
+ * @reach: fraction of uniformly distributed addresses whose lookup reads a block of level
+ */
+typedef struct lpm_level_info_s {
+    u32 blocks;
+    u32 sparse_blocks;
+    unsigned long memory;
+    unsigned long runs;
+    unsigned long child_entries;
+    unsigned long folded_entries;
+    double runs_per_block;
+    double child_fraction;
+    double reach;
+} lpm_level_info_t;
+
+#define LPM_INFO_LEVEL_MAX      16      /* m-trie levels of 128-bit address with 8-bit stride */
+
+/**
+ * Structure of table, see lpm_table_introspect().
+ * @prefixes: prefixes in table, zero route included
+ * @btrie_nodes: 1-trie nodes
+ * @blocks: m-trie blocks of one replica, sparse ones included
+ * @memory: bytes of m-trie blocks of one replica
+ * @levels: levels with blocks, level[levels..LPM_INFO_LEVEL_MAX) are all zero
+ * @expected_depth: expected blocks read by lookup of uniformly distributed addresses, the sum of
+ *                  reach over levels, reading the shared block of folded entry included
+ * @level: per level structure
+ */
+typedef struct lpm_table_info_s {
+    u32 prefixes;
+    u32 btrie_nodes;
+    u32 blocks;
+    unsigned long memory;
+    u32 levels;
+    double expected_depth;
+    lpm_level_info_t level[LPM_INFO_LEVEL_MAX];
+} lpm_table_info_t;
+
+/**
+ * lpm_table_introspect - get structure of table by walking m-trie blocks
+ * @table: LPM table pointer
+ * @info: structure output
+ *
+ * All blocks of one m-trie replica are read, every replica has the same structure. It takes
+ * the time of reading the whole m-trie, and must not run concurrently with updates.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_table_introspect(lpm_lkup_table_t *table, lpm_table_info_t *info);
+
+/**
+ * Hit walker function's type defination, see lpm_walk_hits().
+ * @addr: pointer of address, ATTENTION address should be network byte order (big endianness)
+ * @masklen: mask length value
+ * @data: data of corresponding prefix (addr/masklen)
+ * @hits: lookups matching the prefix since lpm_hit_enable()
+ *
+ * Return 0 for success, non-0 for failure.
+ */
+typedef int (*lpm_hit_walker_func_t)(u8 *addr, u32 masklen, void *data, unsigned long hits);
+
+/**
+ * lpm_hit_enable - count lookups matching every prefix
+ * @table: LPM table pointer
+ * @slots: counting slots of every lookup thread, rounded up to power of 2, 0 for closing
+ *
+ * Opening clears counts of last opening. Every thread calling lpm_search_table() on the table
+ * gets its own counters at its first lookup, so counting takes no lock and no atomic
+ * operation. One slot is used by every m-trie entry holding matched data that is hit, so a
+ * prefix hit takes one slot when its mask length is a multiple of 8, and one per hit entry it
+ * is expanded to otherwise, eg. 16 at most for /20. Hits going beyond 3/4 of slots are dropped
+ * and reported by lpm_walk_hits(). A slot is 32 bytes.
+ * Counting is not supported by table attached from shared memory, and opening or closing must
+ * not run concurrently with lookups.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_hit_enable(lpm_lkup_table_t *table, u32 slots);
+
+/**
+ * lpm_walk_hits - traverse all prefix stored in 1-trie with their hit counts
+ * @table: LPM table pointer
+ * @walker: callback function used for each prefix when traversing, prefixes not hit included
+ *
+ * Counts of all threads are merged. Lookups given default data are walked at last, with default
+ * prefix and data (zero prefix and NULL data when default data is not set). It must not run
+ * concurrently with updates, as lpm_walk_entry(), lookups can go on.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_walk_hits(lpm_lkup_table_t *table, lpm_hit_walker_func_t walker);
+
+/**
+ * Lookup latency histograms, see lpm_latency_read(). Latency is in ticks of time stamp counter.
+ * Below LPM_LATENCY_SUB_BUCKETS ticks every tick has its bucket, beyond that every power of 2
+ * range is split into LPM_LATENCY_SUB_BUCKETS linear buckets, so bucket width is at most 1/8
+ * of latency. Latency of 2^32 ticks or more falls in the last bucket.
+ */
+#define LPM_LATENCY_SUB_BUCKETS 8
+#define LPM_LATENCY_BUCKETS     240
+#define LPM_LATENCY_DEPTH_MAX   16      /* m-trie blocks read by one lookup at most */
+
+/**
+ * Sampled lookup latency of table.
+ * @every: one lookup in every lookups of thread is sampled
+ * @ticks_per_ns: ticks of time stamp counter in one ns
+ * @samples: lookups sampled
+ * @hist: samples by m-trie blocks read (depth) and latency bucket, hist[0] for all depths
+ */
+typedef struct lpm_latency_stat_s {
+    u32 every;
+    double ticks_per_ns;
+    unsigned long samples;
+    unsigned long hist[LPM_LATENCY_DEPTH_MAX + 1][LPM_LATENCY_BUCKETS];
+} lpm_latency_stat_t;
+
+/**
+ * lpm_latency_enable - sample lookup latency of table
+ * @table: LPM table pointer
+ * @every: one lookup in every lookups of thread is timed, 0 for closing
+ *
+ * Opening clears samples of last opening. Sampled lookup is timed by time stamp counter (rdtsc
+ * on x86, monotonic clock in ns elsewhere) less timing overhead calibrated at opening, and is
+ * recorded by m-trie depth it reaches in histograms of calling thread, so recording takes no
+ * lock and no atomic operation. Lookups not sampled cost one more thread local counter
+ * decrement. Opening or closing must not run concurrently with lookups.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_latency_enable(lpm_lkup_table_t *table, u32 every);
+
+/**
+ * lpm_latency_read - get sampled lookup latency, histograms of all threads are merged
+ * @table: LPM table pointer
+ * @stat: latency output, about 30KB
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_latency_read(lpm_lkup_table_t *table, lpm_latency_stat_t *stat);
+
+/**
+ * lpm_latency_bucket_low - lower bound of latency bucket
+ * @bucket: index of latency bucket
+ *
+ * Return the lowest latency in ticks of the bucket.
+ */
+unsigned long lpm_latency_bucket_low(u32 bucket);
+
+/**
+ * lpm_latency_percentile - latency percentile of lookups reaching m-trie depth
+ * @stat: latency got by lpm_latency_read()
+ * @depth: m-trie blocks read by lookup, 0 for all depths
+ * @percent: percentile in (0, 100], eg. 99.9
+ *
+ * Return latency in ns at the middle of bucket holding the percentile, 0 for no sample.
+ */
+double lpm_latency_percentile(lpm_latency_stat_t *stat, u32 depth, double percent);
+
+/**
+ * lpm_latency_report - print sampled lookup latency percentiles by m-trie depth
+ * @table: LPM table pointer
+ *
+ * No return value.
+ */
+void lpm_latency_report(lpm_lkup_table_t *table);
+
+/**
+ * Trace points of table mutations, see lpm_trace_set().
+ */
+typedef enum lpm_trace_point_e {
+    LPM_TRACE_ADD = 0,          /* lpm_add_entry() returns */
+    LPM_TRACE_DEL,              /* lpm_del_entry() returns */
+    LPM_TRACE_UPDATE,           /* lpm_update_entry() returns */
+    LPM_TRACE_BLOCK_ALLOC,      /* m-trie block allocated */
+    LPM_TRACE_BLOCK_FREE,       /* m-trie block freed */
+    LPM_TRACE_EXPAND_ENTRY,     /* prefix expansion into m-trie starts */
+    LPM_TRACE_EXPAND_EXIT,      /* prefix expansion into m-trie returns */
+    LPM_TRACE_POINT_MAX
+} lpm_trace_point_t;
+
+/**
+ * Record of trace point passed to trace hook.
+ * @point: LPM_TRACE_XXX
+ * @table: name of table
+ * @addr: prefix of update, all 0 for block allocated or freed out of update, eg. destroying
+ * @masklen: mask length of prefix
+ * @entries: m-trie entries touched, those written by update or expansion for ADD, DEL, UPDATE
+ *           and EXPAND_EXIT, those covered by expansion in every m-trie replica for
+ *           EXPAND_ENTRY, and those the block holds for BLOCK_ALLOC and BLOCK_FREE
+ * @result: result of update or expansion, LPM_SUCCESS for others
+ */
+typedef struct lpm_trace_s {
+    lpm_trace_point_t point;
+    const char *table;
+    u8 addr[16];
+    u32 masklen;
+    unsigned long entries;
+    lpm_result_t result;
+} lpm_trace_t;
+
+typedef void (*lpm_trace_func_t)(const lpm_trace_t *trace);
+
+/**
+ * lpm_trace_set - hook trace point of table mutations of all tables
+ * @point: LPM_TRACE_XXX
+ * @func: called in updating thread at the trace point, NULL for unhooking
+ *
+ * Trace point without hook costs one load and one branch not taken, and LPM built with
+ * LPM_TRACE 0 has no trace point at all, this fails with LPM_ERR_INVALID then. Hook can be
+ * set while tables are updated, hook runs with table writing, so it must be short and must
+ * not call LPM functions on the same table.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_trace_set(lpm_trace_point_t point, lpm_trace_func_t func);
+
+/**
+ * M-trie writes of updates, see lpm_write_stat(). Blocks are counted in every m-trie replica,
+ * sparse blocks included.
+ * @entries: m-trie entries written by prefix expansion and zeroing out
+ * @blocks_alloc: m-trie blocks allocated
+ * @blocks_free: m-trie blocks freed
+ */
+typedef struct lpm_write_count_s {
+    unsigned long entries;
+    unsigned long blocks_alloc;
+    unsigned long blocks_free;
+} lpm_write_count_t;
+
+/**
+ * Write amplification statistic of table, see lpm_write_stat().
+ * @updates: successful calls of lpm_add_entry(), lpm_update_entry() and lpm_del_entry()
+ * @failed: failed calls of them, not counted in @last and @max
+ * @total: writes since table creation, lpm_clear_table() and the like included
+ * @last: writes of the last update
+ * @max: writes of the update writing most m-trie entries
+ * @max_addr: prefix of that update
+ * @max_masklen: mask length of that update
+ */
+typedef struct lpm_write_stat_s {
+    unsigned long updates;
+    unsigned long failed;
+    lpm_write_count_t total;
+    lpm_write_count_t last;
+    lpm_write_count_t max;
+    u8 max_addr[16];
+    u32 max_masklen;
+} lpm_write_stat_t;
+
+/**
+ * lpm_write_stat - get m-trie writes of updates, to find prefixes expanding pathologically
+ * @table: LPM table pointer
+ * @stat: statistic output
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_write_stat(lpm_lkup_table_t *table, lpm_write_stat_t *stat);
+
+/**
+ * Operations and hardware events measured by performance counters, see lpm_perf_enable().
+ */
+typedef enum lpm_perf_op_e {
+    LPM_PERF_SEARCH = 0,    /* lpm_search_table() */
+    LPM_PERF_ADD,           /* lpm_add_entry() */
+    LPM_PERF_UPDATE,        /* lpm_update_entry() */
+    LPM_PERF_DEL,           /* lpm_del_entry() */
+    LPM_PERF_OP_MAX,
+} lpm_perf_op_t;
+
+typedef enum lpm_perf_event_e {
+    LPM_PERF_CYCLES = 0,    /* CPU cycles */
+    LPM_PERF_INSTRUCTIONS,  /* instructions retired */
+    LPM_PERF_LLC_MISSES,    /* last level cache read misses */
+    LPM_PERF_DTLB_MISSES,   /* data TLB read misses */
+    LPM_PERF_EVENT_MAX,
+} lpm_perf_event_t;
+
+/**
+ * Performance counters of one operation, see lpm_perf_read().
+ * @ops: operations measured
+ * @count: event counts summed over all measured operations, measuring overhead excluded
+ * @valid: event is counted, 0 when CPU or kernel does not support it
+ */
+typedef struct lpm_perf_stat_s {
+    unsigned long ops;
+    unsigned long count[LPM_PERF_EVENT_MAX];
+    u8 valid[LPM_PERF_EVENT_MAX];
+} lpm_perf_stat_t;
+
+/**
+ * lpm_perf_enable - measure operations of table with hardware performance counters
+ * @table: LPM table pointer
+ * @on: 0 for closing, 1 for opening and clearing counts measured before
+ *
+ * Only available when LPM is built with LPM_PERF_EVENT, fails with LPM_ERR_INVALID otherwise.
+ * Every thread calling lpm_search_table(), lpm_add_entry(), lpm_update_entry() or
+ * lpm_del_entry() on the table opens its own user space counters by perf_event_open(2) at
+ * its first measured operation, and reads them before and after every operation then, by
+ * rdpmc from user space on x86 when kernel allows it, or by read(2) of the counter group
+ * otherwise. Counts are summed in counters of calling thread, with no lock and no atomic
+ * operation, and merged by lpm_perf_read(). Reading still takes tens of cycles, and two
+ * system calls without rdpmc, wall clock numbers of instrumented build are not comparable with
+ * normal build. Opening clears counts of last opening, and must not run concurrently with
+ * measured operations.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_perf_enable(lpm_lkup_table_t *table, int on);
+
+/**
+ * lpm_perf_read - get performance counters of operation measured since lpm_perf_enable()
+ * @table: LPM table pointer
+ * @op: LPM_PERF_XXX operation
+ * @stat: counters output, divide count by ops for per-operation averages
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_perf_read(lpm_lkup_table_t *table, lpm_perf_op_t op, lpm_perf_stat_t *stat);
+
+/**
+ * lpm_perf_report - print per-operation averages of performance counters
+ * @table: LPM table pointer
+ *
+ * No return value.
+ */
+void lpm_perf_report(lpm_lkup_table_t *table);
+
 /**
  * lpm_dump_mtrie - print all data in M-trie, for the sake of debugging
  * @table: LPM table pointer
@@ -111,6 +662,16 @@ lpm_result_t lpm_debug_support(lpm_lkup_table_t *table, lpm_debug_t debug, int o
  */
 void *lpm_search_table(lpm_lkup_table_t *table, u8 *addr, u8 *using_default);
 
+/**
+ * lpm_numa_refresh_thread - detect NUMA node of calling thread again
+ *
+ * NUMA node of thread is detected at its first lpm_search_table() and cached, forwarding
+ * threads are expected to be pinned. Call it after the thread is moved to another NUMA node.
+ *
+ * No return value.
+ */
+void lpm_numa_refresh_thread(void);
+
 /**
  * lpm_find_entry - accurately search in 1-trie
  * @table: LPM table pointer
@@ -129,6 +690,9 @@ void *lpm_find_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen);
  * @masklen: mask length value
  * @data: data to be add
  *
+ * When LPM is built with LPM_MTRIE_INDEX32, data is kept as 32-bit handle in m-trie, eg. an
+ * index of next hop array, and data beyond 32 bits is rejected with LPM_ERR_INVALID.
+ *
  * Return LPM operation results.
  */
 lpm_result_t lpm_add_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data);
@@ -140,10 +704,89 @@ lpm_result_t lpm_add_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void
  * @masklen: mask length value
  * @data: new data used for updating
  *
+ * Data must fit in 32 bits with LPM_MTRIE_INDEX32 as lpm_add_entry().
+ *
  * Return LPM operation results.
  */
 lpm_result_t lpm_update_entry(lpm_lkup_table_t *table, u8 *addr, u32 masklen, void *data);
 
+/**
+ * LPM prefix and data, used in lpm_add_entries().
+ */
+typedef struct lpm_entry_s {
+    u8 addr[16];                            /* network byte order, IPv4 in the first 4 bytes */
+    u32 masklen;                            /* mask length value */
+    void *data;                             /* data of prefix, never NULL */
+} lpm_entry_t;
+
+/**
+ * lpm_add_entries - adding prefixes and data in bulk
+ * @table: LPM table pointer
+ * @entries: prefixes and data, sorted in place
+ * @cnt: quantity of entries
+ * @added: quantity of entries added or updated, NULL for not caring
+ *
+ * Host bits of entries are cleared, and entries are sorted by address, longer prefix first for
+ * the same address. The whole batch is put into 1-trie first, then prefixes are expanded block
+ * by block, longer prefix first in a block, so every m-trie entry is written once, blocks are
+ * folded once and the batch is journaled in one write. Prefix already existing with other
+ * data is updated, and the same data is skipped, so loading a table again is harmless. Prefix
+ * given more than once takes data of one of its entries, sorting does not keep their order.
+ *
+ * Invalid entry stops adding at it in sorted order. When m-trie blocks run out, prefixes not
+ * expanded yet are left out of the table, @added tells how many entries are in.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_add_entries(lpm_lkup_table_t *table, lpm_entry_t *entries, u32 cnt, u32 *added);
+
+/**
+ * lpm_load_text - adding prefixes and data from text file
+ * @table: LPM table pointer
+ * @path: text file path
+ * @threads: parsing threads, 0 for one per online CPU
+ * @added: quantity of prefixes added or updated, NULL for not caring
+ *
+ * Each line is "addr/masklen value", eg. "10.0.0.0/8 1" or "2001:db8::/32 0x2", value is a
+ * non-zero integer (decimal or 0x hexadecimal) stored as data, eg. next hop index. Blank
+ * lines and lines starting with '#' are skipped. File is mapped and split into chunks at line
+ * boundaries, which are parsed by threads at the same time, then the chunks are added in
+ * file order with lpm_add_entries(). Nothing is added if any line is malformed.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_load_text(lpm_lkup_table_t *table, char *path, u32 threads, u32 *added);
+
+/**
+ * Next hop mapping function's type defination, used in lpm_load_mrt().
+ * @nexthop: next hop address of prefix, NULL for no next hop attribute
+ * @len: next hop address length, 4 for IPv4, 16 or 32 (global and link-local) for IPv6
+ * @ctx: opaque pointer passed to lpm_load_mrt()
+ *
+ * Return data of prefix, eg. next hop index, or NULL for skipping the prefix.
+ */
+typedef void *(*lpm_mrt_nexthop_func_t)(u8 *nexthop, u32 len, void *ctx);
+
+/**
+ * lpm_load_mrt - adding prefixes from MRT TABLE_DUMP_V2 RIB file
+ * @table: LPM table pointer
+ * @path: uncompressed MRT file path, eg. RIPE RIS or RouteViews RIB dump
+ * @af: AF_INET for RIB_IPV4_UNICAST records, or AF_INET6 for RIB_IPV6_UNICAST records
+ * @nexthop_func: next hop to data of prefix, NULL for prefix-only mode
+ * @ctx: opaque pointer passed to nexthop_func
+ * @added: quantity of prefixes added or updated, NULL for not caring
+ *
+ * File is mapped and records are read in place, one prefix per RIB record, ADD-PATH records
+ * included, other records are skipped. In prefix-only mode, every prefix has data 1. Otherwise
+ * NEXT_HOP (IPv4) or MP_REACH_NLRI (IPv6) attribute of the first RIB entry of prefix is passed
+ * to nexthop_func. Prefix already existing is updated as lpm_add_entries() does, adding stops
+ * at the first failure, and malformed record fails with LPM_ERR_INVALID.
+ *
+ * Return LPM operation results.
+ */
+lpm_result_t lpm_load_mrt(lpm_lkup_table_t *table, char *path, int af,
+                          lpm_mrt_nexthop_func_t nexthop_func, void *ctx, u32 *added);
+
 /**
  * lpm_update_default_data - update default data using the appointed prefix's data
  * @table: LPM table pointer
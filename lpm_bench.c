@@ -0,0 +1,1085 @@
+/*
+ * lpm_bench.c
+ *
+ * Longest prefix matching benchmark tool, built by "make bench".
+ *
+ * Usage:
+ *      lpm_bench lookup [-6] [-n routes] [-f text | -m mrt] [-l lookups] [-s seed] [-F flags]
+ *                       [-H slots]
+ *      lpm_bench churn [-6] [-n routes] [-f text | -m mrt] [-u updates] [-s seed] [-F flags]
+ *      lpm_bench compact [-6] [-n routes] [-f text | -m mrt] [-u updates] [-b budget] [-s seed]
+ *                        [-F flags]
+ *
+ * ATTENTION:
+ *      1. Synthetic tables follow prefix length histograms of public IPv4 and IPv6 BGP feeds,
+ *         and prefixes are clustered in allocations (/12 for IPv4, /32 for IPv6) as real
+ *         feeds are, so that m-trie blocks are shared as much as they are in production.
+ *      2. Random numbers come from a seeded xorshift generator, the same seed gives the same
+ *         table and address streams on every platform.
+ *      3. Numbers are comparable only on the same machine with the same options.
+ *      4. Churn times every update alone, clock reading (tens of ns) is included in latency.
+ *      5. lpm_bench_perf built by "make bench-perf" also prints hardware counters per operation
+ *         of lookup throughput runs and churn patterns, see lpm_perf_enable(). Its timing is
+ *         not comparable with lpm_bench.
+ *      6. Compact checks lpm_compact() as background job, after updates scatter the blocks: every
+ *         call costs about its budget, lookups never change, and updates between calls are
+ *         taken. It exits with 1 when any check fails.
+ *
+ * History
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "lpm.h"
+#include "lpm_internal.h"
+
+#define BENCH_ADDRS         (0x1 << 20)     /* addresses of one stream, looked up round robin */
+#define BENCH_BATCH         16              /* lookups timed together for latency percentiles */
+#define BENCH_NEXTHOPS      64              /* data handles of synthetic routes */
+#define BENCH_ZIPF_S        1.0             /* skew of Zipf stream */
+#define BENCH_FLAP_PREFIXES 4096            /* more-specifics flapping in churn */
+#define BENCH_FLAP_DEPTH    8               /* more-specifics are at most 8 bits longer */
+
+typedef struct bench_route_s {
+    u8 addr[LPM_LEVEL_MAX];
+    u32 masklen;
+    void *data;
+} bench_route_t;
+
+typedef struct bench_opt_s {
+    int ipv6;                               /* IPv6 table and addresses */
+    u32 routes;                             /* synthetic routes, 0 for feed size */
+    char *text;                             /* text table file, see lpm_load_text() */
+    char *mrt;                              /* MRT RIB file, see lpm_load_mrt() */
+    unsigned long lookups;                  /* lookups of each stream */
+    unsigned long updates;                  /* updates of each churn pattern but reset */
+    unsigned long seed;
+    u32 flags;                              /* LPM_TABLE_XXX */
+    u32 hit_slots;                          /* hit counting slots per thread, 0 for no counting */
+    u32 sample_every;                       /* one in every lookups timed, 0 for no sampling */
+    u32 budget;                             /* blocks relocated by one lpm_compact() call */
+} bench_opt_t;
+
+/* Prefixes per mask length in per mille, shaped like public BGP feeds */
+static const u32 bench_v4_hist[33] = {
+    [8] = 1, [9] = 1, [10] = 1, [11] = 2, [12] = 3, [13] = 4, [14] = 6, [15] = 8,
+    [16] = 13, [17] = 11, [18] = 18, [19] = 33, [20] = 40, [21] = 45, [22] = 107, [23] = 83,
+    [24] = 624,
+};
+
+static const u32 bench_v6_hist[LPM_MASKLEN_MAX + 1] = {
+    [28] = 10, [29] = 40, [30] = 10, [31] = 5, [32] = 120, [33] = 15, [34] = 15, [35] = 10,
+    [36] = 35, [37] = 5, [38] = 8, [39] = 7, [40] = 55, [41] = 5, [42] = 12, [43] = 8,
+    [44] = 70, [45] = 15, [46] = 30, [47] = 20, [48] = 495, [56] = 5, [64] = 5,
+};
+
+static unsigned long bench_rand_state;
+
+static unsigned long bench_rand(void)
+{
+    unsigned long x = bench_rand_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    bench_rand_state = x;
+
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Set bits of addr from bit position from to masklen randomly, and clear bits after masklen */
+static void bench_fill_bits(u8 *addr, u32 from, u32 masklen, u32 bits)
+{
+    u32 i;
+
+    for (i = from; i < bits; i++) {
+        if (i < masklen && (bench_rand() & 0x1)) {
+            addr[i >> 0x3] |= (0x80 >> (i & 0x7));
+        } else {
+            addr[i >> 0x3] &= ~(0x80 >> (i & 0x7));
+        }
+    }
+}
+
+static u32 bench_pick_masklen(const u32 *hist, u32 max)
+{
+    u32 r = bench_rand() % 1000, masklen;
+
+    for (masklen = 0; masklen < max; masklen++) {
+        if (r < hist[masklen]) {
+            break;
+        }
+        r -= hist[masklen];
+    }
+
+    return masklen;
+}
+
+/*
+ * Synthetic feed. IPv4 allocations are /12 in 1.0.0.0-223.255.255.255, IPv6 allocations are
+ * /32 in 2000::/3, and routes are carved from a random allocation.
+ */
+static lpm_result_t bench_synthetic(lpm_lkup_table_t *table, bench_opt_t *opt)
+{
+    const u32 *hist = opt->ipv6 ? bench_v6_hist : bench_v4_hist;
+    u32 bits = opt->ipv6 ? 128 : 32, alloc_len = opt->ipv6 ? 32 : 12;
+    u32 alloc_cnt, i, masklen;
+    lpm_entry_t *entries;
+    u8 (*allocs)[LPM_LEVEL_MAX];
+    lpm_result_t ret;
+
+    alloc_cnt = opt->routes / (opt->ipv6 ? 8 : 64) + 1;
+    allocs = calloc(alloc_cnt, LPM_LEVEL_MAX);
+    entries = calloc(opt->routes, sizeof(lpm_entry_t));
+    if (allocs == NULL || entries == NULL) {
+        free(allocs);
+        free(entries);
+        return LPM_ERR_RESOURCES;
+    }
+
+    for (i = 0; i < alloc_cnt; i++) {
+        if (opt->ipv6) {
+            allocs[i][0] = 0x20 | (bench_rand() & 0x1f);
+            bench_fill_bits(allocs[i], 8, alloc_len, bits);
+        } else {
+            allocs[i][0] = 1 + bench_rand() % 223;
+            bench_fill_bits(allocs[i], 8, alloc_len, bits);
+        }
+    }
+    for (i = 0; i < opt->routes; i++) {
+        masklen = bench_pick_masklen(hist, bits);
+        memcpy(entries[i].addr, allocs[bench_rand() % alloc_cnt], LPM_LEVEL_MAX);
+        bench_fill_bits(entries[i].addr, alloc_len, masklen, bits);
+        if (masklen < alloc_len) {
+            bench_fill_bits(entries[i].addr, masklen, masklen, bits);
+        }
+        entries[i].masklen = masklen;
+        entries[i].data = (void *)(unsigned long)(1 + bench_rand() % BENCH_NEXTHOPS);
+    }
+
+    ret = lpm_add_entries(table, entries, opt->routes, NULL);
+
+    free(allocs);
+    free(entries);
+
+    return ret;
+}
+
+static bench_route_t *bench_routes;
+static u32 bench_route_cnt;
+static volatile unsigned long bench_sink;   /* lookup results are consumed */
+
+static int bench_collect(u8 *addr, u32 masklen, void *data)
+{
+    /* Zero route matches everything, and default data is walked at last as a copy */
+    if (masklen == 0) {
+        return 0;
+    }
+    memcpy(bench_routes[bench_route_cnt].addr, addr, LPM_LEVEL_MAX);
+    bench_routes[bench_route_cnt].masklen = masklen;
+    bench_routes[bench_route_cnt].data = data;
+    bench_route_cnt++;
+
+    return 0;
+}
+
+static lpm_lkup_table_t *bench_table(bench_opt_t *opt)
+{
+    lpm_table_param_t param;
+    lpm_lkup_table_t *table;
+    lpm_result_t ret;
+    double t0;
+
+    memset(&param, 0, sizeof(param));
+    param.flags = opt->flags;
+    table = lpm_create_table_ex(opt->ipv6 ? "bench-IPv6" : "bench-IPv4", &param);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    t0 = bench_now();
+    if (opt->text != NULL) {
+        ret = lpm_load_text(table, opt->text, 0, NULL);
+    } else if (opt->mrt != NULL) {
+        ret = lpm_load_mrt(table, opt->mrt, opt->ipv6 ? AF_INET6 : AF_INET, NULL, NULL, NULL);
+    } else {
+        ret = bench_synthetic(table, opt);
+    }
+    if (ret != LPM_SUCCESS) {
+        fprintf(stderr, "building table failed, ret %d\n", ret);
+        lpm_destroy_table(table);
+        return NULL;
+    }
+
+    printf("table: %s %s, %d routes, flags 0x%x, built in %.3f s\n",
+           opt->ipv6 ? "IPv6" : "IPv4",
+           opt->text ? opt->text : (opt->mrt ? opt->mrt : "synthetic"),
+           table->stat.data_total, table->flags, (bench_now() - t0) / 1e9);
+    printf("memory: %.3f MB in slabs, %.1f bytes/route, 1-trie nodes %d, m-trie blocks %d, sparse %d\n",
+           table->budget.used / 1e6, (double)table->budget.used / (table->stat.data_total ? : 1),
+           table->stat.btrie_node_alloc_stat, table->stat.mtrie_block_alloc_stat,
+           table->stat.mtrie_sparse_alloc_stat);
+
+    bench_routes = calloc(table->stat.data_total + 1, sizeof(bench_route_t));
+    if (bench_routes == NULL) {
+        lpm_destroy_table(table);
+        return NULL;
+    }
+    bench_route_cnt = 0;
+    lpm_walk_entry(table, bench_collect);
+    if (bench_route_cnt == 0) {
+        fprintf(stderr, "table has no route\n");
+        lpm_destroy_table(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+/* Random host bits in a random route, every lookup hits a route */
+static void bench_stream_uniform(u8 (*addrs)[LPM_LEVEL_MAX], u32 bits)
+{
+    bench_route_t *route;
+    u32 i;
+
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        route = &bench_routes[bench_rand() % bench_route_cnt];
+        memcpy(addrs[i], route->addr, LPM_LEVEL_MAX);
+        bench_fill_bits(addrs[i], route->masklen, bits, bits);
+    }
+}
+
+/* Routes are ranked randomly, and route of rank k is looked up in proportion to 1/k^s */
+static int bench_stream_zipf(u8 (*addrs)[LPM_LEVEL_MAX], u32 bits)
+{
+    double *cdf, u;
+    u32 *rank, i, j, lo, hi, mid;
+
+    cdf = malloc(bench_route_cnt * sizeof(double));
+    rank = malloc(bench_route_cnt * sizeof(u32));
+    if (cdf == NULL || rank == NULL) {
+        free(cdf);
+        free(rank);
+        return -1;
+    }
+    for (i = 0; i < bench_route_cnt; i++) {
+        cdf[i] = ((i > 0) ? cdf[i - 1] : 0) + 1.0 / pow(i + 1, BENCH_ZIPF_S);
+        rank[i] = i;
+    }
+    for (i = bench_route_cnt - 1; i > 0; i--) {
+        j = bench_rand() % (i + 1);
+        mid = rank[i];
+        rank[i] = rank[j];
+        rank[j] = mid;
+    }
+
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        u = (bench_rand() >> 11) * (1.0 / 9007199254740992.0) * cdf[bench_route_cnt - 1];
+        for (lo = 0, hi = bench_route_cnt - 1; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        memcpy(addrs[i], bench_routes[rank[lo]].addr, LPM_LEVEL_MAX);
+        bench_fill_bits(addrs[i], bench_routes[rank[lo]].masklen, bits, bits);
+    }
+
+    free(cdf);
+    free(rank);
+
+    return 0;
+}
+
+/* Routes in address order, as 1-trie is walked */
+static void bench_stream_sequential(u8 (*addrs)[LPM_LEVEL_MAX])
+{
+    u32 i;
+
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        memcpy(addrs[i], bench_routes[i % bench_route_cnt].addr, LPM_LEVEL_MAX);
+    }
+}
+
+/* Hardware counters of operations from now on, only in LPM_PERF_EVENT build */
+static void bench_perf_start(lpm_lkup_table_t *table)
+{
+#if LPM_PERF_EVENT
+    (void)lpm_perf_enable(table, 1);
+#else
+    (void)table;
+#endif
+}
+
+static void bench_perf_stop(lpm_lkup_table_t *table)
+{
+#if LPM_PERF_EVENT
+    static const char *op_name[LPM_PERF_OP_MAX] = {"search", "add", "update", "delete"};
+    static const char *event_name[LPM_PERF_EVENT_MAX] = {"cycles", "instructions",
+                                                         "LLC-misses", "dTLB-misses"};
+    lpm_perf_stat_t stat;
+    int op, i;
+
+    (void)lpm_perf_enable(table, 0);
+    for (op = 0; op < LPM_PERF_OP_MAX; op++) {
+        if (lpm_perf_read(table, op, &stat) != LPM_SUCCESS || stat.ops == 0) {
+            continue;
+        }
+        printf("%-12s   %s per op:", "", op_name[op]);
+        for (i = 0; i < LPM_PERF_EVENT_MAX; i++) {
+            if (stat.valid[i]) {
+                printf(" %s %.2f", event_name[i], (double)stat.count[i] / stat.ops);
+            } else {
+                printf(" %s n/a", event_name[i]);
+            }
+        }
+        printf("\n");
+    }
+#else
+    (void)table;
+#endif
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void bench_run(lpm_lkup_table_t *table, const char *name, u8 (*addrs)[LPM_LEVEL_MAX],
+                      unsigned long lookups)
+{
+    unsigned long i, n, batches = lookups / BENCH_BATCH;
+    unsigned long sink = 0;
+    double *samples, t0, t1, total;
+    u8 using_default;
+    u32 j;
+
+    samples = malloc(batches * sizeof(double));
+    if (samples == NULL) {
+        fprintf(stderr, "no memory for %lu samples\n", batches);
+        return;
+    }
+
+    /* Warm up, then throughput without timing overhead */
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        sink += (unsigned long)lpm_search_table(table, addrs[i], &using_default);
+    }
+    bench_perf_start(table);
+    t0 = bench_now();
+    for (i = 0; i < lookups; i++) {
+        sink += (unsigned long)lpm_search_table(table, addrs[i & (BENCH_ADDRS - 1)], &using_default);
+    }
+    total = bench_now() - t0;
+
+    /* Latency of every batch, clock reading is amortized over BENCH_BATCH lookups */
+    for (n = 0, i = 0; n < batches; n++) {
+        t0 = bench_now();
+        for (j = 0; j < BENCH_BATCH; j++, i++) {
+            sink += (unsigned long)lpm_search_table(table, addrs[i & (BENCH_ADDRS - 1)], &using_default);
+        }
+        t1 = bench_now();
+        samples[n] = (t1 - t0) / BENCH_BATCH;
+    }
+    qsort(samples, batches, sizeof(double), bench_cmp_double);
+
+    bench_sink += sink;
+
+    printf("%-12s %10.2f %8.1f %8.1f %8.1f %8.1f %8.1f\n", name,
+           lookups / total * 1e3, total / lookups,
+           samples[batches / 2], samples[batches * 9 / 10], samples[batches * 99 / 100],
+           samples[batches * 999 / 1000]);
+    bench_perf_stop(table);
+
+    free(samples);
+}
+
+/* Sampled latency by m-trie depth of last stream, samples are cleared for next stream */
+static void bench_latency(lpm_lkup_table_t *table, bench_opt_t *opt)
+{
+    if (opt->sample_every == 0) {
+        return;
+    }
+    lpm_latency_report(table);
+    (void)lpm_latency_enable(table, opt->sample_every);
+}
+
+static unsigned long bench_hit_prefixes, bench_hit_lookups;
+
+static int bench_hit_collect(u8 *addr, u32 masklen, void *data, unsigned long hits)
+{
+    (void)addr;
+    (void)data;
+    if (hits != 0 && masklen != 0) {
+        bench_hit_prefixes++;
+    }
+    bench_hit_lookups += hits;
+
+    return 0;
+}
+
+static int bench_lookup(bench_opt_t *opt)
+{
+    lpm_lkup_table_t *table;
+    u8 (*addrs)[LPM_LEVEL_MAX];
+    u32 bits = opt->ipv6 ? 128 : 32;
+
+    table = bench_table(opt);
+    if (table == NULL) {
+        return 1;
+    }
+    addrs = malloc(BENCH_ADDRS * sizeof(*addrs));
+    if (addrs == NULL) {
+        lpm_destroy_table(table);
+        return 1;
+    }
+
+    if ((opt->hit_slots != 0 && lpm_hit_enable(table, opt->hit_slots) != LPM_SUCCESS)
+        || (opt->sample_every != 0 && lpm_latency_enable(table, opt->sample_every) != LPM_SUCCESS)) {
+        free(addrs);
+        free(bench_routes);
+        lpm_destroy_table(table);
+        return 1;
+    }
+
+    printf("%lu lookups per stream, %u addresses per stream, ns/lookup percentiles of %u-lookup batches\n",
+           opt->lookups, BENCH_ADDRS, BENCH_BATCH);
+    printf("%-12s %10s %8s %8s %8s %8s %8s\n", "stream", "Mlookups/s", "mean ns",
+           "p50 ns", "p90 ns", "p99 ns", "p99.9 ns");
+
+    bench_stream_uniform(addrs, bits);
+    bench_run(table, "uniform", addrs, opt->lookups);
+    bench_latency(table, opt);
+    if (bench_stream_zipf(addrs, bits) == 0) {
+        bench_run(table, "zipf", addrs, opt->lookups);
+        bench_latency(table, opt);
+    }
+    bench_stream_sequential(addrs);
+    bench_run(table, "sequential", addrs, opt->lookups);
+    bench_latency(table, opt);
+
+    if (opt->hit_slots != 0) {
+        lpm_walk_hits(table, bench_hit_collect);
+        printf("hits: %lu lookups counted, %lu of %u prefixes hit\n", bench_hit_lookups,
+               bench_hit_prefixes, bench_route_cnt);
+    }
+
+    free(addrs);
+    free(bench_routes);
+    lpm_destroy_table(table);
+
+    return 0;
+}
+
+/*******************************
+ * Churn rel. codes
+ */
+
+typedef enum bench_op_e {
+    BENCH_OP_ADD,
+    BENCH_OP_UPDATE,
+    BENCH_OP_DEL,
+} bench_op_t;
+
+typedef struct bench_churn_s {
+    lpm_lkup_table_t *table;
+    double *latency;                        /* ns of every update */
+    double *written;                        /* m-trie entries written by every update */
+    unsigned long cnt;                      /* successful updates */
+    unsigned long fail;
+    double total;                           /* ns of all updates */
+    unsigned long blocks_alloc;             /* m-trie blocks allocated by all updates */
+    unsigned long blocks_free;              /* m-trie blocks freed by all updates */
+} bench_churn_t;
+
+/* One timed update, m-trie writes are taken from lpm_write_stat() */
+static lpm_result_t bench_update(bench_churn_t *churn, bench_op_t op, u8 *addr, u32 masklen, void *data)
+{
+    lpm_lkup_table_t *table = churn->table;
+    lpm_write_stat_t write;
+    lpm_result_t ret = LPM_ERR_INVALID;
+    double t0, t1;
+
+    t0 = bench_now();
+    switch (op) {
+    case BENCH_OP_ADD:
+        ret = lpm_add_entry(table, addr, masklen, data);
+        break;
+    case BENCH_OP_UPDATE:
+        ret = lpm_update_entry(table, addr, masklen, data);
+        break;
+    case BENCH_OP_DEL:
+        ret = lpm_del_entry(table, addr, masklen);
+        break;
+    }
+    t1 = bench_now();
+
+    if (ret != LPM_SUCCESS) {
+        churn->fail++;
+        return ret;
+    }
+    (void)lpm_write_stat(table, &write);
+    churn->latency[churn->cnt] = t1 - t0;
+    churn->written[churn->cnt] = write.last.entries;
+    churn->cnt++;
+    churn->total += t1 - t0;
+    churn->blocks_alloc += write.last.blocks_alloc;
+    churn->blocks_free += write.last.blocks_free;
+
+    return ret;
+}
+
+static void bench_churn_report(bench_churn_t *churn, const char *name)
+{
+    unsigned long n = churn->cnt, i;
+    double written = 0;
+
+    if (n == 0) {
+        printf("%-12s no update done, %lu failed\n", name, churn->fail);
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        written += churn->written[i];
+    }
+    qsort(churn->latency, n, sizeof(double), bench_cmp_double);
+    qsort(churn->written, n, sizeof(double), bench_cmp_double);
+
+    printf("%-12s %9lu %10.1f %8.2f %8.2f %8.2f %8.2f %9.2f %9.2f %8.1f %8.0f %8.0f %8.3f %8.3f\n", name, n,
+           n / churn->total * 1e6, churn->total / n / 1e3,
+           churn->latency[n / 2] / 1e3, churn->latency[n * 9 / 10] / 1e3,
+           churn->latency[n * 99 / 100] / 1e3, churn->latency[n * 999 / 1000] / 1e3,
+           churn->latency[n - 1] / 1e3,
+           written / n, churn->written[n * 99 / 100], churn->written[n - 1],
+           (double)churn->blocks_alloc / n, (double)churn->blocks_free / n);
+    if (churn->fail != 0) {
+        printf("%-12s %lu updates failed\n", "", churn->fail);
+    }
+    bench_perf_stop(churn->table);
+
+    churn->cnt = 0;
+    churn->fail = 0;
+    churn->total = 0;
+    churn->blocks_alloc = 0;
+    churn->blocks_free = 0;
+}
+
+/*
+ * More-specifics of random routes are announced and withdrawn at random, as deaggregated
+ * prefixes of unstable sites are. They are all withdrawn at last, untimed.
+ */
+static void bench_churn_flap(bench_churn_t *churn, bench_opt_t *opt)
+{
+    u32 bits = opt->ipv6 ? 128 : 32, max = opt->ipv6 ? 64 : 32;
+    bench_route_t *flap, *route;
+    u8 *announced;
+    unsigned long i;
+    u32 n, tries, j;
+
+    flap = calloc(BENCH_FLAP_PREFIXES, sizeof(bench_route_t));
+    announced = calloc(BENCH_FLAP_PREFIXES, sizeof(u8));
+    if (flap == NULL || announced == NULL) {
+        free(flap);
+        free(announced);
+        return;
+    }
+
+    for (n = 0, tries = 0; n < BENCH_FLAP_PREFIXES && tries < BENCH_FLAP_PREFIXES * 16; tries++) {
+        route = &bench_routes[bench_rand() % bench_route_cnt];
+        if (route->masklen >= max) {
+            continue;
+        }
+        memcpy(flap[n].addr, route->addr, LPM_LEVEL_MAX);
+        flap[n].masklen = route->masklen + 1 + bench_rand() % BENCH_FLAP_DEPTH;
+        if (flap[n].masklen > max) {
+            flap[n].masklen = max;
+        }
+        bench_fill_bits(flap[n].addr, route->masklen, flap[n].masklen, bits);
+        if (lpm_find_entry(churn->table, flap[n].addr, flap[n].masklen) != NULL) {
+            continue;
+        }
+        for (j = 0; j < n; j++) {
+            if (flap[j].masklen == flap[n].masklen && memcmp(flap[j].addr, flap[n].addr, LPM_LEVEL_MAX) == 0) {
+                break;
+            }
+        }
+        if (j != n) {
+            continue;
+        }
+        flap[n].data = (void *)(unsigned long)(1 + bench_rand() % BENCH_NEXTHOPS);
+        n++;
+    }
+    if (n == 0) {
+        printf("%-12s no route to flap under\n", "flap");
+        free(flap);
+        free(announced);
+        return;
+    }
+
+    bench_perf_start(churn->table);
+    for (i = 0; i < opt->updates; i++) {
+        route = &flap[bench_rand() % n];
+        if (announced[route - flap]) {
+            bench_update(churn, BENCH_OP_DEL, route->addr, route->masklen, NULL);
+            announced[route - flap] = 0;
+        } else if (bench_update(churn, BENCH_OP_ADD, route->addr, route->masklen, route->data) == LPM_SUCCESS) {
+            announced[route - flap] = 1;
+        }
+    }
+    bench_churn_report(churn, "flap");
+
+    for (i = 0; i < n; i++) {
+        if (announced[i]) {
+            lpm_del_entry(churn->table, flap[i].addr, flap[i].masklen);
+        }
+    }
+
+    free(flap);
+    free(announced);
+}
+
+/* Next hop of random routes changes, as after an IGP or peer change */
+static void bench_churn_nexthop(bench_churn_t *churn, bench_opt_t *opt)
+{
+    bench_route_t *route;
+    unsigned long i, data;
+
+    bench_perf_start(churn->table);
+    for (i = 0; i < opt->updates; i++) {
+        route = &bench_routes[bench_rand() % bench_route_cnt];
+        data = 1 + bench_rand() % BENCH_NEXTHOPS;
+        if (data == (unsigned long)route->data) {
+            data = data % BENCH_NEXTHOPS + 1;
+        }
+        if (bench_update(churn, BENCH_OP_UPDATE, route->addr, route->masklen, (void *)data) == LPM_SUCCESS) {
+            route->data = (void *)data;
+        }
+    }
+    bench_churn_report(churn, "nexthop");
+}
+
+/*
+ * Covering prefixes are withdrawn and announced again, every withdrawal rewrites the range
+ * of covering prefix with less specific data around its more-specifics.
+ */
+static void bench_churn_withdraw(bench_churn_t *churn, bench_opt_t *opt)
+{
+    bench_route_t *a, *b;
+    u32 *covering, n, i, j;
+    unsigned long k;
+
+    covering = malloc(bench_route_cnt * sizeof(u32));
+    if (covering == NULL) {
+        return;
+    }
+
+    /* Routes are walked in pre-order, more-specifics of route follow it */
+    for (n = 0, i = 0; i + 1 < bench_route_cnt; i++) {
+        a = &bench_routes[i];
+        b = &bench_routes[i + 1];
+        if (b->masklen <= a->masklen) {
+            continue;
+        }
+        for (j = 0; j < a->masklen; j++) {
+            if ((a->addr[j >> 3] ^ b->addr[j >> 3]) & (0x80 >> (j & 0x7))) {
+                break;
+            }
+        }
+        if (j == a->masklen) {
+            covering[n++] = i;
+        }
+    }
+    if (n == 0) {
+        printf("%-12s no covering prefix in table\n", "withdraw");
+        free(covering);
+        return;
+    }
+
+    bench_perf_start(churn->table);
+    for (k = 0; k + 1 < opt->updates; k += 2) {     /* both updates fit in samples */
+        a = &bench_routes[covering[bench_rand() % n]];
+        bench_update(churn, BENCH_OP_DEL, a->addr, a->masklen, NULL);
+        bench_update(churn, BENCH_OP_ADD, a->addr, a->masklen, a->data);
+    }
+    bench_churn_report(churn, "withdraw");
+
+    free(covering);
+}
+
+/* Peer session resets, the full table is withdrawn and then announced again in walk order */
+static void bench_churn_reset(bench_churn_t *churn)
+{
+    bench_route_t *route;
+    u32 i;
+
+    bench_perf_start(churn->table);
+    for (i = 0; i < bench_route_cnt; i++) {
+        route = &bench_routes[i];
+        bench_update(churn, BENCH_OP_DEL, route->addr, route->masklen, NULL);
+    }
+    bench_churn_report(churn, "reset-down");
+
+    bench_perf_start(churn->table);
+    for (i = 0; i < bench_route_cnt; i++) {
+        route = &bench_routes[i];
+        bench_update(churn, BENCH_OP_ADD, route->addr, route->masklen, route->data);
+    }
+    bench_churn_report(churn, "reset-up");
+}
+
+static int bench_churn(bench_opt_t *opt)
+{
+    bench_churn_t churn;
+    unsigned long max;
+
+    memset(&churn, 0, sizeof(churn));
+    churn.table = bench_table(opt);
+    if (churn.table == NULL) {
+        return 1;
+    }
+    max = (opt->updates > bench_route_cnt) ? opt->updates : bench_route_cnt;
+    churn.latency = malloc(max * sizeof(double));
+    churn.written = malloc(max * sizeof(double));
+    if (churn.latency == NULL || churn.written == NULL) {
+        fprintf(stderr, "no memory for %lu samples\n", max);
+        free(churn.latency);
+        free(churn.written);
+        free(bench_routes);
+        lpm_destroy_table(churn.table);
+        return 1;
+    }
+
+    printf("%lu updates per pattern, latency in us, m-trie entries written and blocks allocated "
+           "and freed per update\n", opt->updates);
+    printf("%-12s %9s %10s %8s %8s %8s %8s %9s %9s %8s %8s %8s %8s %8s\n", "pattern", "updates",
+           "Kupdates/s", "mean", "p50", "p90", "p99", "p99.9", "max",
+           "entries", "p99", "max", "alloc", "free");
+
+    bench_churn_flap(&churn, opt);
+    bench_churn_nexthop(&churn, opt);
+    bench_churn_withdraw(&churn, opt);
+    bench_churn_reset(&churn);
+
+    free(churn.latency);
+    free(churn.written);
+    free(bench_routes);
+    lpm_destroy_table(churn.table);
+
+    return 0;
+}
+
+/*******************************
+ * Compact rel. codes
+ */
+
+#define BENCH_COMPACT_CALLS     100000      /* calls of one compacting round at most */
+#define BENCH_COMPACT_CHURN     1000        /* calls with updates between them */
+#define BENCH_COMPACT_SLACK     10          /* call may cost 10 times its budget of blocks */
+#define BENCH_COMPACT_FLOOR     50000.0     /* ns of any call, scheduling noise is not failure */
+
+typedef struct bench_compact_s {
+    lpm_lkup_table_t *table;
+    double *latency;                        /* ns of every call */
+    unsigned long calls;
+    unsigned long relocated;                /* blocks relocated by all calls */
+    unsigned long over;                     /* calls relocating more blocks than budget */
+} bench_compact_t;
+
+/* Withdraw and announce random route again, blocks are freed and allocated, lookups are kept */
+static void bench_compact_flap(lpm_lkup_table_t *table)
+{
+    bench_route_t *route = &bench_routes[bench_rand() % bench_route_cnt];
+
+    (void)lpm_del_entry(table, route->addr, route->masklen);
+    (void)lpm_add_entry(table, route->addr, route->masklen, route->data);
+}
+
+/*
+ * Call lpm_compact() until the round is done or calls run out, one route flaps between calls
+ * when churn is set. Return result of the last call.
+ */
+static lpm_result_t bench_compact_round(bench_compact_t *cp, u32 budget, unsigned long calls, int churn)
+{
+    lpm_lkup_table_t *table = cp->table;
+    lpm_result_t ret = LPM_ERR_AGAIN;
+    unsigned long before, moved;
+    double t0;
+
+    cp->calls = 0;
+    cp->relocated = 0;
+    cp->over = 0;
+    while (ret == LPM_ERR_AGAIN && cp->calls < calls) {
+        if (churn) {
+            bench_compact_flap(table);
+        }
+        before = table->stat.mtrie_block_compact_stat;
+        t0 = bench_now();
+        ret = lpm_compact(table, budget);
+        cp->latency[cp->calls++] = bench_now() - t0;
+        moved = table->stat.mtrie_block_compact_stat - before;
+        cp->relocated += moved;
+        if (budget != 0 && moved > (unsigned long)budget * table->mtrie_cnt) {
+            cp->over++;
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Print calls of round, return 1 when p99 call time is over bound. The first call is not
+ * checked, it releases what the former round leaves, eg. all blocks of a round without budget.
+ */
+static int bench_compact_report(bench_compact_t *cp, const char *name, lpm_result_t ret, double bound)
+{
+    unsigned long n = cp->calls, i;
+    double total = 0;
+    int slow = 0;
+
+    for (i = 0; i < n; i++) {
+        total += cp->latency[i];
+    }
+    if (n > 1) {
+        qsort(cp->latency + 1, n - 1, sizeof(double), bench_cmp_double);
+        slow = (cp->latency[1 + (n - 1) * 99 / 100] > bound);
+    }
+    qsort(cp->latency, n, sizeof(double), bench_cmp_double);
+
+    printf("%-12s %9lu %10.1f %9.1f %9.1f %9.1f %10.1f %s\n", name, n, (double)cp->relocated / n,
+           cp->latency[n / 2] / 1e3, cp->latency[n * 99 / 100] / 1e3, cp->latency[n - 1] / 1e3,
+           total / 1e6, (ret == LPM_SUCCESS) ? "done" : "going on");
+
+    return slow;
+}
+
+/* Lookups of addresses which differ from expected ones */
+static unsigned long bench_compact_verify(lpm_lkup_table_t *table, u8 (*addrs)[LPM_LEVEL_MAX], void **expected)
+{
+    unsigned long i, bad = 0;
+    u8 using_default;
+
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        if (lpm_search_table(table, addrs[i], &using_default) != expected[i]) {
+            bad++;
+        }
+    }
+
+    return bad;
+}
+
+static int bench_compact(bench_opt_t *opt)
+{
+    bench_compact_t cp;
+    u8 (*addrs)[LPM_LEVEL_MAX];
+    void **expected;
+    u8 using_default;
+    lpm_result_t ret;
+    unsigned long i, bad = 0, over = 0;
+    double ns_per_block, bound;
+    int failed = 0, slow = 0;
+
+    memset(&cp, 0, sizeof(cp));
+    cp.table = bench_table(opt);
+    if (cp.table == NULL) {
+        return 1;
+    }
+    addrs = malloc(BENCH_ADDRS * sizeof(*addrs));
+    expected = malloc(BENCH_ADDRS * sizeof(void *));
+    cp.latency = malloc(BENCH_COMPACT_CALLS * sizeof(double));
+    if (addrs == NULL || expected == NULL || cp.latency == NULL) {
+        fprintf(stderr, "no memory for compacting check\n");
+        free(addrs);
+        free(expected);
+        free(cp.latency);
+        free(bench_routes);
+        lpm_destroy_table(cp.table);
+        return 1;
+    }
+
+    /* Blocks are scattered by updates, as they are after a long time of churn */
+    for (i = 0; i < opt->updates; i++) {
+        bench_compact_flap(cp.table);
+    }
+    bench_stream_uniform(addrs, opt->ipv6 ? 128 : 32);
+    for (i = 0; i < BENCH_ADDRS; i++) {
+        expected[i] = lpm_search_table(cp.table, addrs[i], &using_default);
+    }
+
+    printf("%lu routes flapped, budget %u blocks, time of lpm_compact() calls in us\n",
+           opt->updates, opt->budget);
+    printf("%-12s %9s %10s %9s %9s %9s %10s\n", "round", "calls", "blocks", "p50", "p99", "max", "total ms");
+
+    /* Cost of relocating one block, by a round without budget */
+    ret = bench_compact_round(&cp, 0, 1, 0);
+    bench_compact_report(&cp, "unlimited", ret, 0);
+    ns_per_block = cp.latency[0] / (cp.relocated ? : 1);
+    bound = BENCH_COMPACT_SLACK * ns_per_block * opt->budget * cp.table->mtrie_cnt;
+    if (bound < BENCH_COMPACT_FLOOR) {
+        bound = BENCH_COMPACT_FLOOR;
+    }
+    bad += bench_compact_verify(cp.table, addrs, expected);
+
+    ret = bench_compact_round(&cp, opt->budget, BENCH_COMPACT_CALLS, 0);
+    slow += bench_compact_report(&cp, "budget", ret, bound);
+    if (ret != LPM_SUCCESS) {
+        fprintf(stderr, "FAILED: round is not done in %u calls, ret %d\n", BENCH_COMPACT_CALLS, ret);
+        failed = 1;
+    }
+    over += cp.over;
+    bad += bench_compact_verify(cp.table, addrs, expected);
+
+    /* Updates between calls restart the round, calls still cost their budget */
+    ret = bench_compact_round(&cp, opt->budget, BENCH_COMPACT_CHURN, 1);
+    slow += bench_compact_report(&cp, "budget+churn", ret, bound);
+    over += cp.over;
+    bad += bench_compact_verify(cp.table, addrs, expected);
+
+    /* Round restarted by updates is done once they stop */
+    ret = bench_compact_round(&cp, opt->budget, BENCH_COMPACT_CALLS, 0);
+    slow += bench_compact_report(&cp, "budget", ret, bound);
+    if (ret != LPM_SUCCESS) {
+        fprintf(stderr, "FAILED: round after updates is not done in %u calls, ret %d\n",
+                BENCH_COMPACT_CALLS, ret);
+        failed = 1;
+    }
+    over += cp.over;
+    bad += bench_compact_verify(cp.table, addrs, expected);
+
+    if (over != 0) {
+        fprintf(stderr, "FAILED: %lu calls relocate more blocks than budget\n", over);
+        failed = 1;
+    }
+    if (slow != 0) {
+        fprintf(stderr, "FAILED: p99 call time exceeds %.1f us in %d rounds\n", bound / 1e3, slow);
+        failed = 1;
+    }
+    if (bad != 0) {
+        fprintf(stderr, "FAILED: %lu lookups changed by compacting\n", bad);
+        failed = 1;
+    }
+    if (!failed) {
+        printf("compacting check passed, p99 call time within %.1f us\n", bound / 1e3);
+    }
+
+    free(addrs);
+    free(expected);
+    free(cp.latency);
+    free(bench_routes);
+    lpm_destroy_table(cp.table);
+
+    return failed;
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr,
+            "usage: lpm_bench lookup|churn|compact [options]\n"
+            "  -6          IPv6 table, IPv4 by default\n"
+            "  -n routes   synthetic routes, 900000 for IPv4 and 200000 for IPv6 by default\n"
+            "  -f file     table from text file of \"addr/masklen value\" lines\n"
+            "  -m file     table from MRT TABLE_DUMP_V2 RIB file\n"
+            "  -l lookups  lookups of each address stream, 20000000 by default\n"
+            "  -u updates  updates of each churn pattern, or routes flapped before compacting, 1000000 by default\n"
+            "  -b budget   blocks relocated by one lpm_compact() call, 256 by default\n"
+            "  -s seed     random seed, 1 by default\n"
+            "  -F flags    LPM_TABLE_XXX flags of table, eg. 0x1 for LPM_TABLE_HUGEPAGE\n"
+            "  -H slots    count lookup hits per prefix with slots per thread, see lpm_hit_enable()\n"
+            "  -S every    sample latency of one in every lookups by m-trie depth, see lpm_latency_enable()\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench_opt_t opt;
+    int c;
+
+    if (argc < 2) {
+        bench_usage();
+        return 1;
+    }
+
+    memset(&opt, 0, sizeof(opt));
+    opt.lookups = 20000000;
+    opt.updates = 1000000;
+    opt.seed = 1;
+    opt.budget = 256;
+    optind = 2;
+    while ((c = getopt(argc, argv, "6n:f:m:l:u:s:F:H:S:b:")) != -1) {
+        switch (c) {
+        case '6':
+            opt.ipv6 = 1;
+            break;
+        case 'n':
+            opt.routes = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            opt.text = optarg;
+            break;
+        case 'm':
+            opt.mrt = optarg;
+            break;
+        case 'l':
+            opt.lookups = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            opt.updates = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            opt.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            opt.flags = strtoul(optarg, NULL, 0);
+            break;
+        case 'H':
+            opt.hit_slots = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            opt.sample_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            opt.budget = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            bench_usage();
+            return 1;
+        }
+    }
+    if (opt.routes == 0) {
+        opt.routes = opt.ipv6 ? 200000 : 900000;
+    }
+    if (opt.lookups < BENCH_BATCH * 1000) {
+        opt.lookups = BENCH_BATCH * 1000;
+    }
+    bench_rand_state = opt.seed * 0x9E3779B97F4A7C15UL + 1;
+
+    if (strcmp(argv[1], "lookup") == 0) {
+        return bench_lookup(&opt);
+    }
+    if (strcmp(argv[1], "churn") == 0) {
+        return bench_churn(&opt);
+    }
+    if (strcmp(argv[1], "compact") == 0) {
+        return bench_compact(&opt);
+    }
+
+    bench_usage();
+
+    return 1;
+}
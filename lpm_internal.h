@@ -15,20 +15,192 @@
 #define LPM_LEVEL_MAX   16
 #define LPM_MASKLEN_MAX (LPM_LEVEL_MAX * LPM_STRIDE)
 
+/*
+ * Path-compressed 1-trie node, one node stands for one prefix (key/masklen).
+ * Chains of single-child nodes without data are skipped, so a child may be
+ * more than one bit deeper than its parent. Every non-root node has data or
+ * two children.
+ */
 typedef struct btrie_node_s {
     void *data;
     /* child[0] is left child, and child[1] is right child */
     struct btrie_node_s *child[2];
+    u32 masklen;                    /* bit position where node branches */
+    u8 key[LPM_LEVEL_MAX];          /* prefix, bits after masklen are zero */
 } btrie_node_t;
 
 /*
- * On 32-bit CPU, mtrie node is 8 bytes, mtrie block is 8 x 256 = 2KB
+ * M-trie entry layout switch. By default entry holds data pointer and sub-block pointer, mtrie
+ * node is 16 bytes on 64-bit CPU and mtrie block is 16 x 256 = 4KB. With layout switch open,
+ * entry holds 32-bit data handle and 32-bit sub-block index into replica's block region, mtrie
+ * node is 8 bytes and mtrie block is 8 x 256 = 2KB on any CPU, and blocks are position
+ * independent. Data added to the table must fit in 32 bits then.
  */
+#ifndef LPM_MTRIE_INDEX32
+#define LPM_MTRIE_INDEX32       0           /* close by default */
+#endif
+
+#if LPM_MTRIE_INDEX32
+typedef u32 mtrie_data_t;                   /* data handle */
+typedef u32 mtrie_base_t;                   /* block index, see mtrie_base() */
+#else
+typedef void *mtrie_data_t;
+typedef struct mtrie_node_s *mtrie_base_t;
+#endif
+
 typedef struct mtrie_node_s {
-    void *data;
-    struct mtrie_node_s *base;  /* sub-level mtrie table (block) base */
+    mtrie_data_t data;
+    mtrie_base_t base;          /* sub-level mtrie table (block) base */
 } mtrie_node_t;
 
+/*
+ * Sparse m-trie block, 1/8 of dense block, block pointer is tagged by MTRIE_SPARSE_TAG.
+ * Entries share slots through map, entry with sub-block always owns its slot.
+ */
+#define MTRIE_SPARSE_SLOTS  16
+#define MTRIE_SPARSE_TAG    0x1UL
+
+typedef struct mtrie_sparse_s {
+    u8 map[0x1 << 8];                       /* entry index to slot, for 8-stride */
+    mtrie_node_t slot[MTRIE_SPARSE_SLOTS];
+} mtrie_sparse_t;
+
+#define MTRIE_IS_SPARSE(base)   (((unsigned long)(base)) & MTRIE_SPARSE_TAG)
+#define MTRIE_SPARSE(base)      ((mtrie_sparse_t *)(((unsigned long)(base)) & (~MTRIE_SPARSE_TAG)))
+
+/* Entry of dense or sparse m-trie block */
+static inline mtrie_node_t *mtrie_entry(mtrie_node_t *base, u8 idx)
+{
+    mtrie_sparse_t *sparse;
+
+    if (MTRIE_IS_SPARSE(base)) {
+        sparse = MTRIE_SPARSE(base);
+        return &(sparse->slot[sparse->map[idx]]);
+    }
+
+    return base + idx;
+}
+
+/*
+ * Slab allocator for fixed size objects, eg. 1-trie nodes and m-trie blocks.
+ * Objects are carved from large slabs, released objects are linked into the free list through
+ * their first word, so allocating is only a pointer pop. Slabs are released as a whole when
+ * the slab allocator is destroyed, or kept for reuse when the slab allocator is reset.
+ * Slab size is power of 2 and slab is aligned to its size, so object finds its slab header
+ * by masking its address, which counts live objects of the slab.
+ */
+#define LPM_CACHE_LINE          64          /* cache line size in bytes */
+
+typedef struct lpm_slab_hdr_s {
+    struct lpm_slab_hdr_s *next;            /* next slab */
+    u32 live;                               /* objects quantity allocated from slab */
+    u8 pad[LPM_CACHE_LINE - sizeof(void *) - sizeof(u32)];  /* keep objects cache line aligned */
+} lpm_slab_hdr_t;
+
+typedef struct lpm_slab_s {
+    u32 obj_size;                           /* object size, at least one pointer */
+    u32 obj_per_slab;                       /* objects quantity of each slab */
+    size_t slab_size;                       /* slab size, including slab header */
+    u32 flags;                              /* LPM_SLAB_XXX */
+    void *free_list;                        /* released objects */
+    lpm_slab_hdr_t *slab_list;              /* all slabs, oldest first */
+    lpm_slab_hdr_t *slab_cur;               /* slab which objects are carved from */
+    u8 *next_obj;                           /* next never used object of current slab */
+    u8 *slab_end;                           /* end of current slab */
+    u32 slab_cnt;                           /* slabs quantity */
+    u32 slab_used;                          /* slabs quantity carved, including current slab */
+    lpm_slab_hdr_t *slab_tail;              /* newest slab */
+    u32 free_cnt;                           /* objects quantity in free list */
+    u32 huge_cnt;                           /* slabs quantity on hugetlbfs pages */
+    int numa_node;                          /* NUMA node slabs bound to, -1 for no binding */
+    struct lpm_mem_budget_s *budget;        /* memory budget slabs charged to, NULL for none */
+    lpm_allocator_t *allocator;             /* slabs allocator, NULL or no alloc for built-in */
+    struct lpm_region_s *region;            /* region slabs carved from, NULL for none */
+} lpm_slab_t;
+
+#define LPM_SLAB_HUGEPAGE       (0x1 << 0)  /* slab is one 2MB huge page */
+#define LPM_SLAB_HUGEPAGE_1G    (0x1 << 1)  /* slab is one 1GB huge page */
+#define LPM_SLAB_FIXED          (0x1 << 2)  /* slab allocator never gets more memory */
+#define LPM_SLAB_COLOR          (0x1 << 3)  /* objects are cache colored, see lpm_slab_init() */
+
+/*
+ * Memory budget shared by all slab allocators of table, getting one more slab fails when
+ * it goes beyond the limit.
+ */
+typedef struct lpm_mem_budget_s {
+    size_t limit;                           /* hard cap in bytes, 0 for no cap */
+    size_t used;                            /* bytes of all slabs */
+} lpm_mem_budget_t;
+
+#define LPM_PAGE_SIZE           (0x1UL << 12)
+#define LPM_HUGEPAGE_SIZE       (0x1UL << 21)
+#define LPM_HUGEPAGE_1G_SIZE    (0x1UL << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT          26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB            (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB            (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define LPM_BTRIE_SLAB_NODES    1024        /* 1-trie nodes per slab */
+#define LPM_MTRIE_ARENA_BLOCKS  64          /* m-trie blocks per arena (slab), about one color round */
+#define LPM_SPARSE_ARENA_BLOCKS 512         /* sparse m-trie blocks per arena (slab) */
+
+/* Reservation by expected prefixes, m-trie blocks are estimated from prefixes quantity */
+#define LPM_RESERVE_PREFIXES_PER_BLOCK  8   /* expected prefixes sharing one m-trie block */
+#define LPM_RESERVE_SPARSE_PER_DENSE    8   /* sparse blocks per dense block, LPM_TABLE_SPARSE */
+
+/*
+ * Block region of m-trie replica with LPM_MTRIE_INDEX32. Virtual address range is reserved
+ * once, slabs of replica's arenas are carved from it in order, and pages are populated when
+ * blocks are written. Block index is block's offset in region in cache lines, shifted left
+ * by one for MTRIE_SPARSE_TAG, so region addresses 128GB at most.
+ */
+typedef struct lpm_region_s {
+    u8 *base;                               /* region start, aligned to the largest slab */
+    size_t size;                            /* reserved bytes */
+    size_t used;                            /* bytes carved into slabs */
+    int shared;                             /* shared memory object mapped */
+} lpm_region_t;
+
+#define LPM_REGION_SIZE_MAX     (((size_t)0x1 << 31) * LPM_CACHE_LINE)
+
+/*
+ * M-trie replica. Table has one replica by default, or one replica per NUMA node with
+ * LPM_TABLE_NUMA_REPLICA, and all replicas are updated from the single 1-trie.
+ */
+typedef struct lpm_mtrie_s {
+    mtrie_base_t hi256_table_base;          /* m-trie base block */
+    lpm_slab_t arena;                       /* m-trie blocks arena, on replica's NUMA node */
+    lpm_slab_t sparse_arena;                /* sparse m-trie blocks arena, LPM_TABLE_SPARSE */
+    int numa_node;                          /* NUMA node of replica, -1 for no binding */
+    mtrie_base_t **compact_queue;           /* references of blocks to compact, breadth-first */
+    u32 compact_head;                       /* next block to relocate in compact_queue */
+    u32 compact_tail;                       /* blocks queued in compact_queue */
+    u32 compact_queue_max;                  /* capacity of compact_queue */
+    int compact_state;                      /* LPM_COMPACT_XXX of this round */
+    mtrie_node_t **compact_retired;         /* blocks relocated by last compacting, not released yet */
+    u32 compact_retired_cnt;                /* blocks quantity in compact_retired */
+    u32 compact_retired_max;                /* capacity of compact_retired */
+    u32 compact_moved;                      /* blocks relocated since slabs are recycled */
+    int compact_recycle;                    /* recycle slabs on releasing */
+    lpm_region_t region;                    /* blocks region, LPM_MTRIE_INDEX32 */
+} lpm_mtrie_t;
+
+#define LPM_COMPACT_IDLE        0           /* round of replica is not started */
+#define LPM_COMPACT_RUNNING     1           /* blocks are queued in compact_queue */
+#define LPM_COMPACT_DONE        2           /* replica is compacted in this round */
+
+#define LPM_NUMA_NODE_MAX       8           /* NUMA nodes (m-trie replicas) supported */
+#define LPM_MPOL_BIND           2           /* MPOL_BIND of mbind(2) */
+
+#define for_each_mtrie(table, mtrie) \
+    for ((mtrie) = &((table)->mtrie[0]); (mtrie) < &((table)->mtrie[(table)->mtrie_cnt]); (mtrie)++)
+
 /*
  * LPM table statistic structure
  */
@@ -38,28 +210,282 @@ struct lpm_lkup_table_stat {
 
     volatile int mtrie_block_alloc_stat;                /* M-trie block total allocating quantity */
     volatile u32 mtrie_block_alloc_fail_stat;           /* M-trie block alloc failure quantity */
+    volatile u32 mtrie_block_fold_stat;                 /* M-trie uniform blocks folded quantity */
+    volatile u32 mtrie_block_unfold_stat;               /* M-trie folded blocks expanded quantity */
+    volatile int mtrie_sparse_alloc_stat;               /* M-trie sparse blocks allocating quantity */
+    volatile u32 mtrie_sparse_upgrade_stat;             /* M-trie sparse blocks turned dense quantity */
+    volatile u32 mtrie_sparse_downgrade_stat;           /* M-trie dense blocks turned sparse quantity */
+    volatile u32 mtrie_block_compact_stat;              /* M-trie blocks relocated by compacting */
+    volatile unsigned long mtrie_entry_write_stat;      /* M-trie entries written, never cleared */
+    volatile unsigned long mtrie_block_alloc_total_stat;/* M-trie blocks allocated, never cleared */
+    volatile unsigned long mtrie_block_free_total_stat; /* M-trie blocks freed, never cleared */
+    lpm_write_count_t write_last;                       /* m-trie writes of the last update */
+    lpm_write_count_t write_max;                        /* m-trie writes of the worst update */
+    u8 write_max_addr[LPM_LEVEL_MAX];                   /* prefix of the worst update */
+    u32 write_max_masklen;
+    unsigned long write_updates;                        /* updates counted in write statistic */
+    unsigned long write_failed;                         /* updates failed, not counted in it */
 
     volatile int data_total;                            /* quantity of valid data stored in LPM */
     volatile u32 data_per_masklen[LPM_MASKLEN_MAX + 1]; /* data's quantity of each masklen */
 };
 
+/*
+ * Update journal of table, see lpm_journal_open(). Every successful update appends one record
+ * with one write(2), and records since the last checkpoint are replayed on the snapshot by
+ * lpm_recover(). Torn record at the tail is told by magic, sequence and checksum.
+ */
+typedef struct lpm_journal_s {
+    int fd;                                 /* journal file, -1 for no journal */
+    u32 seq;                                /* sequence of the last record since checkpoint */
+    char *snapshot;                         /* snapshot path of checkpoint */
+} lpm_journal_t;
+
+#define LPM_JOURNAL_MAGIC       0x4a4d504cU     /* "LPMJ" */
+
+typedef enum lpm_journal_op_e {
+    LPM_JOURNAL_ADD = 1,                    /* lpm_add_entry() */
+    LPM_JOURNAL_UPDATE,                     /* lpm_update_entry() */
+    LPM_JOURNAL_DEL,                        /* lpm_del_entry() */
+    LPM_JOURNAL_DEFAULT,                    /* lpm_update_default_data() */
+    LPM_JOURNAL_DEL_DEFAULT,                /* lpm_del_default_data() */
+    LPM_JOURNAL_CLEAR,                      /* lpm_clear_table() */
+} lpm_journal_op_t;
+
+typedef struct lpm_journal_rec_s {
+    u32 magic;                              /* LPM_JOURNAL_MAGIC */
+    u32 seq;                                /* 1 for the first record after checkpoint */
+    u8 op;                                  /* LPM_JOURNAL_XXX */
+    u8 masklen;
+    u16 pad;
+    u8 addr[LPM_LEVEL_MAX];                 /* prefix, bytes after masklen are zero */
+    u32 checksum;                           /* FNV-1a of record with checksum 0 */
+    uint64_t data;                          /* data value */
+} lpm_journal_rec_t;
+
+/*
+ * Hit counters of lookups, see lpm_hit_enable(). Every lookup thread counts in its own shard,
+ * a hash keyed by address bytes the lookup reads up to the entry holding matched data, which
+ * tells the matched prefix without one more lookup. Shards are merged and matched prefixes are
+ * found in 1-trie on reading.
+ */
+typedef struct lpm_hit_slot_s {
+    u8 key[LPM_LEVEL_MAX];                  /* address bytes up to matched entry, others are zero */
+    u32 depth;                              /* bytes of key, 0 for empty slot */
+    unsigned long hits;
+} lpm_hit_slot_t;
+
+typedef struct lpm_hit_shard_s {
+    struct lpm_hit_shard_s *next;           /* next shard of table */
+    void *owner;                            /* thread counting in shard */
+    u32 mask;                               /* slots - 1 */
+    u32 used;                               /* slots used */
+    unsigned long misses;                   /* lookups given default data */
+    unsigned long dropped;                  /* hits not counted when shard is full */
+    lpm_hit_slot_t slot[0];
+} lpm_hit_shard_t;
+
+typedef struct lpm_hit_s {
+    u32 slots;                              /* slots of every shard, 0 for closed */
+    unsigned long gen;                      /* generation of shards, unique in process */
+    lpm_hit_shard_t *shards;                /* shard list, pushed by lookup threads */
+} lpm_hit_t;
+
+#define LPM_HIT_CACHE           4           /* tables whose shards thread keeps at hand */
+#define LPM_HIT_LOAD(slots)     ((slots) / 4 * 3)   /* slots used at most, keeps probing short */
+
+/*
+ * Lookup latency sampling, see lpm_latency_enable(). Every lookup thread records its samples in
+ * its own shard of histograms, shards are merged on reading.
+ */
+typedef struct lpm_latency_shard_s {
+    struct lpm_latency_shard_s *next;       /* next shard of table */
+    void *owner;                            /* thread recording in shard */
+    unsigned long hist[LPM_LATENCY_DEPTH_MAX + 1][LPM_LATENCY_BUCKETS];
+} lpm_latency_shard_t;
+
+typedef struct lpm_latency_s {
+    u32 every;                              /* one in every lookups is sampled, 0 for closed */
+    unsigned long gen;                      /* generation of shards, unique in process */
+    lpm_latency_shard_t *shards;            /* shard list, pushed by lookup threads */
+} lpm_latency_t;
+
+#define LPM_LATENCY_CALIBRATE_NS    10000000    /* time stamp counter is calibrated in 10ms */
+
+/*
+ * Trace points of table mutations, see lpm_trace_set(). Prefix of the update in progress is
+ * kept in table, for trace points knowing no prefix, eg. block allocating.
+ */
+#ifndef LPM_TRACE
+#define LPM_TRACE               1           /* open by default, hooks are not set */
+#endif
+
+typedef struct lpm_trace_ctx_s {
+    u8 addr[LPM_LEVEL_MAX];                 /* prefix of update in progress, 0 out of update */
+    u32 masklen;
+} lpm_trace_ctx_t;
+
+/*
+ * Hardware performance counters of lookup and update, see lpm_perf_enable(). Every measuring
+ * thread sums counts in its own shard, shards are merged on reading.
+ */
+#ifndef LPM_PERF_EVENT
+#define LPM_PERF_EVENT          0           /* close by default */
+#endif
+
+typedef struct lpm_perf_shard_s {
+    struct lpm_perf_shard_s *next;          /* next shard of table */
+    void *owner;                            /* thread counting in shard */
+    u32 valid;                              /* bit of LPM_PERF_XXX event counted */
+    unsigned long ops[LPM_PERF_OP_MAX];
+    unsigned long count[LPM_PERF_OP_MAX][LPM_PERF_EVENT_MAX];
+} lpm_perf_shard_t;
+
+typedef struct lpm_perf_s {
+    int on;
+    unsigned long gen;                      /* generation of shards, unique in process */
+    lpm_perf_shard_t *shards;               /* shard list, pushed by measuring threads */
+} lpm_perf_t;
+
+/* Counters of calling thread, opened at its first measured operation */
+typedef struct lpm_perf_thread_s {
+    int state;                              /* 0 for not opened, 1 for opened, -1 for failure */
+    int leader;                             /* fd of group leader */
+    int fd[LPM_PERF_EVENT_MAX];             /* -1 for event not supported */
+    void *page[LPM_PERF_EVENT_MAX];         /* mmap'd perf_event_mmap_page of event, for rdpmc */
+    int rdpmc;                              /* pages of all events are mapped */
+    u32 slot[LPM_PERF_EVENT_MAX];           /* position of event in group read */
+    u32 cnt;                                /* events in group */
+    u32 valid;                              /* bit of LPM_PERF_XXX event opened */
+    unsigned long overhead[LPM_PERF_EVENT_MAX]; /* counts of reading counters twice */
+    lpm_lkup_table_t *table;                /* table of shard at hand */
+    unsigned long gen;
+    lpm_perf_shard_t *shard;                /* NULL for failing to get one */
+} lpm_perf_thread_t;
+
+#define LPM_PERF_CALIBRATE      64          /* empty measurements, least one is overhead */
+
 #define LPM_TABLE_NAME_LEN  32              /* table name string maximum length, include '\0' */
+#define LPM_SHM_NAME_LEN    64              /* shared memory object name maximum length, include '\0' */
 #define LPM_TABLE_DEFAULT_NAME "Unknown"    /* table name by default */
 
 struct lpm_lkup_table_s {
     char name[LPM_TABLE_NAME_LEN];          /* LPM table name */
 
     btrie_node_t *btrie_root;               /* b-trie root node */
-    mtrie_node_t *hi256_table_base;         /* m-trie base block */
+    lpm_slab_t btrie_slab;                  /* b-trie nodes slab allocator */
+    lpm_mtrie_t mtrie[LPM_NUMA_NODE_MAX];   /* m-trie replicas */
+    u32 mtrie_cnt;                          /* m-trie replicas quantity */
+    u8 numa_mtrie[LPM_NUMA_NODE_MAX];       /* NUMA node to local m-trie replica */
     
     void *default_data;                     /* LPM default data */
     u8 default_addr[LPM_LEVEL_MAX];         /* LPM default prefix (network) */
     u32 default_masklen;                    /* LPM default prefix's mask length */
 
+    u32 flags;                              /* LPM_TABLE_XXX creation options */
+    lpm_mem_budget_t budget;                /* memory budget of 1-trie and m-trie */
+    lpm_allocator_t allocator;              /* user allocator, no alloc for built-in */
+    u32 expected_prefixes;                  /* prefixes memory reserved for, 0 for growing */
+    char shm_name[LPM_SHM_NAME_LEN];        /* shared memory object of m-trie, "" for private */
+    struct lpm_shm_hdr_s *shm;              /* header of shared m-trie region, NULL for private */
+    lpm_journal_t journal;                  /* update journal */
+    lpm_perf_t perf;                        /* performance counters, see lpm_perf_enable() */
+    lpm_hit_t hit;                          /* hit counters, see lpm_hit_enable() */
+    lpm_latency_t latency;                  /* latency sampling, see lpm_latency_enable() */
+    lpm_trace_ctx_t trace;                  /* update traced, see lpm_trace_set() */
+    unsigned long compact_stamp;            /* blocks allocated and freed when compacting stops */
     unsigned long debug_flag;               /* LPM debug flag */
     struct lpm_lkup_table_stat stat;        /* LPM table statistic */
 };
 
+#define LPM_TABLE_SNAPSHOT      (0x1U << 31)    /* m-trie mapped from snapshot file, read-only */
+#define LPM_TABLE_ATTACHED      (0x1U << 30)    /* m-trie attached from shared memory, read-only */
+#define LPM_TABLE_READONLY      (LPM_TABLE_SNAPSHOT | LPM_TABLE_ATTACHED)
+
+/*
+ * Header of shared m-trie region, see lpm_attach_table(). It takes the first cache line of
+ * region, which is never a block. Writer process publishes root block index and default data
+ * handle here, reader processes look up from them instead of their own table control block.
+ */
+#define LPM_SHM_MAGIC           0x524d504cU     /* "LPMR" */
+#define LPM_SHM_VERSION         1
+
+typedef struct lpm_shm_hdr_s {
+    u32 magic;                              /* LPM_SHM_MAGIC, written last by writer */
+    u32 version;                            /* LPM_SHM_VERSION */
+    u32 entry_size;                         /* sizeof(mtrie_node_t) */
+    u32 sparse_size;                        /* sizeof(mtrie_sparse_t) */
+    volatile u32 root;                      /* hi256_table_base index */
+    volatile u32 default_data;              /* default data handle, 0 for none */
+    uint64_t size;                          /* region size */
+    char name[LPM_TABLE_NAME_LEN];          /* LPM table name of writer */
+} lpm_shm_hdr_t;
+
+/*
+ * Snapshot file, see lpm_save_table(). Header, prefix records in 1-trie depth first order, then
+ * m-trie region of the first replica with LPM_MTRIE_INDEX32, at LPM_SNAPSHOT_ALIGN aligned
+ * offset so that it is mapped directly. Integers are in host byte order.
+ */
+#define LPM_SNAPSHOT_MAGIC      0x534d504cU     /* "LPMS" */
+#define LPM_SNAPSHOT_VERSION    1
+#define LPM_SNAPSHOT_ALIGN      65536           /* region offset alignment, fits any page size */
+
+typedef struct lpm_snapshot_hdr_s {
+    u32 magic;                              /* LPM_SNAPSHOT_MAGIC */
+    u32 version;                            /* LPM_SNAPSHOT_VERSION */
+    char name[LPM_TABLE_NAME_LEN];          /* LPM table name */
+    u32 flags;                              /* LPM_TABLE_XXX creation options */
+    u32 prefix_cnt;                         /* prefix records quantity */
+    u32 default_masklen;                    /* LPM default prefix's mask length */
+    u32 default_valid;                      /* default data is set */
+    u8 default_addr[LPM_LEVEL_MAX];         /* LPM default prefix (network) */
+    u32 entry_size;                         /* sizeof(mtrie_node_t), 0 for no m-trie region */
+    u32 sparse_size;                        /* sizeof(mtrie_sparse_t) */
+    u32 root;                               /* hi256_table_base index */
+    u32 block_cnt;                          /* dense m-trie blocks quantity */
+    u32 sparse_cnt;                         /* sparse m-trie blocks quantity */
+    u32 pad;
+    uint64_t region_off;                    /* m-trie region offset in file */
+    uint64_t region_len;                    /* m-trie region length */
+} lpm_snapshot_hdr_t;
+
+typedef struct lpm_snapshot_prefix_s {
+    u8 addr[LPM_LEVEL_MAX];                 /* prefix, bits after masklen are zero */
+    u32 masklen;
+    u32 pad;
+    uint64_t data;                          /* data value, pointer is meaningless in other process */
+} lpm_snapshot_prefix_t;
+
+/*
+ * Chunk of text file parsed by one thread, see lpm_load_text(). Chunks smaller than
+ * LPM_LOAD_CHUNK_MIN are not worth a thread.
+ */
+#define LPM_LOAD_THREADS_MAX    64
+#define LPM_LOAD_CHUNK_MIN      (0x1 << 20)
+
+typedef struct lpm_text_chunk_s {
+    const char *start;                      /* first line */
+    const char *end;                        /* after the last line */
+    lpm_entry_t *entries;                   /* parsed prefixes */
+    u32 cnt;                                /* quantity of entries */
+    u32 size;                               /* entries allocated */
+    u32 lines;                              /* lines parsed */
+    u32 bad_line;                           /* line of parsing failure in chunk, 0 for none */
+    lpm_result_t ret;
+} lpm_text_chunk_t;
+
+/* MRT TABLE_DUMP_V2 of RFC 6396 and RFC 8050, see lpm_load_mrt(). Integers are big endian */
+#define LPM_MRT_HDR_LEN                 12      /* timestamp, type, subtype, length */
+#define LPM_MRT_TABLE_DUMP_V2           13
+#define LPM_MRT_RIB_IPV4_UNICAST        2
+#define LPM_MRT_RIB_IPV6_UNICAST        4
+#define LPM_MRT_RIB_IPV4_UNICAST_ADDPATH 8
+#define LPM_MRT_RIB_IPV6_UNICAST_ADDPATH 10
+
+#define LPM_BGP_ATTR_EXTENDED_LEN       0x10    /* attribute flag of 2 bytes length */
+#define LPM_BGP_ATTR_NEXT_HOP           3
+#define LPM_BGP_ATTR_MP_REACH_NLRI      14
+
 /* memory allocation failure simulating switch, 0 for close, and 1 for open */
 #define LPM_DEBUG_ALLOC_FAIL    0                       /* close by default */
 /* check for recursion depth */